@@ -0,0 +1,396 @@
+/*
+ *  fplay_bench.c - end-to-end throughput benchmark for fplay
+ *
+ *  Runs the real playback and capture paths of fplay (playback_go,
+ *  capture, playbackv_go, capturev_go) against a PCM that does not
+ *  block on a hardware clock (ALSA "null" by default, or e.g.
+ *  "file:'/dev/null',raw"), across a matrix of sample formats, channel
+ *  counts, rates, period sizes, access types (RW/mmap) and layouts
+ *  (interleaved or one file per channel as with -I).
+ *
+ *  Every case prints one JSON object per line on stdout:
+ *
+ *    frames_per_s          frames moved per wall-clock second
+ *    cpu_per_audio_s       CPU seconds (user+sys) per second of audio
+ *    rw_syscalls_per_period read/write syscalls per period, taken from
+ *                          /proc/self/io (ioctl/poll are not counted)
+ *    ctxsw_per_period      voluntary context switches per period
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ */
+
+#define main fplay_main
+#include "../fplay.c"
+#undef main
+
+#include <sys/resource.h>
+
+#define BENCH_MAX_LIST	16
+
+struct bench_list {
+	unsigned int n;
+	long val[BENCH_MAX_LIST];
+};
+
+struct bench_counters {
+	double wall;
+	double cpu;
+	long long syscalls;
+	long ctxsw;
+};
+
+static const char *bench_device = "null";
+static double bench_seconds = 10.0;
+
+static double ts_to_double(const struct timespec *ts)
+{
+	return ts->tv_sec + ts->tv_nsec / 1e9;
+}
+
+static double tv_to_double(const struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/* read and write syscall counts of this process, -1 if unavailable */
+static long long read_io_syscalls(void)
+{
+	FILE *f;
+	char line[128];
+	long long v, sum = 0;
+	int found = 0;
+
+	f = fopen("/proc/self/io", "r");
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "syscr: %lld", &v) == 1 ||
+		    sscanf(line, "syscw: %lld", &v) == 1) {
+			sum += v;
+			found++;
+		}
+	}
+	fclose(f);
+	return found == 2 ? sum : -1;
+}
+
+static void sample_counters(struct bench_counters *c)
+{
+	struct timespec now;
+	struct rusage ru;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	getrusage(RUSAGE_SELF, &ru);
+	c->wall = ts_to_double(&now);
+	c->cpu = tv_to_double(&ru.ru_utime) + tv_to_double(&ru.ru_stime);
+	c->ctxsw = ru.ru_nvcsw;
+	c->syscalls = read_io_syscalls();
+}
+
+static int parse_list(const char *arg, struct bench_list *list,
+		      long (*conv)(const char *))
+{
+	char *copy, *tok, *save;
+
+	list->n = 0;
+	copy = strdup(arg);
+	if (!copy)
+		return -1;
+	for (tok = strtok_r(copy, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		if (list->n >= BENCH_MAX_LIST) {
+			free(copy);
+			return -1;
+		}
+		list->val[list->n] = conv(tok);
+		if (list->val[list->n] < 0) {
+			free(copy);
+			return -1;
+		}
+		list->n++;
+	}
+	free(copy);
+	return list->n ? 0 : -1;
+}
+
+static long conv_number(const char *s)
+{
+	int err;
+	long v = parse_long(s, &err);
+
+	return err < 0 ? -1 : v;
+}
+
+static long conv_format(const char *s)
+{
+	return snd_pcm_format_value(s);
+}
+
+static long conv_access(const char *s)
+{
+	if (!strcmp(s, "rw"))
+		return 0;
+	if (!strcmp(s, "mmap"))
+		return 1;
+	return -1;
+}
+
+static long conv_layout(const char *s)
+{
+	if (!strcmp(s, "interleaved") || !strcmp(s, "i"))
+		return 1;
+	if (!strcmp(s, "separate") || !strcmp(s, "I"))
+		return 0;
+	return -1;
+}
+
+static long conv_path(const char *s)
+{
+	if (!strcmp(s, "playback"))
+		return SND_PCM_STREAM_PLAYBACK;
+	if (!strcmp(s, "capture"))
+		return SND_PCM_STREAM_CAPTURE;
+	return -1;
+}
+
+/* reset the globals that set_params() and the transfer loops modify */
+static void bench_setup(snd_pcm_stream_t dir, snd_pcm_format_t format,
+			unsigned int channels, unsigned int rate,
+			snd_pcm_uframes_t period, int use_mmap, int inter,
+			long frames)
+{
+	int err;
+
+	stream = dir;
+	rhwparams.format = format;
+	rhwparams.channels = channels;
+	rhwparams.rate = rate;
+	hwparams = rhwparams;
+	mmap_flag = use_mmap;
+	interleaved = inter;
+	period_time = 0;
+	buffer_time = 0;
+	period_frames = period;
+	buffer_frames = period * 4;
+	start_delay = dir == SND_PCM_STREAM_CAPTURE ? 1 : 0;
+	timelimit = 0;
+	sampleslimit = frames;
+	pbrec_count = LLONG_MAX;
+	fdcount = 0;
+	in_aborting = 0;
+
+	if (mmap_flag) {
+		writei_func = snd_pcm_mmap_writei;
+		readi_func = snd_pcm_mmap_readi;
+		writen_func = snd_pcm_mmap_writen;
+		readn_func = snd_pcm_mmap_readn;
+	} else {
+		writei_func = snd_pcm_writei;
+		readi_func = snd_pcm_readi;
+		writen_func = snd_pcm_writen;
+		readn_func = snd_pcm_readn;
+	}
+
+	err = snd_pcm_open(&handle, bench_device, stream, 0);
+	if (err < 0) {
+		error(_("audio open error (%s): %s"), bench_device,
+		      snd_strerror(err));
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void bench_run_case(snd_pcm_stream_t dir, snd_pcm_format_t format,
+			   unsigned int channels, unsigned int rate,
+			   snd_pcm_uframes_t period, int use_mmap, int inter)
+{
+	struct bench_counters before, after;
+	long frames = (long)(bench_seconds * rate);
+	char *names[channels];
+	int fds[channels];
+	unsigned int ch;
+	double wall, audio, periods;
+	const char *dev = dir == SND_PCM_STREAM_PLAYBACK ?
+		"/dev/zero" : "/dev/null";
+
+	bench_setup(dir, format, channels, rate, period, use_mmap, inter,
+		    frames);
+	for (ch = 0; ch < channels; ch++) {
+		names[ch] = (char *)dev;
+		fds[ch] = -1;
+	}
+
+	sample_counters(&before);
+	if (dir == SND_PCM_STREAM_PLAYBACK) {
+		if (inter) {
+			fd = open(dev, O_RDONLY);
+			if (fd < 0) {
+				perror(dev);
+				exit(EXIT_FAILURE);
+			}
+			playback_go(fd, 0, calc_count(), (char *)dev);
+			close(fd);
+			fd = -1;
+		} else {
+			for (ch = 0; ch < channels; ch++) {
+				fds[ch] = open(dev, O_RDONLY);
+				if (fds[ch] < 0) {
+					perror(dev);
+					exit(EXIT_FAILURE);
+				}
+			}
+			playbackv_go(fds, channels, 0, calc_count(), names);
+		}
+	} else {
+		if (inter) {
+			capture((char *)dev);
+		} else {
+			for (ch = 0; ch < channels; ch++) {
+				fds[ch] = open(dev, O_WRONLY);
+				if (fds[ch] < 0) {
+					perror(dev);
+					exit(EXIT_FAILURE);
+				}
+			}
+			capturev_go(fds, channels, calc_count(), names);
+		}
+	}
+	sample_counters(&after);
+
+	for (ch = 0; ch < channels; ch++)
+		if (fds[ch] >= 0)
+			close(fds[ch]);
+	snd_pcm_close(handle);
+	handle = NULL;
+
+	wall = after.wall - before.wall;
+	audio = (double)frames / rate;
+	periods = (double)frames / chunk_size;
+	printf("{\"path\":\"%s\",\"device\":\"%s\",\"format\":\"%s\","
+	       "\"channels\":%u,\"rate\":%u,\"period\":%lu,"
+	       "\"access\":\"%s\",\"layout\":\"%s\",\"frames\":%ld,"
+	       "\"wall_s\":%.6f,\"frames_per_s\":%.0f,\"cpu_s\":%.6f,"
+	       "\"cpu_per_audio_s\":%.6f,\"periods\":%.0f,",
+	       dir == SND_PCM_STREAM_PLAYBACK ?
+			(inter ? "playback_go" : "playbackv_go") :
+			(inter ? "capture" : "capturev_go"),
+	       bench_device, snd_pcm_format_name(format), channels, rate,
+	       (unsigned long)chunk_size, use_mmap ? "mmap" : "rw",
+	       inter ? "interleaved" : "separate", frames, wall,
+	       wall > 0 ? frames / wall : 0.0, after.cpu - before.cpu,
+	       (after.cpu - before.cpu) / audio, periods);
+	if (before.syscalls >= 0 && after.syscalls >= 0)
+		printf("\"rw_syscalls_per_period\":%.3f,",
+		       (after.syscalls - before.syscalls) / periods);
+	else
+		printf("\"rw_syscalls_per_period\":null,");
+	printf("\"ctxsw_per_period\":%.3f}\n",
+	       (after.ctxsw - before.ctxsw) / periods);
+	fflush(stdout);
+}
+
+static void bench_usage(void)
+{
+	printf(
+"Usage: %s [OPTION]...\n"
+"\n"
+"-h              help\n"
+"-D NAME         PCM to run against (default null)\n"
+"-t SECONDS      seconds of audio per case (default 10)\n"
+"-P LIST         paths: playback,capture\n"
+"-f LIST         formats (default S16_LE,S24_3LE,S32_LE)\n"
+"-c LIST         channel counts (default 1,2,8)\n"
+"-r LIST         rates (default 48000,192000)\n"
+"-p LIST         period sizes in frames (default 256,1024,4096)\n"
+"-m LIST         access types: rw,mmap\n"
+"-l LIST         layouts: interleaved,separate (as with -I)\n"
+"\n"
+"LIST is comma separated. One JSON object per case is written to stdout.\n",
+	       command);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_list paths, formats, channels, rates, periods, access,
+		layouts;
+	unsigned int ip, ifmt, ic, ir, ipr, ia, il;
+	int c, err;
+
+	command = "fplay_bench";
+	err = snd_output_stdio_attach(&log_out, stderr, 0);
+	assert(err >= 0);
+
+	parse_list("playback,capture", &paths, conv_path);
+	parse_list("S16_LE,S24_3LE,S32_LE", &formats, conv_format);
+	parse_list("1,2,8", &channels, conv_number);
+	parse_list("48000,192000", &rates, conv_number);
+	parse_list("256,1024,4096", &periods, conv_number);
+	parse_list("rw,mmap", &access, conv_access);
+	parse_list("interleaved,separate", &layouts, conv_layout);
+
+	while ((c = getopt(argc, argv, "hD:t:P:f:c:r:p:m:l:")) != -1) {
+		switch (c) {
+		case 'h':
+			bench_usage();
+			return 0;
+		case 'D':
+			bench_device = optarg;
+			break;
+		case 't':
+			bench_seconds = atof(optarg);
+			if (bench_seconds <= 0) {
+				error(_("invalid duration '%s'"), optarg);
+				return 1;
+			}
+			break;
+		case 'P':
+			err = parse_list(optarg, &paths, conv_path);
+			break;
+		case 'f':
+			err = parse_list(optarg, &formats, conv_format);
+			break;
+		case 'c':
+			err = parse_list(optarg, &channels, conv_number);
+			break;
+		case 'r':
+			err = parse_list(optarg, &rates, conv_number);
+			break;
+		case 'p':
+			err = parse_list(optarg, &periods, conv_number);
+			break;
+		case 'm':
+			err = parse_list(optarg, &access, conv_access);
+			break;
+		case 'l':
+			err = parse_list(optarg, &layouts, conv_layout);
+			break;
+		default:
+			bench_usage();
+			return 1;
+		}
+		if (err < 0) {
+			error(_("invalid list '%s' for -%c"), optarg, c);
+			return 1;
+		}
+	}
+
+	quiet_mode = 1;
+	for (ip = 0; ip < paths.n; ip++)
+	for (ifmt = 0; ifmt < formats.n; ifmt++)
+	for (ic = 0; ic < channels.n; ic++)
+	for (ir = 0; ir < rates.n; ir++)
+	for (ipr = 0; ipr < periods.n; ipr++)
+	for (ia = 0; ia < access.n; ia++)
+	for (il = 0; il < layouts.n; il++)
+		bench_run_case(paths.val[ip], formats.val[ifmt],
+			       channels.val[ic], rates.val[ir],
+			       periods.val[ipr], access.val[ia],
+			       layouts.val[il]);
+
+	free(audiobuf);
+	snd_output_close(log_out);
+	snd_config_update_free_global();
+	return 0;
+}
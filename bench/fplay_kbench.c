@@ -0,0 +1,354 @@
+/*
+ *  fplay_kbench.c - microbenchmarks for fplay's per-sample kernels
+ *
+ *  Times the kernels that touch every sample on synthetic buffers:
+ *  the peak scan behind compute_max_peak() for each sample width and
+ *  endianness, remap_data() for a few common channel maps, the
+ *  snd_pcm_format_set_silence() padding done by pcm_write(), the
+ *  CRC32C of the --crc32c sidecar, in hardware and in software, and the
+ *  S24_3LE packing and FLOAT_LE conversions of --file-format.
+ *
+ *  Every kernel prints one JSON object per line on stdout with the
+ *  time per sample (ns_per_sample) and the input bandwidth (gb_per_s).
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ */
+
+#define main fplay_main
+#include "../fplay.c"
+#undef main
+
+static size_t kbench_frames = 4096;
+static double kbench_min_time = 0.2;
+static volatile long kbench_sink;
+
+static double now_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* make the format the "negotiated" one, as set_params() would */
+static void kbench_format(snd_pcm_format_t format, unsigned int channels)
+{
+	hwparams.format = format;
+	hwparams.channels = channels;
+	hwparams.rate = 48000;
+	bits_per_sample = snd_pcm_format_physical_width(format);
+	significant_bits_per_sample = snd_pcm_format_width(format);
+	bits_per_frame = bits_per_sample * channels;
+	chunk_size = kbench_frames;
+	chunk_bytes = chunk_size * bits_per_frame / 8;
+}
+
+static u_char *kbench_buffer(size_t bytes)
+{
+	u_char *buf = malloc(bytes);
+	unsigned int seed = 1;
+	size_t i;
+
+	if (!buf) {
+		error(_("not enough memory"));
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < bytes; i++)
+		buf[i] = rand_r(&seed);
+	return buf;
+}
+
+static void kbench_report(const char *kernel, const char *variant,
+			  unsigned int channels, size_t samples, size_t bytes,
+			  long iterations, double elapsed)
+{
+	double total = (double)samples * iterations;
+
+	printf("{\"kernel\":\"%s\",\"variant\":\"%s\",\"channels\":%u,"
+	       "\"samples\":%zu,\"iterations\":%ld,\"ns_per_sample\":%.4f,"
+	       "\"gb_per_s\":%.3f}\n",
+	       kernel, variant, channels, samples, iterations,
+	       elapsed * 1e9 / total, bytes * (double)iterations / elapsed / 1e9);
+	fflush(stdout);
+}
+
+static void kbench_peak(snd_pcm_format_t format, int ichans)
+{
+	size_t samples = kbench_frames * ichans;
+	size_t bytes;
+	signed int max_peak[2];
+	u_char *buf;
+	long iterations = 0;
+	double start, elapsed;
+
+	kbench_format(format, ichans);
+	bytes = chunk_bytes;
+	buf = kbench_buffer(bytes);
+	start = now_seconds();
+	do {
+		if (find_max_peak(buf, samples, ichans, max_peak) < 0) {
+			free(buf);
+			return;
+		}
+		kbench_sink += max_peak[0] + max_peak[1];
+		iterations++;
+		elapsed = now_seconds() - start;
+	} while (elapsed < kbench_min_time);
+	kbench_report("peak", snd_pcm_format_name(format), ichans, samples,
+		      bytes, iterations, elapsed);
+	free(buf);
+}
+
+#ifdef CONFIG_SUPPORT_CHMAP
+static void kbench_remap(snd_pcm_format_t format, const char *name,
+			 unsigned int channels, const unsigned int *map)
+{
+	unsigned int map_copy[channels];
+	size_t bytes;
+	u_char *buf, *out;
+	long iterations = 0;
+	double start, elapsed;
+	char variant[64];
+
+	kbench_format(format, channels);
+	bytes = chunk_bytes;
+	buf = kbench_buffer(bytes);
+	memcpy(map_copy, map, sizeof(map_copy));
+	hw_map = map_copy;
+	start = now_seconds();
+	do {
+		out = remap_data(buf, kbench_frames);
+		kbench_sink += out[0];
+		iterations++;
+		elapsed = now_seconds() - start;
+	} while (elapsed < kbench_min_time);
+	hw_map = NULL;
+	snprintf(variant, sizeof(variant), "%s/%s", name,
+		 snd_pcm_format_name(format));
+	kbench_report("remap", variant, channels, kbench_frames * channels,
+		      bytes, iterations, elapsed);
+	free(buf);
+}
+#endif
+
+/* pad a short final period, as pcm_write() does before the last write */
+static void kbench_silence(snd_pcm_format_t format, unsigned int channels)
+{
+	size_t samples = kbench_frames * channels;
+	u_char *buf;
+	long iterations = 0;
+	double start, elapsed;
+
+	kbench_format(format, channels);
+	buf = kbench_buffer(chunk_bytes);
+	start = now_seconds();
+	do {
+		snd_pcm_format_set_silence(hwparams.format, buf, samples);
+		kbench_sink += buf[chunk_bytes - 1];
+		iterations++;
+		elapsed = now_seconds() - start;
+	} while (elapsed < kbench_min_time);
+	kbench_report("silence", snd_pcm_format_name(format), channels,
+		      samples, chunk_bytes, iterations, elapsed);
+	free(buf);
+}
+
+static void kbench_crc(const char *variant,
+		       uint32_t (*fn)(uint32_t, const u_char *, size_t))
+{
+	size_t bytes = kbench_frames * 4;
+	u_char *buf;
+	long iterations = 0;
+	double start, elapsed;
+
+	buf = kbench_buffer(bytes);
+	start = now_seconds();
+	do {
+		kbench_sink += fn(0, buf, bytes);
+		iterations++;
+		elapsed = now_seconds() - start;
+	} while (elapsed < kbench_min_time);
+	kbench_report("crc32c", variant, 2, kbench_frames * 2, bytes,
+		      iterations, elapsed);
+	free(buf);
+}
+
+/* --file-format=S24_3LE: pack on capture, unpack on playback */
+static void kbench_pack(snd_pcm_format_t format, int unpack)
+{
+	size_t samples = kbench_frames * 2;
+	u_char *buf, *out;
+	long iterations = 0;
+	double start, elapsed;
+
+	kbench_format(format, 2);
+	buf = kbench_buffer(chunk_bytes);
+	out = kbench_buffer(chunk_bytes);
+	start = now_seconds();
+	do {
+		if (unpack)
+			unpack_s24_3le(buf, out, samples, format);
+		else
+			pack_s24_3le(buf, out, samples, format);
+		kbench_sink += out[0];
+		iterations++;
+		elapsed = now_seconds() - start;
+	} while (elapsed < kbench_min_time);
+	kbench_report(unpack ? "unpack" : "pack", snd_pcm_format_name(format),
+		      2, samples, unpack ? samples * 3 : chunk_bytes,
+		      iterations, elapsed);
+	free(buf);
+	free(out);
+}
+
+/* --file-format=FLOAT_LE: to float on capture, from float on playback */
+static void kbench_float(snd_pcm_format_t format, int from_float)
+{
+	size_t samples = kbench_frames * 2;
+	float *fbuf = calloc(samples, sizeof(float));
+	u_char *buf;
+	long iterations = 0;
+	double start, elapsed;
+	size_t i;
+
+	kbench_format(format, 2);
+	buf = kbench_buffer(chunk_bytes);
+	if (!fbuf) {
+		error(_("not enough memory"));
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < samples; i++)
+		fbuf[i] = (i % 97) / 48.5f - 1;
+	start = now_seconds();
+	do {
+		if (from_float)
+			kbench_sink += float_to_format(fbuf, buf, samples, format);
+		else
+			meter_to_float(buf, fbuf, samples, format);
+		kbench_sink += buf[0];
+		iterations++;
+		elapsed = now_seconds() - start;
+	} while (elapsed < kbench_min_time);
+	kbench_report(from_float ? "from_float" : "to_float",
+		      snd_pcm_format_name(format), 2, samples,
+		      from_float ? samples * sizeof(float) : chunk_bytes,
+		      iterations, elapsed);
+	free(buf);
+	free(fbuf);
+}
+
+static void kbench_usage(void)
+{
+	printf(
+"Usage: %s [OPTION]...\n"
+"\n"
+"-h              help\n"
+"-n FRAMES       frames per buffer (default 4096)\n"
+"-t SECONDS      minimum time per kernel (default 0.2)\n"
+"-k LIST         kernels to run: peak,remap,silence,crc32c,pack,float\n"
+"                (default all)\n"
+"\n"
+"One JSON object per kernel and variant is written to stdout.\n",
+	       command);
+}
+
+int main(int argc, char *argv[])
+{
+	static const snd_pcm_format_t peak_formats[] = {
+		SND_PCM_FORMAT_S8, SND_PCM_FORMAT_U8,
+		SND_PCM_FORMAT_S16_LE, SND_PCM_FORMAT_S16_BE,
+		SND_PCM_FORMAT_U16_LE, SND_PCM_FORMAT_S24_3LE,
+		SND_PCM_FORMAT_S24_3BE, SND_PCM_FORMAT_S24_LE,
+		SND_PCM_FORMAT_S32_LE, SND_PCM_FORMAT_S32_BE,
+	};
+	static const snd_pcm_format_t silence_formats[] = {
+		SND_PCM_FORMAT_S16_LE, SND_PCM_FORMAT_U16_LE,
+		SND_PCM_FORMAT_S24_3LE, SND_PCM_FORMAT_S32_LE,
+		SND_PCM_FORMAT_U8,
+	};
+#ifdef CONFIG_SUPPORT_CHMAP
+	static const unsigned int map_swap[] = { 1, 0 };
+	static const unsigned int map_51[] = { 0, 1, 4, 5, 2, 3 };
+	static const unsigned int map_71[] = { 0, 1, 4, 5, 2, 3, 6, 7 };
+#endif
+	const char *kernels = "peak,remap,silence,crc32c,pack,float";
+	unsigned int i;
+	int c, err;
+
+	command = "fplay_kbench";
+	err = snd_output_stdio_attach(&log_out, stderr, 0);
+	assert(err >= 0);
+
+	while ((c = getopt(argc, argv, "hn:t:k:")) != -1) {
+		switch (c) {
+		case 'h':
+			kbench_usage();
+			return 0;
+		case 'n':
+			kbench_frames = parse_long(optarg, &err);
+			if (err < 0 || kbench_frames < 1) {
+				error(_("invalid frame count '%s'"), optarg);
+				return 1;
+			}
+			break;
+		case 't':
+			kbench_min_time = atof(optarg);
+			if (kbench_min_time <= 0) {
+				error(_("invalid time '%s'"), optarg);
+				return 1;
+			}
+			break;
+		case 'k':
+			kernels = optarg;
+			break;
+		default:
+			kbench_usage();
+			return 1;
+		}
+	}
+
+	if (strstr(kernels, "peak")) {
+		for (i = 0; i < sizeof(peak_formats) / sizeof(peak_formats[0]); i++) {
+			kbench_peak(peak_formats[i], 1);
+			kbench_peak(peak_formats[i], 2);
+		}
+	}
+#ifdef CONFIG_SUPPORT_CHMAP
+	if (strstr(kernels, "remap")) {
+		kbench_remap(SND_PCM_FORMAT_S16_LE, "swap", 2, map_swap);
+		kbench_remap(SND_PCM_FORMAT_S32_LE, "swap", 2, map_swap);
+		kbench_remap(SND_PCM_FORMAT_S16_LE, "5.1", 6, map_51);
+		kbench_remap(SND_PCM_FORMAT_S24_3LE, "5.1", 6, map_51);
+		kbench_remap(SND_PCM_FORMAT_S32_LE, "7.1", 8, map_71);
+	}
+#endif
+	if (strstr(kernels, "silence")) {
+		for (i = 0; i < sizeof(silence_formats) / sizeof(silence_formats[0]); i++)
+			kbench_silence(silence_formats[i], 2);
+	}
+	if (strstr(kernels, "crc32c")) {
+		crc32c_init();
+		if (crc32c != crc32c_sw)
+			kbench_crc("hw", crc32c);
+		kbench_crc("sw", crc32c_sw);
+	}
+	if (strstr(kernels, "pack")) {
+		kbench_pack(SND_PCM_FORMAT_S24_LE, 0);
+		kbench_pack(SND_PCM_FORMAT_S32_LE, 0);
+		kbench_pack(SND_PCM_FORMAT_S24_LE, 1);
+		kbench_pack(SND_PCM_FORMAT_S32_LE, 1);
+	}
+	if (strstr(kernels, "float")) {
+		for (i = 0; i < 2; i++) {
+			kbench_float(SND_PCM_FORMAT_S16_LE, i);
+			kbench_float(SND_PCM_FORMAT_S24_3LE, i);
+			kbench_float(SND_PCM_FORMAT_S32_LE, i);
+		}
+	}
+
+	snd_output_close(log_out);
+	return 0;
+}
@@ -28,6 +28,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 #include <getopt.h>
 #include <fcntl.h>
 #include <ctype.h>
@@ -41,10 +42,16 @@
 #include <signal.h>
 #include <poll.h>
 #include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
 #include <sys/time.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <endian.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <math.h>
 
 #define N_(x) (x)
 #define _(x) (x)
@@ -108,6 +115,8 @@ static unsigned period_time = 0;
 static unsigned buffer_time = 0;
 static snd_pcm_uframes_t period_frames = 0;
 static snd_pcm_uframes_t buffer_frames = 0;
+static unsigned req_period_time, req_buffer_time;	/* as given, for the params cache */
+static snd_pcm_uframes_t req_period_frames, req_buffer_frames;
 static int avail_min = -1;
 static int start_delay = 0;
 static int stop_delay = 0;
@@ -122,13 +131,114 @@ static size_t chunk_bytes;
 static int test_position = 0;
 static int test_coef = 8;
 static int test_nowait = 0;
-static snd_output_t *log;
+static snd_output_t *log_out;
 static long long max_file_size = 0;
 static int max_file_time = 0;
 static int use_strftime = 0;
 volatile static int recycle_capture_file = 0;
 static long term_c_lflag = -1;
 static int dump_hw_params = 0;
+static char *params_cache_name = NULL;
+static int gapless = 0;
+static char *control_socket_name = NULL;
+static int control_fd = -1;
+static char *control_output_name = NULL;	/* pending "output" command */
+static const char *cur_file_name = NULL;
+static off64_t frames_total = 0;		/* frames moved since start */
+static off64_t stop_at_frame = -1;		/* "stop" command target */
+static unsigned long xrun_count = 0;
+static int standby = 0;
+static char *standby_trigger_name = NULL;	/* fd number or path */
+static int standby_pipe[2] = { -1, -1 };
+static volatile sig_atomic_t standby_triggered = 0;
+static int standby_started = 0;
+static struct timespec standby_trigger_ts;
+static long long standby_latency_us = -1;
+static char *schedule_name = NULL;
+static int preroll_time = -1;
+static int hold_time = 5;
+static int trigger_level = 0;
+static volatile sig_atomic_t preroll_trigger = 0;
+static int blackbox_time = 0;
+static char *blackbox_range = NULL;
+static int spill_size = 0;		/* MiB */
+static char **stripe_dirs = NULL;
+static unsigned int stripe_count = 0;
+static size_t stripe_block_size = 1024 * 1024;
+static int unstripe = 0;
+static size_t crc_block_size = 0;
+static int crc_verify = 0;
+static int overview = 0;
+static int spectrum_meter = 0;
+static int spectrum_size = 1024;
+static int spectrum_decimate = 1;
+static int spectrum_rate = 10;
+static char *spectrum_shm_name = NULL;
+static int loudness_meter = 0;
+static int loudness_rate = 10;
+static char *loudness_log = NULL;
+static int histogram_meter = 0;
+static int histogram_interval = 10;
+static char *histogram_log = NULL;
+static int tone_meter = 0;
+static int tone_block_ms = 50;
+static double tone_threshold = -40.0;
+static char *tone_log = NULL;
+static int anomaly_meter = 0;
+static int clip_run_min = 3;
+static int stuck_run_min = 256;
+static int dropout_run_min = 64;
+static char *anomaly_log = NULL;
+/* clip events so far, for the VU meter; written by the meter thread */
+static volatile unsigned long anomaly_clip_events;
+static int iq_input = 0;
+static int iq_correct = 0;
+static int iq_report = 10;		/* seconds, 0 for never */
+static int decimate_factor = 1;
+static double *channel_delays = NULL;	/* frames, per channel */
+static unsigned int channel_delay_count = 0;
+static int delay_calibrate = 0;
+static unsigned int delay_reference = 0;
+static unsigned int channelize_count = 0;
+static char *channels_out = NULL;
+static snd_pcm_format_t file_format = SND_PCM_FORMAT_UNKNOWN;
+static int float_fallback = 0;
+
+enum {
+	DITHER_NONE,
+	DITHER_TPDF,		/* triangular, 2 LSB peak to peak */
+	DITHER_SHAPED,		/* TPDF with second order noise shaping */
+};
+
+static int dither_mode = DITHER_NONE;
+
+enum {
+	SPILL_DROP_NEW,		/* drop the periods that do not fit */
+	SPILL_DROP_OLD,		/* drop the oldest queued data */
+	SPILL_BLOCK,		/* wait for the disk, as without the buffer */
+};
+
+static int spill_policy = SPILL_DROP_NEW;
+
+struct spill_block;
+struct spill_close;
+
+static struct {
+	struct spill_block *head, *tail, *free;
+	struct spill_close *closes;	/* files with nothing queued */
+	unsigned int nfree;
+	size_t allocated;
+	off64_t queued;
+	off64_t dropped;
+	off64_t dropped_now;	/* since the buffer last filled up */
+	int level;		/* last threshold warned about */
+	int overflow;
+	int quit;
+	int failed;
+	pthread_t writer;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+} spill;
 
 static int fd = -1;
 static off64_t pbrec_count = LLONG_MAX, fdcount;
@@ -145,13 +255,41 @@ static unsigned int *hw_map = NULL; /* chmap to follow */
 /* needed prototypes */
 
 static void done_stdin(void);
+static int control_open(void);
+static void control_close(void);
 
 static void playback(char *filename);
+static void playback_gapless(char **filenames, unsigned int count);
 static void capture(char *filename);
+static int is_stripe_manifest(int pfd);
+static int stripe_open_reader(const char *name);
+static void stripe_extract(const char *name, const char *out);
+static int crc_verify_files(char **names, int count);
 static void playbackv(char **filenames, unsigned int count);
 static void capturev(char **filenames, unsigned int count);
+static void load_schedule(const char *filename);
+static void capture_schedule(char *filename);
+static void capture_triggered(char *filename);
+static void capture_blackbox(char *filename);
+static void blackbox_extract(const char *box, const char *out);
+static void capture_channelized(char *filename);
 
 static void suspend(void);
+static void meter_start(void);
+static void meter_stop(void);
+static void meter_push(const u_char *data, size_t frames);
+static int tones_parse(const char *list);
+static unsigned int capture_output_rate(void);
+static void file_format_check(void);
+static void playback_delay_setup(void);
+static int channel_delay_parse(const char *list);
+static void channel_delay_setup(void);
+static void channel_delay_process(float *f, size_t frames, unsigned int channels);
+static int set_fallback_format(snd_pcm_hw_params_t *params);
+static unsigned long float_to_format(const float *src, u_char *dst,
+				     size_t samples, snd_pcm_format_t format);
+static snd_pcm_format_t capture_file_format(void);
+static int meter_wanted(void);
 
 #if __GNUC__ > 2 || (__GNUC__ == 2 && __GNUC_MINOR__ >= 95)
 #define error(...) do {\
@@ -195,7 +333,8 @@ _("Usage: %s [OPTION]... [FILE]...\n"
 "                        (relative to buffer size if <= 0)\n"
 "-T, --stop-delay=#      delay for automatic PCM stop is # microseconds from xrun\n"
 "-v, --verbose           show PCM structure and setup (accumulative)\n"
-"-V, --vumeter=TYPE      enable VU meter (TYPE: mono or stereo)\n"
+"-V, --vumeter=TYPE      enable VU meter (TYPE: mono, stereo, spectrum,\n"
+"                        loudness or histogram)\n"
 "-I, --separate-channels one file for each channel\n"
 "-i, --interactive       allow interactive operation from stdin\n"
 "-m, --chmap=ch1,ch2,..  Give the channel map to override or follow\n"
@@ -213,6 +352,89 @@ _("Usage: %s [OPTION]... [FILE]...\n"
 "    --use-strftime      apply the strftime facility to the output file name\n"
 "    --dump-hw-params    dump hw_params of the device\n"
 "    --fatal-errors      treat all errors as fatal\n"
+"    --params-cache=FILE reuse hw params negotiated by earlier runs, kept in FILE\n"
+"    --gapless           play all files as one stream, without reconfiguring\n"
+"                        or draining the device between them\n"
+"    --control-socket=PATH accept rotate/pause/resume/stats/output/stop\n"
+"                        commands on a UNIX socket\n"
+"    --standby[=FD|PATH] prepare the capture, then start it on SIGUSR2, the\n"
+"                        \"start\" control command or FD/PATH becoming readable\n"
+"    --schedule=FILE     keep capturing, but write only inside the windows\n"
+"                        listed in FILE, one strftime named file per window;\n"
+"                        -d and -s limit the whole run\n"
+"    --preroll=#         keep the last # seconds in memory and write them,\n"
+"                        and what follows, on SIGUSR2, the \"trigger\" control\n"
+"                        command or --trigger-level\n"
+"    --hold=#            keep writing # seconds after the last trigger (default 5)\n"
+"    --trigger-level=#   trigger when the peak reaches # percent of full scale\n"
+"    --blackbox=#        capture into a preallocated file holding the last\n"
+"                        # seconds, overwritten in place\n"
+"    --blackbox-extract=FROM,TO\n"
+"                        copy a time range out of a black box file given as\n"
+"                        the first name to the second (default stdout);\n"
+"                        times are -SECONDS, @EPOCH or 'YYYY-MM-DD HH:MM:SS',\n"
+"                        empty for the oldest or newest sample\n"
+"    --spill-buffer=#    queue captured data in up to # MiB of memory and\n"
+"                        write it from a separate thread\n"
+"    --spill-policy=new|old|block\n"
+"                        when the spill buffer is full, drop the new data\n"
+"                        (default), the oldest queued data or wait\n"
+"    --stripe=DIR,DIR... write the capture in blocks spread round robin over\n"
+"                        one file per directory; the file name given holds a\n"
+"                        manifest that playback reassembles\n"
+"    --stripe-block=#    stripe block size in KiB (default 1024)\n"
+"    --unstripe          copy the striped capture given as first name to the\n"
+"                        second (default stdout) as one plain file\n"
+"    --crc32c[=#]        write a NAME.crc32c sidecar with the CRC32C of every\n"
+"                        # KiB block (default 1024) of each captured file\n"
+"    --verify            check the files given against their CRC32C sidecars\n"
+"    --overview          write a NAME.overview sidecar with the min, max and\n"
+"                        RMS of each captured file at three resolutions\n"
+"    --spectrum-size=#   FFT size for -V spectrum, a power of two (default 1024)\n"
+"    --spectrum-decimate=#\n"
+"                        average # frames into one before the FFT (default 1)\n"
+"    --spectrum-rate=#   spectrum lines per second (default 10)\n"
+"    --spectrum-shm=NAME export the spectrum to POSIX shared memory NAME\n"
+"                        instead of printing it\n"
+"    --loudness-rate=#   -V loudness readings per second, 1 to 10 (default 10)\n"
+"    --loudness-log=FILE append the -V loudness readings to FILE\n"
+"    --histogram-interval=#\n"
+"                        seconds between -V histogram reports (default 10)\n"
+"    --histogram-log=FILE append the -V histogram reports to FILE\n"
+"    --tones=#,#         detect tones at these frequencies (Hz) on every\n"
+"                        channel and report when they start and stop\n"
+"    --tone-block=#      detector block in ms (default 50)\n"
+"    --tone-threshold=#  tone level in dBFS that counts as present\n"
+"                        (default -40)\n"
+"    --tone-log=FILE     append the tone events to FILE\n"
+"    --anomalies         report clipping, stuck samples and dropouts\n"
+"    --clip-run=#        full scale frames in a row that count as\n"
+"                        clipping (default 3)\n"
+"    --stuck-run=#       equal non-zero frames in a row that count as a\n"
+"                        stuck sample (default 256)\n"
+"    --dropout-run=#     digital zero frames in a row that count as a\n"
+"                        dropout (default 64)\n"
+"    --anomaly-log=FILE  append the anomaly events to FILE\n"
+"    --iq                the first two channels are an I/Q pair\n"
+"    --iq-correct[=#]    remove DC offset and gain/phase imbalance from the\n"
+"                        I/Q pair before writing, report the estimates every\n"
+"                        # seconds (default 10, 0 for never)\n"
+"    --decimate=#        low pass filter and keep every #th frame, the file is\n"
+"                        written at 1/# of the capture rate\n"
+"    --channel-delay=#,# delay each channel by this many frames, fractions\n"
+"                        allowed, on capture or playback\n"
+"    --delay-calibrate[=#] measure how far each channel lags channel #\n"
+"                        (default 0) and print the matching --channel-delay\n"
+"    --channelize=#      split the I/Q pair into # channels (a power of two)\n"
+"                        and write each to NAME.chK at 1/# of the rate\n"
+"    --channels-out=#,#  the channels --channelize writes (default all),\n"
+"                        negative ones count down from the top\n"
+"    --file-format=FORMAT write the capture as S16_LE, S24_3LE or FLOAT_LE\n"
+"                        (CF32 for I/Q pairs) instead of the format of the\n"
+"                        device; on playback, expand S24_3LE files for an\n"
+"                        S24_LE or S32_LE device or convert FLOAT_LE files\n"
+"    --dither=TYPE       dither when --file-format drops bits: none (default),\n"
+"                        tpdf or shaped (TPDF with noise shaping)\n"
   )
 		, command);
 	printf(_("Recognized sample formats are:"));
@@ -349,6 +571,8 @@ static void version(void)
 static void prg_exit(int code) 
 {
 	done_stdin();
+	meter_stop();
+	control_close();
 	if (handle)
 		snd_pcm_close(handle);
 	if (pidfile_written)
@@ -376,6 +600,26 @@ static void signal_handler(int sig)
 	signal(sig, SIG_DFL);
 }
 
+/* call on SIGUSR2 signal in standby mode */
+static void signal_handler_standby(int sig)
+{
+	int saved_errno = errno;
+
+	if (!standby_triggered) {
+		clock_gettime(CLOCK_MONOTONIC, &standby_trigger_ts);
+		standby_triggered = 1;
+		if (write(standby_pipe[1], "", 1) < 0)
+			;	/* the pipe is full, a wakeup is pending anyway */
+	}
+	errno = saved_errno;
+}
+
+/* call on SIGUSR2 signal in pre-roll mode */
+static void signal_handler_trigger(int sig)
+{
+	preroll_trigger = 1;
+}
+
 /* call on SIGUSR1 signal. */
 static void signal_handler_recycle (int sig)
 {
@@ -399,6 +643,50 @@ enum {
 	OPT_USE_STRFTIME,
 	OPT_DUMP_HWPARAMS,
 	OPT_FATAL_ERRORS,
+	OPT_PARAMS_CACHE,
+	OPT_GAPLESS,
+	OPT_CONTROL_SOCKET,
+	OPT_STANDBY,
+	OPT_SCHEDULE,
+	OPT_PREROLL,
+	OPT_HOLD,
+	OPT_TRIGGER_LEVEL,
+	OPT_BLACKBOX,
+	OPT_BLACKBOX_EXTRACT,
+	OPT_SPILL_BUFFER,
+	OPT_SPILL_POLICY,
+	OPT_STRIPE,
+	OPT_STRIPE_BLOCK,
+	OPT_UNSTRIPE,
+	OPT_CRC32C,
+	OPT_VERIFY,
+	OPT_OVERVIEW,
+	OPT_SPECTRUM_SIZE,
+	OPT_SPECTRUM_DECIMATE,
+	OPT_SPECTRUM_RATE,
+	OPT_SPECTRUM_SHM,
+	OPT_LOUDNESS_RATE,
+	OPT_LOUDNESS_LOG,
+	OPT_HISTOGRAM_INTERVAL,
+	OPT_HISTOGRAM_LOG,
+	OPT_TONES,
+	OPT_TONE_BLOCK,
+	OPT_TONE_THRESHOLD,
+	OPT_TONE_LOG,
+	OPT_ANOMALIES,
+	OPT_CLIP_RUN,
+	OPT_STUCK_RUN,
+	OPT_DROPOUT_RUN,
+	OPT_ANOMALY_LOG,
+	OPT_IQ,
+	OPT_IQ_CORRECT,
+	OPT_DECIMATE,
+	OPT_CHANNEL_DELAY,
+	OPT_DELAY_CALIBRATE,
+	OPT_CHANNELIZE,
+	OPT_CHANNELS_OUT,
+	OPT_FILE_FORMAT,
+	OPT_DITHER,
 };
 
 /*
@@ -485,6 +773,50 @@ int main(int argc, char *argv[])
 		{"interactive", 0, 0, 'i'},
 		{"dump-hw-params", 0, 0, OPT_DUMP_HWPARAMS},
 		{"fatal-errors", 0, 0, OPT_FATAL_ERRORS},
+		{"params-cache", 1, 0, OPT_PARAMS_CACHE},
+		{"gapless", 0, 0, OPT_GAPLESS},
+		{"control-socket", 1, 0, OPT_CONTROL_SOCKET},
+		{"standby", 2, 0, OPT_STANDBY},
+		{"schedule", 1, 0, OPT_SCHEDULE},
+		{"preroll", 1, 0, OPT_PREROLL},
+		{"hold", 1, 0, OPT_HOLD},
+		{"trigger-level", 1, 0, OPT_TRIGGER_LEVEL},
+		{"blackbox", 1, 0, OPT_BLACKBOX},
+		{"blackbox-extract", 1, 0, OPT_BLACKBOX_EXTRACT},
+		{"spill-buffer", 1, 0, OPT_SPILL_BUFFER},
+		{"spill-policy", 1, 0, OPT_SPILL_POLICY},
+		{"stripe", 1, 0, OPT_STRIPE},
+		{"stripe-block", 1, 0, OPT_STRIPE_BLOCK},
+		{"unstripe", 0, 0, OPT_UNSTRIPE},
+		{"crc32c", 2, 0, OPT_CRC32C},
+		{"verify", 0, 0, OPT_VERIFY},
+		{"overview", 0, 0, OPT_OVERVIEW},
+		{"spectrum-size", 1, 0, OPT_SPECTRUM_SIZE},
+		{"spectrum-decimate", 1, 0, OPT_SPECTRUM_DECIMATE},
+		{"spectrum-rate", 1, 0, OPT_SPECTRUM_RATE},
+		{"spectrum-shm", 1, 0, OPT_SPECTRUM_SHM},
+		{"loudness-rate", 1, 0, OPT_LOUDNESS_RATE},
+		{"loudness-log", 1, 0, OPT_LOUDNESS_LOG},
+		{"histogram-interval", 1, 0, OPT_HISTOGRAM_INTERVAL},
+		{"histogram-log", 1, 0, OPT_HISTOGRAM_LOG},
+		{"tones", 1, 0, OPT_TONES},
+		{"tone-block", 1, 0, OPT_TONE_BLOCK},
+		{"tone-threshold", 1, 0, OPT_TONE_THRESHOLD},
+		{"tone-log", 1, 0, OPT_TONE_LOG},
+		{"anomalies", 0, 0, OPT_ANOMALIES},
+		{"clip-run", 1, 0, OPT_CLIP_RUN},
+		{"stuck-run", 1, 0, OPT_STUCK_RUN},
+		{"dropout-run", 1, 0, OPT_DROPOUT_RUN},
+		{"anomaly-log", 1, 0, OPT_ANOMALY_LOG},
+		{"iq", 0, 0, OPT_IQ},
+		{"iq-correct", 2, 0, OPT_IQ_CORRECT},
+		{"decimate", 1, 0, OPT_DECIMATE},
+		{"channel-delay", 1, 0, OPT_CHANNEL_DELAY},
+		{"delay-calibrate", 2, 0, OPT_DELAY_CALIBRATE},
+		{"channelize", 1, 0, OPT_CHANNELIZE},
+		{"channels-out", 1, 0, OPT_CHANNELS_OUT},
+		{"file-format", 1, 0, OPT_FILE_FORMAT},
+		{"dither", 1, 0, OPT_DITHER},
 #ifdef CONFIG_SUPPORT_CHMAP
 		{"chmap", 1, 0, 'm'},
 #endif
@@ -503,7 +835,7 @@ int main(int argc, char *argv[])
 
 	snd_pcm_info_alloca(&info);
 
-	err = snd_output_stdio_attach(&log, stderr, 0);
+	err = snd_output_stdio_attach(&log_out, stderr, 0);
 	assert(err >= 0);
 
 	command = argv[0];
@@ -665,7 +997,16 @@ int main(int argc, char *argv[])
 				vumeter = VUMETER_MONO;
 			break;
 		case 'V':
-			if (*optarg == 's')
+			if (!strcmp(optarg, "spectrum")) {
+				vumeter = VUMETER_NONE;
+				spectrum_meter = 1;
+			} else if (!strcmp(optarg, "loudness")) {
+				vumeter = VUMETER_NONE;
+				loudness_meter = 1;
+			} else if (!strcmp(optarg, "histogram")) {
+				vumeter = VUMETER_NONE;
+				histogram_meter = 1;
+			} else if (*optarg == 's')
 				vumeter = VUMETER_STEREO;
 			else if (*optarg == 'm')
 				vumeter = VUMETER_MONO;
@@ -736,6 +1077,290 @@ int main(int argc, char *argv[])
 		case OPT_FATAL_ERRORS:
 			fatal_errors = 1;
 			break;
+		case OPT_PARAMS_CACHE:
+			params_cache_name = optarg;
+			break;
+		case OPT_GAPLESS:
+			gapless = 1;
+			break;
+		case OPT_CONTROL_SOCKET:
+			control_socket_name = optarg;
+			break;
+		case OPT_STANDBY:
+			standby = 1;
+			standby_trigger_name = optarg;
+			break;
+		case OPT_SCHEDULE:
+			schedule_name = optarg;
+			break;
+		case OPT_PREROLL:
+			preroll_time = parse_long(optarg, &err);
+			if (err < 0 || preroll_time < 0) {
+				error(_("invalid pre-roll argument '%s'"), optarg);
+				return 1;
+			}
+			break;
+		case OPT_HOLD:
+			hold_time = parse_long(optarg, &err);
+			if (err < 0 || hold_time < 0) {
+				error(_("invalid hold argument '%s'"), optarg);
+				return 1;
+			}
+			break;
+		case OPT_TRIGGER_LEVEL:
+			trigger_level = parse_long(optarg, &err);
+			if (err < 0 || trigger_level < 1 || trigger_level > 100) {
+				error(_("invalid trigger level argument '%s'"), optarg);
+				return 1;
+			}
+			break;
+		case OPT_BLACKBOX:
+			blackbox_time = parse_long(optarg, &err);
+			if (err < 0 || blackbox_time < 1) {
+				error(_("invalid black box length '%s'"), optarg);
+				return 1;
+			}
+			break;
+		case OPT_BLACKBOX_EXTRACT:
+			blackbox_range = optarg;
+			break;
+		case OPT_SPILL_BUFFER:
+			spill_size = parse_long(optarg, &err);
+			if (err < 0 || spill_size < 1) {
+				error(_("invalid spill buffer size '%s'"), optarg);
+				return 1;
+			}
+			break;
+		case OPT_SPILL_POLICY:
+			if (!strcmp(optarg, "new"))
+				spill_policy = SPILL_DROP_NEW;
+			else if (!strcmp(optarg, "old"))
+				spill_policy = SPILL_DROP_OLD;
+			else if (!strcmp(optarg, "block"))
+				spill_policy = SPILL_BLOCK;
+			else {
+				error(_("invalid spill policy '%s'"), optarg);
+				return 1;
+			}
+			break;
+		case OPT_STRIPE: {
+			char *dir, *dirs = strdup(optarg);
+			if (!dirs) {
+				error(_("not enough memory"));
+				return 1;
+			}
+			for (dir = strtok(dirs, ","); dir; dir = strtok(NULL, ",")) {
+				stripe_dirs = realloc(stripe_dirs, (stripe_count + 1) *
+						      sizeof(*stripe_dirs));
+				if (!stripe_dirs) {
+					error(_("not enough memory"));
+					return 1;
+				}
+				stripe_dirs[stripe_count++] = dir;
+			}
+			if (!stripe_count) {
+				error(_("invalid stripe argument '%s'"), optarg);
+				return 1;
+			}
+			break;
+		}
+		case OPT_STRIPE_BLOCK:
+			tmp = parse_long(optarg, &err);
+			if (err < 0 || tmp < 4 || tmp > 1024 * 1024) {
+				error(_("invalid stripe block size '%s'"), optarg);
+				return 1;
+			}
+			stripe_block_size = (size_t)tmp * 1024;
+			break;
+		case OPT_UNSTRIPE:
+			unstripe = 1;
+			break;
+		case OPT_CRC32C:
+			tmp = optarg ? parse_long(optarg, &err) : 1024;
+			if ((optarg && err < 0) || tmp < 4 || tmp > 1024 * 1024) {
+				error(_("invalid CRC block size '%s'"), optarg);
+				return 1;
+			}
+			crc_block_size = (size_t)tmp * 1024;
+			break;
+		case OPT_VERIFY:
+			crc_verify = 1;
+			break;
+		case OPT_OVERVIEW:
+			overview = 1;
+			break;
+		case OPT_SPECTRUM_SIZE:
+			spectrum_size = parse_long(optarg, &err);
+			if (err < 0 || spectrum_size < 16 || spectrum_size > 65536 ||
+			    (spectrum_size & (spectrum_size - 1))) {
+				error(_("invalid spectrum size '%s'"), optarg);
+				return 1;
+			}
+			break;
+		case OPT_SPECTRUM_DECIMATE:
+			spectrum_decimate = parse_long(optarg, &err);
+			if (err < 0 || spectrum_decimate < 1) {
+				error(_("invalid spectrum decimation '%s'"), optarg);
+				return 1;
+			}
+			break;
+		case OPT_SPECTRUM_RATE:
+			spectrum_rate = parse_long(optarg, &err);
+			if (err < 0 || spectrum_rate < 1 || spectrum_rate > 1000) {
+				error(_("invalid spectrum rate '%s'"), optarg);
+				return 1;
+			}
+			break;
+		case OPT_LOUDNESS_RATE:
+			loudness_rate = parse_long(optarg, &err);
+			if (err < 0 || loudness_rate < 1 || loudness_rate > 10) {
+				error(_("invalid loudness rate '%s'"), optarg);
+				return 1;
+			}
+			break;
+		case OPT_LOUDNESS_LOG:
+			loudness_log = optarg;
+			break;
+		case OPT_HISTOGRAM_INTERVAL:
+			histogram_interval = parse_long(optarg, &err);
+			if (err < 0 || histogram_interval < 1) {
+				error(_("invalid histogram interval '%s'"), optarg);
+				return 1;
+			}
+			break;
+		case OPT_HISTOGRAM_LOG:
+			histogram_log = optarg;
+			break;
+		case OPT_TONES:
+			if (tones_parse(optarg) < 0) {
+				error(_("invalid tone list '%s'"), optarg);
+				return 1;
+			}
+			tone_meter = 1;
+			break;
+		case OPT_TONE_BLOCK:
+			tone_block_ms = parse_long(optarg, &err);
+			if (err < 0 || tone_block_ms < 1 || tone_block_ms > 10000) {
+				error(_("invalid tone block '%s'"), optarg);
+				return 1;
+			}
+			break;
+		case OPT_TONE_THRESHOLD: {
+			char *end;
+			tone_threshold = strtod(optarg, &end);
+			if (end == optarg || *end || !(tone_threshold <= 0) ||
+			    tone_threshold < -200) {
+				error(_("invalid tone threshold '%s'"), optarg);
+				return 1;
+			}
+			break;
+		}
+		case OPT_TONE_LOG:
+			tone_log = optarg;
+			break;
+		case OPT_ANOMALIES:
+			anomaly_meter = 1;
+			break;
+		case OPT_CLIP_RUN:
+			clip_run_min = parse_long(optarg, &err);
+			if (err < 0 || clip_run_min < 1) {
+				error(_("invalid clip run '%s'"), optarg);
+				return 1;
+			}
+			break;
+		case OPT_STUCK_RUN:
+			stuck_run_min = parse_long(optarg, &err);
+			if (err < 0 || stuck_run_min < 2) {
+				error(_("invalid stuck run '%s'"), optarg);
+				return 1;
+			}
+			break;
+		case OPT_DROPOUT_RUN:
+			dropout_run_min = parse_long(optarg, &err);
+			if (err < 0 || dropout_run_min < 1) {
+				error(_("invalid dropout run '%s'"), optarg);
+				return 1;
+			}
+			break;
+		case OPT_ANOMALY_LOG:
+			anomaly_log = optarg;
+			break;
+		case OPT_SPECTRUM_SHM:
+			spectrum_shm_name = optarg;
+			break;
+		case OPT_IQ:
+			iq_input = 1;
+			break;
+		case OPT_IQ_CORRECT:
+			iq_input = 1;
+			iq_correct = 1;
+			if (optarg) {
+				iq_report = parse_long(optarg, &err);
+				if (err < 0 || iq_report < 0) {
+					error(_("invalid IQ report interval '%s'"), optarg);
+					return 1;
+				}
+			}
+			break;
+		case OPT_DECIMATE:
+			decimate_factor = parse_long(optarg, &err);
+			if (err < 0 || decimate_factor < 1 || decimate_factor > 256) {
+				error(_("invalid decimation factor '%s'"), optarg);
+				return 1;
+			}
+			break;
+		case OPT_CHANNEL_DELAY:
+			if (channel_delay_parse(optarg) < 0) {
+				error(_("invalid channel delays '%s'"), optarg);
+				return 1;
+			}
+			break;
+		case OPT_DELAY_CALIBRATE:
+			delay_calibrate = 1;
+			if (optarg) {
+				delay_reference = parse_long(optarg, &err);
+				if (err < 0) {
+					error(_("invalid reference channel '%s'"), optarg);
+					return 1;
+				}
+			}
+			break;
+		case OPT_CHANNELIZE:
+			channelize_count = parse_long(optarg, &err);
+			if (err < 0 || channelize_count < 2 || channelize_count > 4096 ||
+			    (channelize_count & (channelize_count - 1))) {
+				error(_("invalid channel count '%s'"), optarg);
+				return 1;
+			}
+			iq_input = 1;
+			break;
+		case OPT_CHANNELS_OUT:
+			channels_out = optarg;
+			break;
+		case OPT_FILE_FORMAT:
+			if (!strcasecmp(optarg, "cf32"))
+				file_format = SND_PCM_FORMAT_FLOAT_LE;
+			else
+				file_format = snd_pcm_format_value(optarg);
+			if (file_format != SND_PCM_FORMAT_S16_LE &&
+			    file_format != SND_PCM_FORMAT_S24_3LE &&
+			    file_format != SND_PCM_FORMAT_FLOAT_LE) {
+				error(_("unsupported file format '%s'"), optarg);
+				return 1;
+			}
+			break;
+		case OPT_DITHER:
+			if (!strcmp(optarg, "none"))
+				dither_mode = DITHER_NONE;
+			else if (!strcmp(optarg, "tpdf"))
+				dither_mode = DITHER_TPDF;
+			else if (!strcmp(optarg, "shaped"))
+				dither_mode = DITHER_SHAPED;
+			else {
+				error(_("invalid dither type '%s'"), optarg);
+				return 1;
+			}
+			break;
 #ifdef CONFIG_SUPPORT_CHMAP
 		case 'm':
 			channel_map = snd_pcm_chmap_parse_string(optarg);
@@ -760,6 +1385,36 @@ int main(int argc, char *argv[])
 		goto __end;
 	}
 
+	if (crc_verify) {
+		if (optind > argc - 1) {
+			error(_("--verify needs file names"));
+			return 1;
+		}
+		if (crc_verify_files(&argv[optind], argc - optind) < 0)
+			prg_exit(EXIT_FAILURE);
+		goto __end;
+	}
+
+	if (unstripe) {
+		if (optind > argc - 1) {
+			error(_("--unstripe needs a manifest file name"));
+			return 1;
+		}
+		stripe_extract(argv[optind],
+			       optind + 1 < argc ? argv[optind + 1] : NULL);
+		goto __end;
+	}
+
+	if (blackbox_range) {
+		if (optind > argc - 1) {
+			error(_("--blackbox-extract needs a black box file name"));
+			return 1;
+		}
+		blackbox_extract(argv[optind],
+				 optind + 1 < argc ? argv[optind + 1] : NULL);
+		goto __end;
+	}
+
 	err = snd_pcm_open(&handle, pcm_name, stream, open_mode);
 	if (err < 0) {
 		error(_("audio open error: %s"), snd_strerror(err));
@@ -787,8 +1442,18 @@ int main(int argc, char *argv[])
 				"         with 8-bit sampling. Use '-f' argument to increase resolution\n"
 				"         e.g. '-f S16_LE'.\n");
 
+	if (file_format == SND_PCM_FORMAT_FLOAT_LE && !force_sample_format &&
+	    stream == SND_PCM_STREAM_PLAYBACK) {
+		rhwparams.format = SND_PCM_FORMAT_FLOAT_LE;
+		float_fallback = 1;
+	}
+
 	chunk_size = 1024;
 	hwparams = rhwparams;
+	req_period_time = period_time;
+	req_buffer_time = buffer_time;
+	req_period_frames = period_frames;
+	req_buffer_frames = buffer_frames;
 
 	audiobuf = (u_char *)malloc(1024);
 	if (audiobuf == NULL) {
@@ -822,16 +1487,92 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (control_socket_name && control_open() < 0)
+		prg_exit(EXIT_FAILURE);
+
 	signal(SIGINT, signal_handler);
 	signal(SIGTERM, signal_handler);
 	signal(SIGABRT, signal_handler);
 	signal(SIGUSR1, signal_handler_recycle);
-	if (interleaved) {
+	if (stripe_count) {
+		if (stream != SND_PCM_STREAM_CAPTURE || !interleaved ||
+		    optind > argc - 1 || !strcmp(argv[optind], "-") ||
+		    spill_size) {
+			error(_("--stripe needs an interleaved capture to named files, "
+				"without --spill-buffer"));
+			prg_exit(EXIT_FAILURE);
+		}
+	}
+	if (!interleaved && meter_wanted()) {
+		error(_("-I does not support -V spectrum, loudness or histogram, "
+			"--tones, --anomalies or --delay-calibrate"));
+		prg_exit(EXIT_FAILURE);
+	}
+	if (standby) {
+		if (stream != SND_PCM_STREAM_CAPTURE || !interleaved) {
+			error(_("--standby needs an interleaved capture"));
+			prg_exit(EXIT_FAILURE);
+		}
+		if (pipe2(standby_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+			error(_("pipe: %s"), strerror(errno));
+			prg_exit(EXIT_FAILURE);
+		}
+		signal(SIGUSR2, signal_handler_standby);
+	}
+	if ((schedule_name || preroll_time >= 0 || blackbox_time) &&
+	    (iq_correct || decimate_factor > 1 || channel_delay_count ||
+	     file_format != SND_PCM_FORMAT_UNKNOWN ||
+	     dither_mode != DITHER_NONE)) {
+		error(_("--schedule, --preroll and --blackbox do not support "
+			"--iq-correct, --decimate, --channel-delay, --file-format "
+			"or --dither"));
+		prg_exit(EXIT_FAILURE);
+	}
+	if (schedule_name) {
+		if (stream != SND_PCM_STREAM_CAPTURE || !interleaved ||
+		    argc - optind != 1 || standby) {
+			error(_("--schedule needs an interleaved capture to a single file name"));
+			prg_exit(EXIT_FAILURE);
+		}
+		load_schedule(schedule_name);
+		use_strftime = 1;
+		capture_schedule(argv[optind]);
+	} else if (preroll_time >= 0) {
+		if (stream != SND_PCM_STREAM_CAPTURE || !interleaved ||
+		    argc - optind != 1 || standby) {
+			error(_("--preroll needs an interleaved capture to a single file name"));
+			prg_exit(EXIT_FAILURE);
+		}
+		signal(SIGUSR2, signal_handler_trigger);
+		capture_triggered(argv[optind]);
+	} else if (blackbox_time) {
+		if (stream != SND_PCM_STREAM_CAPTURE || !interleaved ||
+		    argc - optind != 1 || standby) {
+			error(_("--blackbox needs an interleaved capture to a single file name"));
+			prg_exit(EXIT_FAILURE);
+		}
+		capture_blackbox(argv[optind]);
+	} else if (channelize_count) {
+		if (stream != SND_PCM_STREAM_CAPTURE || !interleaved ||
+		    argc - optind != 1 || !strcmp(argv[optind], "-") ||
+		    standby || decimate_factor > 1 || channel_delay_count ||
+		    stripe_count || spill_size || overview ||
+		    dither_mode != DITHER_NONE) {
+			error(_("--channelize needs an interleaved capture to a single "
+				"file name, without --decimate, --channel-delay, "
+				"--stripe, --spill-buffer, --overview or --dither"));
+			prg_exit(EXIT_FAILURE);
+		}
+		capture_channelized(argv[optind]);
+	} else if (interleaved) {
 		if (optind > argc - 1) {
 			if (stream == SND_PCM_STREAM_PLAYBACK)
 				playback(NULL);
 			else
 				capture(NULL);
+		} else if (gapless && stream == SND_PCM_STREAM_PLAYBACK &&
+			   argc - optind > 1) {
+			playback_gapless(&argv[optind], argc - optind);
 		} else {
 			while (optind <= argc - 1) {
 				if (stream == SND_PCM_STREAM_PLAYBACK)
@@ -852,7 +1593,7 @@ int main(int argc, char *argv[])
 	handle = NULL;
 	free(audiobuf);
       __end:
-	snd_output_close(log);
+	snd_output_close(log_out);
 	snd_config_update_free_global();
 	prg_exit(EXIT_SUCCESS);
 	/* avoid warning */
@@ -960,17 +1701,130 @@ static int setup_chmap(void)
 #define setup_chmap()	0
 #endif
 
-static void set_params(void)
-{
-	snd_pcm_hw_params_t *params;
-	snd_pcm_sw_params_t *swparams;
+/*
+ * hw params cache
+ *
+ * Negotiating hw params walks through the whole configuration space of
+ * the PCM, which is slow on some USB devices. The result is stored in
+ * params_cache_name, one line per device and requested configuration,
+ * and installed with exact values on the next start. If the device no
+ * longer accepts them, the normal negotiation is done instead. The key
+ * holds the values as requested, since negotiation overwrites them, and
+ * the entry the format actually set, which differs after a FLOAT_LE
+ * fallback.
+ */
+struct params_cache_entry {
+	snd_pcm_access_t access;
+	snd_pcm_format_t format;
+	unsigned int rate;
+	snd_pcm_uframes_t period_size;
 	snd_pcm_uframes_t buffer_size;
+};
+
+static void params_cache_key(char *key, size_t len)
+{
+	snprintf(key, len, "%s|%s|%s|%s|%u|%u|%u|%lu|%u|%lu|%d",
+		 snd_pcm_name(handle), snd_pcm_stream_name(stream),
+		 mmap_flag ? "mmap" : (interleaved ? "rw" : "rwn"),
+		 snd_pcm_format_name(hwparams.format), hwparams.channels,
+		 hwparams.rate, req_period_time, (unsigned long)req_period_frames,
+		 req_buffer_time, (unsigned long)req_buffer_frames, open_mode);
+}
+
+static int params_cache_lookup(const char *key, struct params_cache_entry *e)
+{
+	FILE *f;
+	char line[PATH_MAX + 128];
+	size_t keylen = strlen(key);
+	unsigned int access;
+	int format;
+	unsigned long period_size, buffer_size;
+	int found = -1;
+
+	f = fopen(params_cache_name, "r");
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof(line), f)) {
+		if (strncmp(line, key, keylen) || line[keylen] != '\t')
+			continue;
+		if (sscanf(line + keylen + 1, "%u %d %u %lu %lu", &access,
+			   &format, &e->rate, &period_size, &buffer_size) != 5)
+			break;
+		e->access = access;
+		e->format = format;
+		e->period_size = period_size;
+		e->buffer_size = buffer_size;
+		found = 0;
+		break;
+	}
+	fclose(f);
+	return found;
+}
+
+static void params_cache_store(const char *key,
+			       const struct params_cache_entry *e)
+{
+	FILE *in, *out;
+	char line[PATH_MAX + 128];
+	char tmpname[PATH_MAX];
+	size_t keylen = strlen(key);
+
+	snprintf(tmpname, sizeof(tmpname), "%s.%d", params_cache_name,
+		 getpid());
+	out = fopen(tmpname, "w");
+	if (!out) {
+		if (!quiet_mode)
+			fprintf(stderr, _("Warning: cannot write params cache %s: %s\n"),
+				tmpname, strerror(errno));
+		return;
+	}
+	/* keep the entries of all other devices and configurations */
+	in = fopen(params_cache_name, "r");
+	if (in) {
+		while (fgets(line, sizeof(line), in)) {
+			if (!strncmp(line, key, keylen) && line[keylen] == '\t')
+				continue;
+			fputs(line, out);
+		}
+		fclose(in);
+	}
+	fprintf(out, "%s\t%u %d %u %lu %lu\n", key, (unsigned int)e->access,
+		(int)e->format, e->rate, (unsigned long)e->period_size,
+		(unsigned long)e->buffer_size);
+	if (fclose(out) || rename(tmpname, params_cache_name)) {
+		if (!quiet_mode)
+			fprintf(stderr, _("Warning: cannot update params cache %s: %s\n"),
+				params_cache_name, strerror(errno));
+		remove(tmpname);
+	}
+}
+
+/* install cached hw params as they are, without any negotiation */
+static int set_hw_params_cached(snd_pcm_hw_params_t *params,
+				const struct params_cache_entry *e)
+{
+	/* only the FLOAT_LE fallback may end up in another format */
+	if (e->format != hwparams.format && !float_fallback)
+		return -1;
+	if (snd_pcm_hw_params_any(handle, params) < 0 ||
+	    snd_pcm_hw_params_set_access(handle, params, e->access) < 0 ||
+	    snd_pcm_hw_params_set_format(handle, params, e->format) < 0 ||
+	    snd_pcm_hw_params_set_channels(handle, params, hwparams.channels) < 0 ||
+	    snd_pcm_hw_params_set_rate(handle, params, e->rate, 0) < 0 ||
+	    snd_pcm_hw_params_set_period_size(handle, params, e->period_size, 0) < 0 ||
+	    snd_pcm_hw_params_set_buffer_size(handle, params, e->buffer_size) < 0 ||
+	    snd_pcm_hw_params(handle, params) < 0)
+		return -1;
+	hwparams.format = e->format;
+	hwparams.rate = e->rate;
+	return 0;
+}
+
+static void negotiate_hw_params(snd_pcm_hw_params_t *params)
+{
 	int err;
-	size_t n;
 	unsigned int rate;
-	snd_pcm_uframes_t start_threshold, stop_threshold;
-	snd_pcm_hw_params_alloca(&params);
-	snd_pcm_sw_params_alloca(&swparams);
+
 	err = snd_pcm_hw_params_any(handle, params);
 	if (err < 0) {
 		error(_("Broken configuration for this PCM: no configurations available"));
@@ -980,7 +1834,7 @@ static void set_params(void)
 		fprintf(stderr, _("HW Params of device \"%s\":\n"),
 			snd_pcm_name(handle));
 		fprintf(stderr, "--------------------\n");
-		snd_pcm_hw_params_dump(params, log);
+		snd_pcm_hw_params_dump(params, log_out);
 		fprintf(stderr, "--------------------\n");
 	}
 	if (mmap_flag) {
@@ -1001,6 +1855,8 @@ static void set_params(void)
 		prg_exit(EXIT_FAILURE);
 	}
 	err = snd_pcm_hw_params_set_format(handle, params, hwparams.format);
+	if (err < 0 && float_fallback)
+		err = set_fallback_format(params);
 	if (err < 0) {
 		error(_("Sample format non available"));
 		show_available_sample_formats(params);
@@ -1033,7 +1889,6 @@ static void set_params(void)
 				plugex);
 		}
 	}
-	rate = hwparams.rate;
 	if (buffer_time == 0 && buffer_frames == 0) {
 		err = snd_pcm_hw_params_get_buffer_time_max(params,
 							    &buffer_time, 0);
@@ -1062,14 +1917,45 @@ static void set_params(void)
 							     &buffer_frames);
 	}
 	assert(err >= 0);
-	monotonic = snd_pcm_hw_params_is_monotonic(params);
-	can_pause = snd_pcm_hw_params_can_pause(params);
 	err = snd_pcm_hw_params(handle, params);
 	if (err < 0) {
 		error(_("Unable to install hw params:"));
-		snd_pcm_hw_params_dump(params, log);
+		snd_pcm_hw_params_dump(params, log_out);
 		prg_exit(EXIT_FAILURE);
 	}
+}
+
+static void set_params(void)
+{
+	snd_pcm_hw_params_t *params;
+	snd_pcm_sw_params_t *swparams;
+	snd_pcm_uframes_t buffer_size;
+	int err;
+	size_t n;
+	unsigned int rate;
+	snd_pcm_uframes_t start_threshold, stop_threshold;
+	struct params_cache_entry cached;
+	char cache_key[PATH_MAX];
+	int from_cache = 0;
+	snd_pcm_hw_params_alloca(&params);
+	snd_pcm_sw_params_alloca(&swparams);
+	if (params_cache_name && !dump_hw_params) {
+		params_cache_key(cache_key, sizeof(cache_key));
+		if (params_cache_lookup(cache_key, &cached) == 0) {
+			if (set_hw_params_cached(params, &cached) == 0) {
+				from_cache = 1;
+				if (verbose)
+					fprintf(stderr, _("Using cached hw params from %s\n"),
+						params_cache_name);
+			} else if (verbose)
+				fprintf(stderr, _("Cached hw params rejected, negotiating\n"));
+		}
+	}
+	if (!from_cache)
+		negotiate_hw_params(params);
+	rate = hwparams.rate;
+	monotonic = snd_pcm_hw_params_is_monotonic(params);
+	can_pause = snd_pcm_hw_params_can_pause(params);
 	snd_pcm_hw_params_get_period_size(params, &chunk_size, 0);
 	snd_pcm_hw_params_get_buffer_size(params, &buffer_size);
 	if (chunk_size == buffer_size) {
@@ -1077,6 +1963,14 @@ static void set_params(void)
 		      chunk_size, buffer_size);
 		prg_exit(EXIT_FAILURE);
 	}
+	if (params_cache_name && !dump_hw_params && !from_cache) {
+		snd_pcm_hw_params_get_access(params, &cached.access);
+		cached.format = hwparams.format;
+		cached.rate = rate;
+		cached.period_size = chunk_size;
+		cached.buffer_size = buffer_size;
+		params_cache_store(cache_key, &cached);
+	}
 	err = snd_pcm_sw_params_current(handle, swparams);
 	if (err < 0) {
 		error(_("Unable to get current sw params."));
@@ -1106,10 +2000,19 @@ static void set_params(void)
 		stop_threshold = (double) rate * stop_delay / 1000000;
 	err = snd_pcm_sw_params_set_stop_threshold(handle, swparams, stop_threshold);
 	assert(err >= 0);
+	/*
+	 * scheduled capture maps wall clock time to frames via timestamps,
+	 * the black box dates its ring with them
+	 */
+	if (schedule_name || blackbox_time) {
+		err = snd_pcm_sw_params_set_tstamp_mode(handle, swparams,
+							SND_PCM_TSTAMP_ENABLE);
+		assert(err >= 0);
+	}
 
 	if (snd_pcm_sw_params(handle, swparams) < 0) {
 		error(_("unable to install sw params:"));
-		snd_pcm_sw_params_dump(swparams, log);
+		snd_pcm_sw_params_dump(swparams, log_out);
 		prg_exit(EXIT_FAILURE);
 	}
 
@@ -1117,7 +2020,7 @@ static void set_params(void)
 		prg_exit(EXIT_FAILURE);
 
 	if (verbose)
-		snd_pcm_dump(handle, log);
+		snd_pcm_dump(handle, log_out);
 
 	bits_per_sample = snd_pcm_format_physical_width(hwparams.format);
 	significant_bits_per_sample = snd_pcm_format_width(hwparams.format);
@@ -1153,6 +2056,9 @@ static void set_params(void)
 	}
 
 	buffer_frames = buffer_size;	/* for position test */
+	file_format_check();
+	playback_delay_setup();
+	meter_start();
 }
 
 static void init_stdin(void)
@@ -1254,20 +2160,420 @@ static void check_stdin(void)
 	}
 }
 
-#ifndef timersub
-#define	timersub(a, b, result) \
-do { \
-	(result)->tv_sec = (a)->tv_sec - (b)->tv_sec; \
-	(result)->tv_usec = (a)->tv_usec - (b)->tv_usec; \
-	if ((result)->tv_usec < 0) { \
-		--(result)->tv_sec; \
-		(result)->tv_usec += 1000000; \
-	} \
-} while (0)
-#endif
+/*
+ * control socket
+ *
+ * A UNIX stream socket accepting one command per line; every command
+ * is answered with a single "OK ..." or "ERR ..." line:
+ *
+ *   rotate        start a new capture file (same as SIGUSR1)
+ *   pause         pause the stream (needs hw pause support)
+ *   resume        release a pause
+ *   stats         report state and counters
+ *   output PATH   continue the capture in PATH, starting a new file
+ *   stop N        stop after N more frames
+ *   start         start a capture waiting in --standby
+ *   trigger       start or extend an event in --preroll mode
+ *   events        also send this client "EVENT ..." lines, e.g. from
+ *                 the --tones detectors
+ *
+ * The socket is non-blocking and is served between periods by the
+ * transfer loops, and while they wait for the PCM. Other threads queue
+ * events with control_event(); the transfer loop sends them.
+ */
+#define CONTROL_MAX_CLIENTS	4
+#define CONTROL_EVENT_QUEUE	64
 
-#ifndef timermsub
-#define	timermsub(a, b, result) \
+struct control_client {
+	int fd;
+	int events;		/* subscribed to events */
+	size_t len;
+	char buf[PATH_MAX + 16];
+};
+
+static struct control_client control_clients[CONTROL_MAX_CLIENTS];
+static int control_paused = 0;
+
+static struct {
+	pthread_mutex_t mutex;
+	char lines[CONTROL_EVENT_QUEUE][256];
+	unsigned int head, count;
+	unsigned long dropped;
+} control_events = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void control_close_client(struct control_client *cl)
+{
+	close(cl->fd);
+	cl->fd = -1;
+	cl->events = 0;
+	cl->len = 0;
+}
+
+static void control_reply(struct control_client *cl, const char *fmt, ...)
+{
+	char line[PATH_MAX + 256];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(line, sizeof(line) - 1, fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		return;
+	if (len > (int)sizeof(line) - 2)
+		len = sizeof(line) - 2;
+	line[len++] = '\n';
+	/* a client that does not read its replies is dropped */
+	if (send(cl->fd, line, len, MSG_DONTWAIT | MSG_NOSIGNAL) != len)
+		control_close_client(cl);
+}
+
+/* queue an event line for the subscribed clients, from any thread */
+static void control_event(const char *fmt, ...)
+{
+	va_list ap;
+	char *line;
+
+	if (control_fd < 0)
+		return;
+	pthread_mutex_lock(&control_events.mutex);
+	if (control_events.count == CONTROL_EVENT_QUEUE) {
+		control_events.dropped++;
+	} else {
+		line = control_events.lines[(control_events.head +
+					     control_events.count++) %
+					    CONTROL_EVENT_QUEUE];
+		va_start(ap, fmt);
+		vsnprintf(line, sizeof(control_events.lines[0]), fmt, ap);
+		va_end(ap);
+	}
+	pthread_mutex_unlock(&control_events.mutex);
+}
+
+static void control_send_events(void)
+{
+	char line[sizeof(control_events.lines[0])];
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&control_events.mutex);
+		if (!control_events.count) {
+			pthread_mutex_unlock(&control_events.mutex);
+			return;
+		}
+		memcpy(line, control_events.lines[control_events.head], sizeof(line));
+		control_events.head = (control_events.head + 1) % CONTROL_EVENT_QUEUE;
+		control_events.count--;
+		pthread_mutex_unlock(&control_events.mutex);
+		for (i = 0; i < CONTROL_MAX_CLIENTS; i++)
+			if (control_clients[i].fd >= 0 && control_clients[i].events)
+				control_reply(&control_clients[i], "EVENT %s", line);
+	}
+}
+
+static int control_open(void)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	int i, sfd;
+
+	for (i = 0; i < CONTROL_MAX_CLIENTS; i++)
+		control_clients[i].fd = -1;
+	if (strlen(control_socket_name) >= sizeof(addr.sun_path)) {
+		error(_("control socket path too long: %s"), control_socket_name);
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, control_socket_name);
+	/* replace a stale socket left by an earlier instance */
+	if (!lstat(control_socket_name, &st) && S_ISSOCK(st.st_mode))
+		remove(control_socket_name);
+	sfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sfd < 0) {
+		error(_("control socket: %s"), strerror(errno));
+		return -1;
+	}
+	if (bind(sfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(sfd, CONTROL_MAX_CLIENTS) < 0) {
+		error(_("control socket %s: %s"), control_socket_name,
+		      strerror(errno));
+		close(sfd);
+		return -1;
+	}
+	control_fd = sfd;
+	return 0;
+}
+
+static void control_close(void)
+{
+	int i;
+
+	if (control_fd < 0)
+		return;
+	for (i = 0; i < CONTROL_MAX_CLIENTS; i++)
+		if (control_clients[i].fd >= 0)
+			control_close_client(&control_clients[i]);
+	close(control_fd);
+	control_fd = -1;
+	remove(control_socket_name);
+}
+
+/* frames that may still be transferred before a "stop" command, or -1 */
+static off64_t control_frames_left(void)
+{
+	if (stop_at_frame < 0)
+		return -1;
+	return stop_at_frame > frames_total ? stop_at_frame - frames_total : 0;
+}
+
+static void control_command(struct control_client *cl, char *cmd)
+{
+	char *arg;
+	int err;
+
+	arg = strchr(cmd, ' ');
+	if (arg) {
+		*arg++ = 0;
+		while (*arg == ' ')
+			arg++;
+	}
+	if (!strcmp(cmd, "rotate")) {
+		if (stream != SND_PCM_STREAM_CAPTURE || !interleaved) {
+			control_reply(cl, "ERR rotate needs an interleaved capture");
+			return;
+		}
+		recycle_capture_file = 1;
+		control_reply(cl, "OK");
+	} else if (!strcmp(cmd, "pause") || !strcmp(cmd, "resume")) {
+		int enable = cmd[0] == 'p';
+		if (!can_pause) {
+			control_reply(cl, "ERR no hw pause support");
+			return;
+		}
+		if (enable == control_paused) {
+			control_reply(cl, "OK");
+			return;
+		}
+		if (snd_pcm_state(handle) == SND_PCM_STATE_SUSPENDED)
+			suspend();
+		err = snd_pcm_pause(handle, enable);
+		if (err < 0) {
+			control_reply(cl, "ERR %s", snd_strerror(err));
+			return;
+		}
+		control_paused = enable;
+		control_reply(cl, "OK");
+	} else if (!strcmp(cmd, "stats")) {
+		/*
+		 * Commands run on the capture thread, which alone sets
+		 * cur_file_name and fdcount; the spill counters are shared
+		 * with the spill writer.
+		 */
+		long long spill_queued = 0, spill_dropped = 0;
+		if (spill_size) {
+			pthread_mutex_lock(&spill.mutex);
+			spill_queued = spill.queued;
+			spill_dropped = spill.dropped;
+			pthread_mutex_unlock(&spill.mutex);
+		}
+		control_reply(cl, "OK state=%s paused=%d frames=%lld rate=%u "
+			      "channels=%u format=%s file=%s file_bytes=%lld "
+			      "xruns=%lu trigger_latency_us=%lld "
+			      "spill_bytes=%lld spill_dropped=%lld",
+			      snd_pcm_state_name(snd_pcm_state(handle)),
+			      control_paused, (long long)frames_total,
+			      hwparams.rate, hwparams.channels,
+			      snd_pcm_format_name(hwparams.format),
+			      cur_file_name ? cur_file_name : "-",
+			      (long long)fdcount, xrun_count,
+			      standby_latency_us, spill_queued, spill_dropped);
+	} else if (!strcmp(cmd, "output")) {
+		if (stream != SND_PCM_STREAM_CAPTURE || !interleaved) {
+			control_reply(cl, "ERR output needs an interleaved capture");
+			return;
+		}
+		if (!arg || !*arg) {
+			control_reply(cl, "ERR missing path");
+			return;
+		}
+		free(control_output_name);
+		control_output_name = strdup(arg);
+		if (!control_output_name) {
+			control_reply(cl, "ERR not enough memory");
+			return;
+		}
+		recycle_capture_file = 1;
+		control_reply(cl, "OK");
+	} else if (!strcmp(cmd, "start")) {
+		if (!standby || standby_triggered) {
+			control_reply(cl, "ERR not in standby");
+			return;
+		}
+		standby_triggered = 1;
+		control_reply(cl, "OK");
+	} else if (!strcmp(cmd, "trigger")) {
+		if (preroll_time < 0) {
+			control_reply(cl, "ERR not in pre-roll mode");
+			return;
+		}
+		preroll_trigger = 1;
+		control_reply(cl, "OK");
+	} else if (!strcmp(cmd, "events")) {
+		cl->events = 1;
+		control_reply(cl, "OK");
+	} else if (!strcmp(cmd, "stop")) {
+		long frames = arg ? parse_long(arg, &err) : -1;
+		if (!arg || err < 0 || frames < 0) {
+			control_reply(cl, "ERR invalid frame count");
+			return;
+		}
+		stop_at_frame = frames_total + frames;
+		control_reply(cl, "OK stop_at=%lld", (long long)stop_at_frame);
+	} else {
+		control_reply(cl, "ERR unknown command '%s'", cmd);
+	}
+}
+
+static void control_read_client(struct control_client *cl)
+{
+	ssize_t r;
+	char *nl;
+
+	r = recv(cl->fd, cl->buf + cl->len, sizeof(cl->buf) - 1 - cl->len,
+		 MSG_DONTWAIT);
+	if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR)) {
+		control_close_client(cl);
+		return;
+	}
+	if (r < 0)
+		return;
+	cl->len += r;
+	cl->buf[cl->len] = 0;
+	while (cl->fd >= 0 && (nl = strchr(cl->buf, '\n')) != NULL) {
+		size_t used = nl + 1 - cl->buf;
+		*nl = 0;
+		if (nl > cl->buf && nl[-1] == '\r')
+			nl[-1] = 0;
+		if (cl->buf[0])
+			control_command(cl, cl->buf);
+		if (cl->fd < 0)
+			return;
+		cl->len -= used;
+		memmove(cl->buf, cl->buf + used, cl->len + 1);
+	}
+	if (cl->len == sizeof(cl->buf) - 1) {
+		control_reply(cl, "ERR line too long");
+		if (cl->fd >= 0)
+			control_close_client(cl);
+	}
+}
+
+/* add the listening socket and all clients to a poll set */
+static int control_poll_fds(struct pollfd *pfds)
+{
+	int i, n = 0;
+
+	if (control_fd < 0)
+		return 0;
+	pfds[n].fd = control_fd;
+	pfds[n].events = POLLIN;
+	pfds[n++].revents = 0;
+	for (i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+		if (control_clients[i].fd < 0)
+			continue;
+		pfds[n].fd = control_clients[i].fd;
+		pfds[n].events = POLLIN;
+		pfds[n++].revents = 0;
+	}
+	return n;
+}
+
+static void control_handle(struct pollfd *pfds, int n)
+{
+	int i, j, cfd;
+
+	for (i = 0; i < n; i++) {
+		if (!pfds[i].revents)
+			continue;
+		if (pfds[i].fd == control_fd) {
+			cfd = accept4(control_fd, NULL, NULL,
+				      SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if (cfd < 0)
+				continue;
+			for (j = 0; j < CONTROL_MAX_CLIENTS; j++)
+				if (control_clients[j].fd < 0)
+					break;
+			if (j == CONTROL_MAX_CLIENTS) {
+				close(cfd);
+				continue;
+			}
+			control_clients[j].fd = cfd;
+			control_clients[j].events = 0;
+			control_clients[j].len = 0;
+			continue;
+		}
+		for (j = 0; j < CONTROL_MAX_CLIENTS; j++)
+			if (control_clients[j].fd == pfds[i].fd)
+				control_read_client(&control_clients[j]);
+	}
+}
+
+static void check_control(void)
+{
+	struct pollfd pfds[CONTROL_MAX_CLIENTS + 1];
+	int n;
+
+	if (control_fd < 0)
+		return;
+	control_send_events();
+	do {
+		n = control_poll_fds(pfds);
+		/* while paused there is nothing to do but wait for commands */
+		if (poll(pfds, n, control_paused ? 1000 : 0) > 0)
+			control_handle(pfds, n);
+	} while (control_paused && !in_aborting);
+}
+
+/* wait for the PCM, serving the control socket meanwhile */
+static void pcm_wait(void)
+{
+	struct pollfd *pfds;
+	unsigned short revents;
+	int count, n;
+
+	if (test_nowait)
+		return;
+	count = snd_pcm_poll_descriptors_count(handle);
+	if (control_fd < 0 || count <= 0) {
+		snd_pcm_wait(handle, 100);
+		return;
+	}
+	pfds = alloca(sizeof(*pfds) * (count + CONTROL_MAX_CLIENTS + 1));
+	count = snd_pcm_poll_descriptors(handle, pfds, count);
+	n = control_poll_fds(pfds + count);
+	if (poll(pfds, count + n, 100) <= 0)
+		return;
+	control_handle(pfds + count, n);
+	snd_pcm_poll_descriptors_revents(handle, pfds, count, &revents);
+}
+
+#ifndef timersub
+#define	timersub(a, b, result) \
+do { \
+	(result)->tv_sec = (a)->tv_sec - (b)->tv_sec; \
+	(result)->tv_usec = (a)->tv_usec - (b)->tv_usec; \
+	if ((result)->tv_usec < 0) { \
+		--(result)->tv_sec; \
+		(result)->tv_usec += 1000000; \
+	} \
+} while (0)
+#endif
+
+#ifndef timermsub
+#define	timermsub(a, b, result) \
 do { \
 	(result)->tv_sec = (a)->tv_sec - (b)->tv_sec; \
 	(result)->tv_nsec = (a)->tv_nsec - (b)->tv_nsec; \
@@ -1278,6 +2584,118 @@ do { \
 } while (0)
 #endif
 
+/*
+ * warm standby
+ *
+ * The PCM is configured and prepared, the output file is open and all
+ * memory is locked before waiting for a trigger (SIGUSR2, the "start"
+ * control command, or standby_trigger_name becoming readable), so that
+ * starting the stream is a single snd_pcm_start() call.
+ */
+static void standby_prefault(void)
+{
+	/* touch the transfer buffer so the first period takes no page faults */
+	memset(audiobuf, 0, chunk_bytes);
+	/* all buffers exist by now, later mappings need not be pinned */
+	if (mlockall(MCL_CURRENT) < 0 && !quiet_mode)
+		fprintf(stderr, _("Warning: cannot lock memory: %s\n"),
+			strerror(errno));
+}
+
+/* the trigger fd, opened here when given as a path (*opened is set) */
+static int standby_open_trigger(int *opened)
+{
+	int err, tfd;
+
+	*opened = 0;
+	if (!standby_trigger_name)
+		return -1;
+	tfd = parse_long(standby_trigger_name, &err);
+	if (err < 0) {
+		tfd = open(standby_trigger_name, O_RDONLY | O_NONBLOCK);
+		if (tfd < 0) {
+			perror(standby_trigger_name);
+			prg_exit(EXIT_FAILURE);
+		}
+		*opened = 1;
+	}
+	return tfd;
+}
+
+/*
+ * trigger to stream start latency, taken right after snd_pcm_start();
+ * the first read returns a period later, which is not part of it
+ */
+static void standby_report(void)
+{
+	struct timespec now, diff;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timermsub(&now, &standby_trigger_ts, &diff);
+	standby_latency_us = diff.tv_sec * 1000000LL + diff.tv_nsec / 1000;
+	if (!quiet_mode)
+		fprintf(stderr, _("Trigger to stream start: %.3f ms\n"),
+			standby_latency_us / 1000.0);
+}
+
+static void standby_wait(void)
+{
+	struct pollfd pfds[CONTROL_MAX_CLIENTS + 3];
+	const char *source = NULL;
+	char b;
+	int tfd, opened, n, m, err;
+
+	standby_started = 1;
+	standby_prefault();
+	tfd = standby_open_trigger(&opened);
+	if (!quiet_mode) {
+		fprintf(stderr, _("Standby, waiting for trigger...\n"));
+		fflush(stderr);
+	}
+	while (!source && !in_aborting) {
+		n = 0;
+		pfds[n].fd = standby_pipe[0];
+		pfds[n++].events = POLLIN;
+		if (tfd >= 0) {
+			pfds[n].fd = tfd;
+			pfds[n++].events = POLLIN | POLLPRI;
+		}
+		m = control_poll_fds(pfds + n);
+		if (poll(pfds, n + m, -1) <= 0)
+			continue;
+		if (pfds[0].revents) {
+			/* the signal handler has stored the trigger time */
+			while (read(standby_pipe[0], &b, 1) == 1)
+				;
+			source = "signal";
+			break;
+		}
+		if (tfd >= 0 && pfds[1].revents) {
+			clock_gettime(CLOCK_MONOTONIC, &standby_trigger_ts);
+			source = standby_trigger_name;
+			break;
+		}
+		control_handle(pfds + n, m);
+		if (standby_triggered) {
+			clock_gettime(CLOCK_MONOTONIC, &standby_trigger_ts);
+			source = "control socket";
+		}
+	}
+	if (opened)
+		close(tfd);
+	if (in_aborting)
+		return;
+	standby_triggered = 1;
+	err = snd_pcm_start(handle);
+	if (err < 0) {
+		error(_("standby start error: %s"), snd_strerror(err));
+		prg_exit(EXIT_FAILURE);
+	}
+	standby_report();
+	if (verbose)
+		fprintf(stderr, _("Triggered by %s\n"), source);
+}
+
 /* I/O error handler */
 static void xrun(void)
 {
@@ -1290,6 +2708,7 @@ static void xrun(void)
 		prg_exit(EXIT_FAILURE);
 	}
 	if (snd_pcm_status_get_state(status) == SND_PCM_STATE_XRUN) {
+		xrun_count++;
 		if (fatal_errors) {
 			error(_("fatal %s: %s"),
 					stream == SND_PCM_STREAM_PLAYBACK ? _("underrun") : _("overrun"),
@@ -1319,7 +2738,7 @@ static void xrun(void)
 		}
 		if (verbose) {
 			fprintf(stderr, _("Status:\n"));
-			snd_pcm_status_dump(status, log);
+			snd_pcm_status_dump(status, log_out);
 		}
 		if ((res = snd_pcm_prepare(handle))<0) {
 			error(_("xrun: prepare error: %s"), snd_strerror(res));
@@ -1330,7 +2749,7 @@ static void xrun(void)
 	if (snd_pcm_status_get_state(status) == SND_PCM_STATE_DRAINING) {
 		if (verbose) {
 			fprintf(stderr, _("Status(DRAINING):\n"));
-			snd_pcm_status_dump(status, log);
+			snd_pcm_status_dump(status, log_out);
 		}
 		if (stream == SND_PCM_STREAM_CAPTURE) {
 			fprintf(stderr, _("capture stream format change? attempting recover...\n"));
@@ -1343,7 +2762,7 @@ static void xrun(void)
 	}
 	if (verbose) {
 		fprintf(stderr, _("Status(R/W):\n"));
-		snd_pcm_status_dump(status, log);
+		snd_pcm_status_dump(status, log_out);
 	}
 	error(_("read/write error, state = %s"), snd_pcm_state_name(snd_pcm_status_get_state(status)));
 	prg_exit(EXIT_FAILURE);
@@ -1392,6 +2811,8 @@ static void print_vu_meter_mono(int perc, int maxperc)
 	fputs(line, stderr);
 	if (perc > 100)
 		fprintf(stderr, _(" !clip  "));
+	else if (anomaly_clip_events)
+		fprintf(stderr, _(" %lu clip(s)"), anomaly_clip_events);
 }
 
 static void print_vu_meter_stereo(int *perc, int *maxperc)
@@ -1442,21 +2863,19 @@ static void print_vu_meter(signed int *perc, signed int *maxperc)
 		print_vu_meter_mono(*perc, *maxperc);
 }
 
-/* peak handler */
-static void compute_max_peak(u_char *data, size_t samples)
+/*
+ * peak scan: store the largest absolute sample value into max_peak[0]
+ * (and max_peak[1] for odd samples when ichans is 2); returns -1 for
+ * sample widths it cannot handle
+ */
+static int find_max_peak(u_char *data, size_t samples, int ichans,
+			 signed int *max_peak)
 {
-	signed int val, max, perc[2], max_peak[2];
-	static int run = 0;
-	size_t osamples = samples;
+	signed int val;
 	int format_little_endian = snd_pcm_format_little_endian(hwparams.format);
-	int ichans, c;
-
-	if (vumeter == VUMETER_STEREO)
-		ichans = 2;
-	else
-		ichans = 1;
+	int c;
 
-	memset(max_peak, 0, sizeof(max_peak));
+	max_peak[0] = max_peak[1] = 0;
 	switch (bits_per_sample) {
 	case 8: {
 		signed char *valp = (signed char *)data;
@@ -1467,7 +2886,7 @@ static void compute_max_peak(u_char *data, size_t samples)
 			val = abs(val);
 			if (max_peak[c] < val)
 				max_peak[c] = val;
-			if (vumeter == VUMETER_STEREO)
+			if (ichans == 2)
 				c = !c;
 		}
 		break;
@@ -1488,7 +2907,7 @@ static void compute_max_peak(u_char *data, size_t samples)
 			if (max_peak[c] < val)
 				max_peak[c] = val;
 			valp++;
-			if (vumeter == VUMETER_STEREO)
+			if (ichans == 2)
 				c = !c;
 		}
 		break;
@@ -1513,7 +2932,7 @@ static void compute_max_peak(u_char *data, size_t samples)
 			if (max_peak[c] < val)
 				max_peak[c] = val;
 			valp += 3;
-			if (vumeter == VUMETER_STEREO)
+			if (ichans == 2)
 				c = !c;
 		}
 		break;
@@ -1536,12 +2955,31 @@ static void compute_max_peak(u_char *data, size_t samples)
 			if (max_peak[c] < val)
 				max_peak[c] = val;
 			valp++;
-			if (vumeter == VUMETER_STEREO)
+			if (ichans == 2)
 				c = !c;
 		}
 		break;
 	}
 	default:
+		return -1;
+	}
+	return 0;
+}
+
+/* peak handler */
+static void compute_max_peak(u_char *data, size_t samples)
+{
+	signed int val, max, perc[2], max_peak[2];
+	static int run = 0;
+	size_t osamples = samples;
+	int ichans, c;
+
+	if (vumeter == VUMETER_STEREO)
+		ichans = 2;
+	else
+		ichans = 1;
+
+	if (find_max_peak(data, samples, ichans, max_peak) < 0) {
 		if (run == 0) {
 			fprintf(stderr, _("Unsupported bit size %d.\n"), (int)bits_per_sample);
 			run = 1;
@@ -1590,771 +3028,6088 @@ static void compute_max_peak(u_char *data, size_t samples)
 	}
 }
 
-static void do_test_position(void)
-{
-	static long counter = 0;
-	static time_t tmr = -1;
-	time_t now;
-	static float availsum, delaysum, samples;
-	static snd_pcm_sframes_t maxavail, maxdelay;
-	static snd_pcm_sframes_t minavail, mindelay;
-	static snd_pcm_sframes_t badavail = 0, baddelay = 0;
-	snd_pcm_sframes_t outofrange;
-	snd_pcm_sframes_t avail, delay, savail, sdelay;
-	snd_pcm_status_t *status;
-	int err;
+/*
+ *  metering thread
+ *
+ *  Meters heavier than the peak scan run on a thread of their own.
+ *  pcm_read() and pcm_write() only copy each transferred block into a
+ *  lock-free single producer, single consumer ring; the metering thread
+ *  polls the ring every METER_POLL_MS, converts the frames to float and
+ *  hands them to every enabled meter. Nothing on the I/O path waits for
+ *  the meters: when the ring is full the block is dropped and counted.
+ */
 
-	snd_pcm_status_alloca(&status);
-	err = snd_pcm_avail_delay(handle, &avail, &delay);
-	if (err < 0)
+#define METER_POLL_MS	10
+#define METER_BLOCK	4096	/* frames converted at a time */
+
+struct meter {
+	int *enabled;
+	void (*start)(void);
+	void (*process)(const float *frames, size_t count);
+	void (*stop)(void);
+};
+
+static struct {
+	u_char *buf;
+	size_t frame_bytes;
+	size_t capacity;	/* frames, a power of two */
+	size_t write_pos;	/* frames pushed, owned by the I/O thread */
+	size_t read_pos;	/* frames consumed, owned by the meter thread */
+	float *fbuf;		/* METER_BLOCK frames converted, meter thread */
+	unsigned long dropped;
+	snd_pcm_format_t format;
+	unsigned int channels;
+	unsigned int rate;
+	int running;
+	int quit;
+	pthread_t thread;
+} meter_ring;
+
+/*
+ * Convert samples to floats in [-1, 1). Linear formats of up to 32 bits
+ * and FLOAT_LE/BE are handled, see meter_format_ok().
+ */
+static void meter_to_float(const u_char *src, float *dst, size_t samples,
+			   snd_pcm_format_t format)
+{
+	int phys = snd_pcm_format_physical_width(format) / 8;
+	int width = snd_pcm_format_width(format);
+	int little = snd_pcm_format_little_endian(format);
+	uint32_t flip = snd_pcm_format_unsigned(format) ? 1U << (width - 1) : 0;
+	int shift = 32 - width;
+	int is_float = snd_pcm_format_float(format);
+	float scale = 1.0f / 2147483648.0f;
+	uint32_t v;
+	int32_t s;
+	size_t i;
+
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+	/* the common formats as plain loops the compiler can vectorize */
+	if (format == SND_PCM_FORMAT_S16_LE) {
+		const int16_t *s16 = (const int16_t *)src;
+		for (i = 0; i < samples; i++)
+			dst[i] = s16[i] * (1.0f / 32768.0f);
 		return;
-	err = snd_pcm_status(handle, status);
-	if (err < 0)
+	}
+	if (format == SND_PCM_FORMAT_S32_LE) {
+		const int32_t *s32 = (const int32_t *)src;
+		for (i = 0; i < samples; i++)
+			dst[i] = s32[i] * scale;
 		return;
-	savail = snd_pcm_status_get_avail(status);
-	sdelay = snd_pcm_status_get_delay(status);
-	outofrange = (test_coef * (snd_pcm_sframes_t)buffer_frames) / 2;
-	if (avail > outofrange || avail < -outofrange ||
-	    delay > outofrange || delay < -outofrange) {
-		badavail = avail; baddelay = delay;
-		availsum = delaysum = samples = 0;
-		maxavail = maxdelay = 0;
-		minavail = mindelay = buffer_frames * 16;
-		fprintf(stderr, _("Suspicious buffer position (%li total): "
-			"avail = %li, delay = %li, buffer = %li\n"),
-			++counter, (long)avail, (long)delay, (long)buffer_frames);
-	} else if (savail > outofrange || savail < -outofrange ||
-		   sdelay > outofrange || sdelay < -outofrange) {
-		badavail = savail; baddelay = sdelay;
-		availsum = delaysum = samples = 0;
-		maxavail = maxdelay = 0;
-		minavail = mindelay = buffer_frames * 16;
-		fprintf(stderr, _("Suspicious status buffer position (%li total): "
-			"avail = %li, delay = %li, buffer = %li\n"),
-			++counter, (long)savail, (long)sdelay, (long)buffer_frames);
-	} else if (stream == SND_PCM_STREAM_CAPTURE && avail > delay) {
-		fprintf(stderr, _("Suspicious buffer position avail > delay (%li total): "
-			"avail = %li, delay = %li\n"),
-			++counter, (long)avail, (long)delay);
-	} else if (stream == SND_PCM_STREAM_CAPTURE && savail > sdelay) {
-		fprintf(stderr, _("Suspicious status buffer position avail > delay (%li total): "
-			"avail = %li, delay = %li\n"),
-			++counter, (long)savail, (long)sdelay);
-	} else if (verbose) {
-		time(&now);
-		if (tmr == (time_t) -1) {
-			tmr = now;
-			availsum = delaysum = samples = 0;
-			maxavail = maxdelay = 0;
-			minavail = mindelay = buffer_frames * 16;
+	}
+	if (format == SND_PCM_FORMAT_FLOAT_LE) {
+		memcpy(dst, src, samples * sizeof(float));
+		return;
+	}
+#endif
+	while (samples-- > 0) {
+		switch (phys) {
+		case 1:
+			v = src[0];
+			break;
+		case 2:
+			v = little ? src[0] | src[1] << 8 : src[0] << 8 | src[1];
+			break;
+		case 3:
+			v = little ? src[0] | src[1] << 8 | src[2] << 16 :
+				src[0] << 16 | src[1] << 8 | src[2];
+			break;
+		default:
+			v = little ? src[0] | src[1] << 8 | src[2] << 16 |
+				(uint32_t)src[3] << 24 :
+				(uint32_t)src[0] << 24 | src[1] << 16 |
+				src[2] << 8 | src[3];
+			break;
 		}
-		if (avail > maxavail)
-			maxavail = avail;
-		if (savail > maxavail)
-			maxavail = savail;
-		if (delay > maxdelay)
-			maxdelay = delay;
-		if (sdelay > maxdelay)
-			maxdelay = sdelay;
-		if (avail < minavail)
-			minavail = avail;
-		if (savail < minavail)
-			minavail = savail;
-		if (delay < mindelay)
-			mindelay = delay;
-		if (sdelay < mindelay)
-			mindelay = sdelay;
-		availsum += avail;
-		delaysum += delay;
-		samples++;
-		if ((maxavail != 0 || maxdelay != 0) && now != tmr) {
-			fprintf(stderr, "BUFPOS: avg%li/%li "
-				"min%li/%li max%li/%li (%li) (%li:%li/%li)\n",
-                         (long)(availsum / samples),
-				(long)(delaysum / samples),
-				(long)minavail, (long)mindelay,
-				(long)maxavail, (long)maxdelay,
-				(long)buffer_frames,
-				counter, badavail, baddelay);
-			tmr = now;
+		src += phys;
+		if (is_float) {
+			memcpy(dst++, &v, sizeof(float));
+			continue;
 		}
+		/* sign extend from the sample width, via the top bits */
+		s = (int32_t)((v ^ flip) << shift);
+		*dst++ = s * scale;
 	}
-	if (verbose == 1) {
-		fprintf(stderr, _("Status(R/W) (standalone avail=%li delay=%li):\n"), (long)avail, (long)delay);
-		snd_pcm_status_dump(status, log);
+}
+
+/* radix-2 complex FFT, shared by the spectrum meter and the channelizer */
+
+struct fft_plan {
+	unsigned int n;
+	float *tw_re, *tw_im;	/* twiddles, n / 2 of each */
+	unsigned int *bitrev;
+};
+
+static int fft_plan_init(struct fft_plan *plan, unsigned int n)
+{
+	unsigned int i, j, bits;
+
+	plan->n = n;
+	plan->tw_re = malloc(n / 2 * sizeof(float));
+	plan->tw_im = malloc(n / 2 * sizeof(float));
+	plan->bitrev = malloc(n * sizeof(unsigned int));
+	if (!plan->tw_re || !plan->tw_im || !plan->bitrev)
+		return -ENOMEM;
+	for (i = 0; i < n / 2; i++) {
+		plan->tw_re[i] = cos(2 * M_PI * i / n);
+		plan->tw_im[i] = -sin(2 * M_PI * i / n);
+	}
+	for (bits = 0; (1U << bits) < n; bits++)
+		;
+	for (i = 0; i < n; i++)
+		for (j = 0, plan->bitrev[i] = 0; j < bits; j++)
+			if (i & (1U << j))
+				plan->bitrev[i] |= 1U << (bits - 1 - j);
+	return 0;
+}
+
+static void fft_plan_free(struct fft_plan *plan)
+{
+	free(plan->tw_re);
+	free(plan->tw_im);
+	free(plan->bitrev);
+	plan->tw_re = plan->tw_im = NULL;
+	plan->bitrev = NULL;
+}
+
+/* in-place forward radix-2 decimation in time FFT */
+static void fft_run(const struct fft_plan *plan, float *re, float *im)
+{
+	unsigned int n = plan->n, len, half, step, i, j, k;
+	float tr, ti, wr, wi;
+
+	for (i = 0; i < n; i++) {
+		j = plan->bitrev[i];
+		if (j > i) {
+			tr = re[i]; re[i] = re[j]; re[j] = tr;
+			ti = im[i]; im[i] = im[j]; im[j] = ti;
+		}
+	}
+	for (len = 2; len <= n; len <<= 1) {
+		half = len / 2;
+		step = n / len;
+		for (i = 0; i < n; i += len) {
+			for (j = 0, k = 0; j < half; j++, k += step) {
+				wr = plan->tw_re[k];
+				wi = plan->tw_im[k];
+				tr = re[i + j + half] * wr - im[i + j + half] * wi;
+				ti = re[i + j + half] * wi + im[i + j + half] * wr;
+				re[i + j + half] = re[i + j] - tr;
+				im[i + j + half] = im[i + j] - ti;
+				re[i + j] += tr;
+				im[i + j] += ti;
+			}
+		}
 	}
 }
 
 /*
+ * -V spectrum: windowed FFTs of a decimated copy of the stream, averaged
+ * and rendered spectrum_rate times a second as one waterfall line on
+ * stderr, or exported to a POSIX shared memory object. With --iq the
+ * first two channels are taken as I and Q and the full complex band is
+ * shown, otherwise the channels are mixed to mono.
  */
-#ifdef CONFIG_SUPPORT_CHMAP
-static u_char *remap_data(u_char *data, size_t count)
+
+#define SPECTRUM_COLUMNS	64
+#define SPECTRUM_FLOOR		-100.0	/* dBFS shown as blank */
+#define SPECTRUM_SHM_MAGIC	"FPSPEC1"
+
+struct spectrum_shm {
+	char magic[8];
+	uint32_t bins;
+	uint32_t iq;
+	double first_hz;	/* frequency of bin 0 */
+	double bin_hz;
+	uint64_t seq;		/* odd while db[] is being updated */
+	float db[];
+};
+
+static struct {
+	unsigned int n;
+	struct fft_plan fft;
+	float *window;
+	float *re, *im;
+	float *power;
+	unsigned int fill;
+	unsigned int nfft;
+	double acc_i, acc_q;
+	unsigned int acc;
+	int iq;
+	double fs;		/* after decimation */
+	struct timespec last;
+	struct spectrum_shm *shm;
+	size_t shm_size;
+} spec;
+
+static void spectrum_start(void)
 {
-	static u_char *tmp, *src, *dst;
-	static size_t tmp_size;
-	size_t sample_bytes = bits_per_sample / 8;
-	size_t step = bits_per_frame / 8;
-	size_t chunk_bytes;
-	unsigned int ch, i;
+	unsigned int n = spectrum_size, i;
+	size_t bins;
+	int sfd;
+
+	spec.n = n;
+	spec.iq = iq_input && meter_ring.channels >= 2;
+	spec.fs = (double)meter_ring.rate / spectrum_decimate;
+	spec.window = malloc(n * sizeof(float));
+	spec.re = malloc(n * sizeof(float));
+	spec.im = malloc(n * sizeof(float));
+	spec.power = calloc(n, sizeof(float));
+	if (fft_plan_init(&spec.fft, n) < 0 || !spec.window ||
+	    !spec.re || !spec.im || !spec.power) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < n; i++)
+		spec.window[i] = 0.5 - 0.5 * cos(2 * M_PI * i / n);	/* Hann */
+	spec.fill = spec.nfft = spec.acc = 0;
+	spec.acc_i = spec.acc_q = 0;
+	clock_gettime(CLOCK_MONOTONIC, &spec.last);
 
-	if (!hw_map)
-		return data;
+	if (!spectrum_shm_name)
+		return;
+	bins = spec.iq ? n : n / 2;
+	spec.shm_size = sizeof(struct spectrum_shm) + bins * sizeof(float);
+	sfd = shm_open(spectrum_shm_name, O_CREAT | O_RDWR, 0644);
+	if (sfd < 0 || ftruncate(sfd, spec.shm_size) < 0) {
+		error(_("cannot create shared memory %s: %s"), spectrum_shm_name,
+		      strerror(errno));
+		prg_exit(EXIT_FAILURE);
+	}
+	spec.shm = mmap(NULL, spec.shm_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED, sfd, 0);
+	close(sfd);
+	if (spec.shm == MAP_FAILED) {
+		error(_("cannot map shared memory %s: %s"), spectrum_shm_name,
+		      strerror(errno));
+		prg_exit(EXIT_FAILURE);
+	}
+	memcpy(spec.shm->magic, SPECTRUM_SHM_MAGIC, sizeof(spec.shm->magic));
+	spec.shm->bins = bins;
+	spec.shm->iq = spec.iq;
+	spec.shm->bin_hz = spec.fs / n;
+	spec.shm->first_hz = spec.iq ? -spec.fs / 2 : 0;
+}
 
-	chunk_bytes = count * bits_per_frame / 8;
-	if (tmp_size < chunk_bytes) {
-		free(tmp);
-		tmp = malloc(chunk_bytes);
-		if (!tmp) {
-			error(_("not enough memory"));
-			exit(1);
+static void spectrum_render(void)
+{
+	static const char ramp[] = " .:-=+*#%@";
+	unsigned int n = spec.n, bins = spec.iq ? n : n / 2;
+	unsigned int i, b, col, peak_bin = 0;
+	/* a full scale sine gives |X| = n/4 (real) or n/2 (complex), Hann */
+	double norm = spec.iq ? n / 2.0 : n / 4.0;
+	double db, peak = -1000, colmax[SPECTRUM_COLUMNS];
+	char line[SPECTRUM_COLUMNS + 1];
+
+	for (col = 0; col < SPECTRUM_COLUMNS; col++)
+		colmax[col] = -1000;
+	if (spec.shm) {
+		/* odd count before any bin changes */
+		__atomic_fetch_add(&spec.shm->seq, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+	}
+	for (b = 0; b < bins; b++) {
+		/* put negative frequencies first for IQ */
+		i = spec.iq ? (b + n / 2) % n : b;
+		db = 10 * log10(spec.power[i] / spec.nfft / (norm * norm) + 1e-20);
+		if (spec.shm)
+			spec.shm->db[b] = db;
+		col = (unsigned long)b * SPECTRUM_COLUMNS / bins;
+		if (db > colmax[col])
+			colmax[col] = db;
+		if (db > peak) {
+			peak = db;
+			peak_bin = b;
 		}
-		tmp_size = count;
 	}
+	if (spec.shm) {
+		__atomic_add_fetch(&spec.shm->seq, 1, __ATOMIC_RELEASE);
+		return;
+	}
+	for (col = 0; col < SPECTRUM_COLUMNS; col++) {
+		int level = (colmax[col] - SPECTRUM_FLOOR) * (sizeof(ramp) - 1) /
+			-SPECTRUM_FLOOR;
+		if (level < 0)
+			level = 0;
+		if (level > (int)sizeof(ramp) - 2)
+			level = sizeof(ramp) - 2;
+		line[col] = ramp[level];
+	}
+	line[SPECTRUM_COLUMNS] = '\0';
+	fprintf(stderr, "|%s| %6.1f dBFS @ %9.1f Hz\n", line, peak,
+		(spec.iq ? -spec.fs / 2 : 0) + peak_bin * spec.fs / n);
+}
 
-	src = data;
-	dst = tmp;
-	for (i = 0; i < count; i++) {
-		for (ch = 0; ch < hwparams.channels; ch++) {
-			memcpy(dst, src + sample_bytes * hw_map[ch],
-			       sample_bytes);
-			dst += sample_bytes;
+static void spectrum_process(const float *frames, size_t count)
+{
+	unsigned int ch = meter_ring.channels, c;
+	struct timespec now;
+	double i_val, q_val;
+
+	while (count-- > 0) {
+		if (spec.iq) {
+			i_val = frames[0];
+			q_val = frames[1];
+		} else {
+			for (c = 0, i_val = 0; c < ch; c++)
+				i_val += frames[c];
+			i_val /= ch;
+			q_val = 0;
 		}
-		src += step;
+		frames += ch;
+		/* boxcar decimation */
+		spec.acc_i += i_val;
+		spec.acc_q += q_val;
+		if (++spec.acc < (unsigned int)spectrum_decimate)
+			continue;
+		spec.re[spec.fill] = spec.acc_i / spec.acc * spec.window[spec.fill];
+		spec.im[spec.fill] = spec.acc_q / spec.acc * spec.window[spec.fill];
+		spec.acc_i = spec.acc_q = 0;
+		spec.acc = 0;
+		if (++spec.fill < spec.n)
+			continue;
+		fft_run(&spec.fft, spec.re, spec.im);
+		for (c = 0; c < spec.n; c++)
+			spec.power[c] += spec.re[c] * spec.re[c] +
+				spec.im[c] * spec.im[c];
+		spec.nfft++;
+		spec.fill = 0;
 	}
-	return tmp;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (!spec.nfft ||
+	    (now.tv_sec - spec.last.tv_sec) * 1000000000LL +
+	    (now.tv_nsec - spec.last.tv_nsec) < 1000000000LL / spectrum_rate)
+		return;
+	spectrum_render();
+	memset(spec.power, 0, spec.n * sizeof(float));
+	spec.nfft = 0;
+	spec.last = now;
 }
 
-static u_char **remap_datav(u_char **data, size_t count)
+static void spectrum_stop(void)
 {
-	static u_char **tmp;
-	unsigned int ch;
+	if (spec.shm)
+		munmap(spec.shm, spec.shm_size);
+	spec.shm = NULL;
+	fft_plan_free(&spec.fft);
+	free(spec.window);
+	free(spec.re);
+	free(spec.im);
+	free(spec.power);
+}
 
-	if (!hw_map)
-		return data;
+/* where a meter writes its readings: FILE, appended to, or stderr */
+static FILE *meter_log_open(const char *name)
+{
+	FILE *f;
 
-	if (!tmp) {
-		tmp = malloc(sizeof(*tmp) * hwparams.channels);
-		if (!tmp) {
-			error(_("not enough memory"));
-			exit(1);
-		}
-		for (ch = 0; ch < hwparams.channels; ch++)
-			tmp[ch] = data[hw_map[ch]];
+	if (!name)
+		return stderr;
+	f = fopen(name, "a");
+	if (!f) {
+		error(_("cannot open %s: %s"), name, strerror(errno));
+		prg_exit(EXIT_FAILURE);
 	}
-	return tmp;
+	return f;
+}
+
+static void meter_log_close(FILE *f)
+{
+	if (f && f != stderr)
+		fclose(f);
+}
+
+/* local time of an event, to the millisecond */
+static void meter_wallclock(char *buf, size_t size)
+{
+	struct timespec ts;
+	struct tm tm;
+	size_t n;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	localtime_r(&ts.tv_sec, &tm);
+	n = strftime(buf, size, "%Y-%m-%dT%H:%M:%S", &tm);
+	snprintf(buf + n, size - n, ".%03u",
+		 (unsigned int)(ts.tv_nsec / 1000000) % 1000);
 }
-#else
-#define remap_data(data, count)		(data)
-#define remap_datav(data, count)	(data)
-#endif
 
 /*
- *  write function
+ * -V loudness: ITU-R BS.1770 / EBU R128 loudness. Every channel goes
+ * through the K-weighting pre-filter and high pass, and its mean square
+ * is summed per 100 ms; momentary loudness is taken over the last 4 of
+ * those, short term over the last 30, and the integrated loudness over
+ * the 400 ms blocks that pass the -70 LUFS absolute and -10 LU relative
+ * gates, kept as a histogram of 0.1 LU bins so that memory does not
+ * grow with the capture. True peak comes from an oversampled copy of
+ * each channel. One JSON object per reading goes to --loudness-log, or
+ * to stderr.
  */
 
-static ssize_t pcm_write(u_char *data, size_t count)
+#define LOUDNESS_ABS_GATE	-70.0
+#define LOUDNESS_HIST_BINS	800	/* 0.1 LU each, -70 to +10 LUFS */
+#define LOUDNESS_SHORT_BLOCKS	30	/* of 100 ms */
+#define TRUE_PEAK_TAPS		12	/* per phase of the oversampler */
+
+static struct {
+	unsigned int channels;
+	double b[2][3], a[2][3];	/* shelf and high pass biquads */
+	double *z;		/* per channel: 2 states of each biquad */
+	double *weight;
+	double *sq;		/* per channel sum of squares of this 100 ms */
+	unsigned int sub_len, sub_fill;
+	double short_e[LOUDNESS_SHORT_BLOCKS];	/* weighted mean squares */
+	unsigned long subs;	/* 100 ms blocks done */
+	double hist_e[LOUDNESS_HIST_BINS];
+	unsigned long hist_n[LOUDNESS_HIST_BINS];
+	unsigned int over;	/* true peak oversampling factor */
+	float *tp_coef;		/* over * TRUE_PEAK_TAPS */
+	float *tp_hist;		/* per channel, TRUE_PEAK_TAPS samples */
+	float *tp_max;		/* per channel, linear */
+	unsigned int report_every;	/* 100 ms blocks between readings */
+	FILE *out;
+} loud;
+
+/* one K-weighting stage for the sample rate, as in BS.1770 annex 1 */
+static void loudness_design(double rate)
 {
-	ssize_t r;
-	ssize_t result = 0;
+	double k, vh, vb, q, a0;
+
+	/* high shelf, +4 dB above about 1.5 kHz */
+	k = tan(M_PI * 1681.974450955533 / rate);
+	q = 0.7071752369554196;
+	vh = pow(10, 3.999843853973347 / 20);
+	vb = pow(vh, 0.4996667741545416);
+	a0 = 1 + k / q + k * k;
+	loud.b[0][0] = (vh + vb * k / q + k * k) / a0;
+	loud.b[0][1] = 2 * (k * k - vh) / a0;
+	loud.b[0][2] = (vh - vb * k / q + k * k) / a0;
+	loud.a[0][1] = 2 * (k * k - 1) / a0;
+	loud.a[0][2] = (1 - k / q + k * k) / a0;
+
+	/* revised low frequency B weighting high pass */
+	k = tan(M_PI * 38.13547087602444 / rate);
+	q = 0.5003270373238773;
+	a0 = 1 + k / q + k * k;
+	loud.b[1][0] = 1;
+	loud.b[1][1] = -2;
+	loud.b[1][2] = 1;
+	loud.a[1][1] = 2 * (k * k - 1) / a0;
+	loud.a[1][2] = (1 - k / q + k * k) / a0;
+}
 
-	if (count < chunk_size) {
-		snd_pcm_format_set_silence(hwparams.format, data + count * bits_per_frame / 8, (chunk_size - count) * hwparams.channels);
-		count = chunk_size;
+static void loudness_start(void)
+{
+	static const unsigned int alsa_51[] = {
+		SND_CHMAP_FL, SND_CHMAP_FR, SND_CHMAP_RL,
+		SND_CHMAP_RR, SND_CHMAP_FC, SND_CHMAP_LFE,
+	};
+	unsigned int ch = meter_ring.channels, c, n, taps, pos;
+	snd_pcm_chmap_t *map;
+	double x, w, fc;
+
+	memset(&loud, 0, sizeof(loud));
+	loud.channels = ch;
+	loudness_design(meter_ring.rate);
+	loud.sub_len = meter_ring.rate / 10;
+	loud.report_every = 10 / loudness_rate;
+	loud.over = meter_ring.rate < 96000 ? 4 : meter_ring.rate < 192000 ? 2 : 1;
+	taps = loud.over * TRUE_PEAK_TAPS;
+	loud.z = calloc(ch * 4, sizeof(double));
+	loud.weight = malloc(ch * sizeof(double));
+	loud.sq = calloc(ch, sizeof(double));
+	loud.tp_coef = malloc(taps * sizeof(float));
+	loud.tp_hist = calloc(ch * TRUE_PEAK_TAPS, sizeof(float));
+	loud.tp_max = calloc(ch, sizeof(float));
+	if (!loud.z || !loud.weight || !loud.sq || !loud.tp_coef ||
+	    !loud.tp_hist || !loud.tp_max) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
 	}
-	data = remap_data(data, count);
-	while (count > 0 && !in_aborting) {
-		if (test_position)
-			do_test_position();
-		check_stdin();
-		r = writei_func(handle, data, count);
-		if (test_position)
-			do_test_position();
-		if (r == -EAGAIN || (r >= 0 && (size_t)r < count)) {
-			if (!test_nowait)
-				snd_pcm_wait(handle, 100);
-		} else if (r == -EPIPE) {
-			xrun();
-		} else if (r == -ESTRPIPE) {
-			suspend();
-		} else if (r < 0) {
-			error(_("write error: %s"), snd_strerror(r));
-			prg_exit(EXIT_FAILURE);
-		}
-		if (r > 0) {
-			if (vumeter)
-				compute_max_peak(data, r * hwparams.channels);
-			result += r;
-			count -= r;
-			data += r * bits_per_frame / 8;
-		}
+	/*
+	 * no LFE, surrounds +1.5 dB; the positions come from the device's
+	 * channel map, else six channels are taken as 5.1 in ALSA order
+	 */
+	map = snd_pcm_get_chmap(handle);
+	for (c = 0; c < ch; c++) {
+		if (map && map->channels == ch)
+			pos = map->pos[c] & SND_CHMAP_POSITION_MASK;
+		else
+			pos = ch == 6 ? alsa_51[c] : SND_CHMAP_UNKNOWN;
+		loud.weight[c] = pos == SND_CHMAP_LFE ? 0 :
+			pos == SND_CHMAP_RL || pos == SND_CHMAP_RR ||
+			pos == SND_CHMAP_SL || pos == SND_CHMAP_SR ? 1.41 : 1;
 	}
-	return result;
+	free(map);
+	/* interpolator, phase p of output k is tp_coef[p + over * k] */
+	fc = 0.5 / loud.over;
+	for (n = 0; n < taps; n++) {
+		x = n - (taps - 1) / 2.0;
+		w = 0.42 - 0.5 * cos(2 * M_PI * n / (taps - 1)) +
+			0.08 * cos(4 * M_PI * n / (taps - 1));
+		loud.tp_coef[n] = loud.over * w *
+			(x == 0 ? 2 * fc : sin(2 * M_PI * fc * x) / (M_PI * x));
+	}
+	loud.out = meter_log_open(loudness_log);
 }
 
-static ssize_t pcm_writev(u_char **data, unsigned int channels, size_t count)
+static double loudness_lufs(double e)
 {
-	ssize_t r;
-	size_t result = 0;
+	return e > 0 ? -0.691 + 10 * log10(e) : -HUGE_VAL;
+}
 
-	if (count != chunk_size) {
-		unsigned int channel;
-		size_t offset = count;
-		size_t remaining = chunk_size - count;
-		for (channel = 0; channel < channels; channel++)
-			snd_pcm_format_set_silence(hwparams.format, data[channel] + offset * bits_per_sample / 8, remaining);
-		count = chunk_size;
+static double loudness_integrated(void)
+{
+	double e = 0, thr;
+	unsigned long n = 0;
+	int i, first;
+
+	for (i = 0; i < LOUDNESS_HIST_BINS; i++) {
+		e += loud.hist_e[i];
+		n += loud.hist_n[i];
 	}
-	data = remap_datav(data, count);
-	while (count > 0 && !in_aborting) {
-		unsigned int channel;
-		void *bufs[channels];
-		size_t offset = result;
-		for (channel = 0; channel < channels; channel++)
-			bufs[channel] = data[channel] + offset * bits_per_sample / 8;
-		if (test_position)
-			do_test_position();
-		check_stdin();
-		r = writen_func(handle, bufs, count);
-		if (test_position)
-			do_test_position();
-		if (r == -EAGAIN || (r >= 0 && (size_t)r < count)) {
-			if (!test_nowait)
-				snd_pcm_wait(handle, 100);
-		} else if (r == -EPIPE) {
-			xrun();
-		} else if (r == -ESTRPIPE) {
-			suspend();
-		} else if (r < 0) {
-			error(_("writev error: %s"), snd_strerror(r));
-			prg_exit(EXIT_FAILURE);
-		}
-		if (r > 0) {
-			if (vumeter) {
-				for (channel = 0; channel < channels; channel++)
-					compute_max_peak(data[channel], r);
-			}
-			result += r;
-			count -= r;
-		}
+	if (!n)
+		return -HUGE_VAL;
+	thr = loudness_lufs(e / n) - 10;
+	first = ceil((thr - LOUDNESS_ABS_GATE) * 10);
+	if (first < 0)
+		first = 0;
+	for (i = first, e = 0, n = 0; i < LOUDNESS_HIST_BINS; i++) {
+		e += loud.hist_e[i];
+		n += loud.hist_n[i];
 	}
-	return result;
+	return n ? loudness_lufs(e / n) : -HUGE_VAL;
 }
 
-/*
- *  read function
- */
-
-static ssize_t pcm_read(u_char *data, size_t rcount)
+/* JSON has no infinities: no signal is null */
+static void loudness_print_value(const char *key, double v, const char *sep)
 {
-	ssize_t r;
-	size_t result = 0;
-	size_t count = rcount;
+	if (isfinite(v))
+		fprintf(loud.out, "\"%s\":%.1f%s", key, v, sep);
+	else
+		fprintf(loud.out, "\"%s\":null%s", key, sep);
+}
 
-	if (count != chunk_size) {
-		count = chunk_size;
+static void loudness_report(int final)
+{
+	double m = 0, s = 0;
+	unsigned int i, nm, ns;
+
+	nm = loud.subs < 4 ? loud.subs : 4;
+	ns = loud.subs < LOUDNESS_SHORT_BLOCKS ? loud.subs : LOUDNESS_SHORT_BLOCKS;
+	for (i = 0; i < ns; i++) {
+		double e = loud.short_e[(loud.subs - 1 - i) % LOUDNESS_SHORT_BLOCKS];
+		s += e;
+		if (i < nm)
+			m += e;
 	}
+	fprintf(loud.out, "{\"time\":%.1f,", loud.subs / 10.0);
+	if (final)
+		fprintf(loud.out, "\"final\":true,");
+	loudness_print_value("momentary", nm == 4 ? loudness_lufs(m / nm) : -HUGE_VAL, ",");
+	loudness_print_value("short_term", ns == LOUDNESS_SHORT_BLOCKS ?
+			     loudness_lufs(s / ns) : -HUGE_VAL, ",");
+	loudness_print_value("integrated", loudness_integrated(), ",");
+	fprintf(loud.out, "\"true_peak\":[");
+	for (i = 0; i < loud.channels; i++) {
+		double tp = loud.tp_max[i] > 0 ? 20 * log10(loud.tp_max[i]) : -HUGE_VAL;
+		if (isfinite(tp))
+			fprintf(loud.out, "%s%.1f", i ? "," : "", tp);
+		else
+			fprintf(loud.out, "%snull", i ? "," : "");
+	}
+	fprintf(loud.out, "]}\n");
+	fflush(loud.out);
+}
 
-	while (count > 0) {
-		if (in_aborting)
-			goto abort;
-		if (test_position)
-			do_test_position();
-		check_stdin();
-		r = readi_func(handle, data, count);
-		if (test_position)
-			do_test_position();
-		if (r == -EAGAIN || (r >= 0 && (size_t)r < count)) {
-			if (!test_nowait)
-				snd_pcm_wait(handle, 100);
-		} else if (r == -EPIPE) {
-			xrun();
-		} else if (r == -ESTRPIPE) {
-			suspend();
-		} else if (r < 0) {
-			error(_("read error: %s"), snd_strerror(r));
+/* a 100 ms block is complete */
+static void loudness_block(void)
+{
+	double e = 0, m;
+	unsigned int c;
+	int bin;
+
+	for (c = 0; c < loud.channels; c++) {
+		e += loud.weight[c] * loud.sq[c] / loud.sub_len;
+		loud.sq[c] = 0;
+	}
+	loud.short_e[loud.subs % LOUDNESS_SHORT_BLOCKS] = e;
+	loud.subs++;
+	loud.sub_fill = 0;
+	if (loud.subs >= 4) {
+		/* a 400 ms gating block, overlapping the last by 75% */
+		for (c = 0, m = 0; c < 4; c++)
+			m += loud.short_e[(loud.subs - 1 - c) % LOUDNESS_SHORT_BLOCKS];
+		m /= 4;
+		bin = floor((loudness_lufs(m) - LOUDNESS_ABS_GATE) * 10);
+		if (m > 0 && bin >= 0) {
+			if (bin >= LOUDNESS_HIST_BINS)
+				bin = LOUDNESS_HIST_BINS - 1;
+			loud.hist_e[bin] += m;
+			loud.hist_n[bin]++;
+		}
+	}
+	if (loud.subs % loud.report_every == 0)
+		loudness_report(0);
+}
+
+static void loudness_process(const float *frames, size_t count)
+{
+	unsigned int ch = loud.channels, over = loud.over, c, p, k;
+	double x, y, *z;
+	float *h, t, peak;
+
+	while (count-- > 0) {
+		for (c = 0; c < ch; c++) {
+			x = frames[c];
+			z = loud.z + c * 4;
+			/* transposed direct form II, shelf then high pass */
+			y = loud.b[0][0] * x + z[0];
+			z[0] = loud.b[0][1] * x - loud.a[0][1] * y + z[1];
+			z[1] = loud.b[0][2] * x - loud.a[0][2] * y;
+			x = y;
+			y = x + z[2];
+			z[2] = -2 * x - loud.a[1][1] * y + z[3];
+			z[3] = x - loud.a[1][2] * y;
+			loud.sq[c] += y * y;
+
+			h = loud.tp_hist + c * TRUE_PEAK_TAPS;
+			memmove(h + 1, h, (TRUE_PEAK_TAPS - 1) * sizeof(float));
+			h[0] = frames[c];
+			peak = loud.tp_max[c];
+			for (p = 0; p < over; p++) {
+				for (k = 0, t = 0; k < TRUE_PEAK_TAPS; k++)
+					t += loud.tp_coef[p + over * k] * h[k];
+				if (fabsf(t) > peak)
+					peak = fabsf(t);
+			}
+			loud.tp_max[c] = peak;
+		}
+		frames += ch;
+		if (++loud.sub_fill == loud.sub_len)
+			loudness_block();
+	}
+}
+
+static void loudness_stop(void)
+{
+	if (loud.out)
+		loudness_report(1);
+	meter_log_close(loud.out);
+	loud.out = NULL;
+	free(loud.z);
+	free(loud.weight);
+	free(loud.sq);
+	free(loud.tp_coef);
+	free(loud.tp_hist);
+	free(loud.tp_max);
+}
+
+/*
+ * -V histogram: per channel histograms of the sample codes. Formats of
+ * up to 16 bits get one bucket per code, wider ones 65536 buckets of
+ * 2^(width - 16) codes. Counting goes to four interleaved copies of
+ * each histogram, so runs of the same code do not serialize on one
+ * counter; they are merged when a report is due. Every
+ * --histogram-interval seconds one JSON line per channel reports the
+ * range and entropy of the codes in bits, the share of samples in the
+ * end buckets, the mean and the skew, then the counts start over. For
+ * bucketed formats the entropy assumes the codes within a bucket are
+ * used evenly.
+ */
+
+#define HISTOGRAM_LANES		4
+
+static struct {
+	unsigned int channels;
+	unsigned int bits;	/* log2 of the bucket count */
+	unsigned int codes_per_bucket;
+	uint32_t *counts;	/* channels x lanes x buckets */
+	uint64_t *merged;	/* buckets */
+	size_t frames, interval;
+	double elapsed;
+	FILE *out;
+} hist;
+
+static void histogram_start(void)
+{
+	unsigned int width = snd_pcm_format_float(meter_ring.format) ? 24 :
+		snd_pcm_format_width(meter_ring.format);
+
+	memset(&hist, 0, sizeof(hist));
+	hist.channels = meter_ring.channels;
+	hist.bits = width > 16 ? 16 : width;
+	hist.codes_per_bucket = 1U << (width - hist.bits);
+	hist.interval = (size_t)histogram_interval * meter_ring.rate;
+	hist.counts = calloc((size_t)hist.channels * HISTOGRAM_LANES << hist.bits,
+			     sizeof(uint32_t));
+	hist.merged = malloc(sizeof(uint64_t) << hist.bits);
+	if (!hist.counts || !hist.merged) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
+	}
+	hist.out = meter_log_open(histogram_log);
+}
+
+static void histogram_report(int final)
+{
+	size_t buckets = (size_t)1 << hist.bits, b;
+	unsigned int c, l;
+	uint64_t n, lo_edge, hi_edge;
+	long lo, hi, unused;
+	double mean, m2, m3, d, p, entropy;
+
+	for (c = 0; c < hist.channels; c++) {
+		uint32_t *h = hist.counts + ((size_t)c * HISTOGRAM_LANES << hist.bits);
+
+		memset(hist.merged, 0, sizeof(uint64_t) << hist.bits);
+		for (l = 0; l < HISTOGRAM_LANES; l++)
+			for (b = 0; b < buckets; b++)
+				hist.merged[b] += h[(l << hist.bits) + b];
+		memset(h, 0, sizeof(uint32_t) * HISTOGRAM_LANES << hist.bits);
+
+		n = 0;
+		mean = 0;
+		lo = hi = -1;
+		for (b = 0; b < buckets; b++) {
+			if (!hist.merged[b])
+				continue;
+			if (lo < 0)
+				lo = b;
+			hi = b;
+			n += hist.merged[b];
+			mean += (double)hist.merged[b] * b;
+		}
+		if (!n)
+			continue;
+		mean /= n;
+		m2 = m3 = entropy = 0;
+		unused = 0;
+		for (b = lo; b <= (size_t)hi; b++) {
+			if (!hist.merged[b]) {
+				unused++;
+				continue;
+			}
+			d = b - mean;
+			p = (double)hist.merged[b] / n;
+			m2 += p * d * d;
+			m3 += p * d * d * d;
+			entropy -= p * log2(p);
+		}
+		lo_edge = hist.merged[0];
+		hi_edge = hist.merged[buckets - 1];
+		fprintf(hist.out, "{\"time\":%.1f,%s\"channel\":%u,\"samples\":%llu,"
+			"\"range_bits\":%.2f,\"entropy_bits\":%.2f,"
+			"\"unused_codes\":%ld,\"clip_rate\":%.3g,"
+			"\"mean\":%.3g,\"skew\":%.3f}\n",
+			hist.elapsed, final ? "\"final\":true," : "", c,
+			(unsigned long long)n,
+			log2((double)(hi - lo + 1) * hist.codes_per_bucket),
+			entropy + (hist.codes_per_bucket > 1 ?
+				   log2(hist.codes_per_bucket) : 0),
+			unused * (long)hist.codes_per_bucket,
+			(double)(lo_edge + hi_edge) / n,
+			(mean - buckets / 2.0 +
+			 (hist.codes_per_bucket > 1 ? 0.5 : 0)) / (buckets / 2.0),
+			m2 > 0 ? m3 / pow(m2, 1.5) : 0);
+	}
+	fflush(hist.out);
+}
+
+static void histogram_process(const float *frames, size_t count)
+{
+	unsigned int ch = hist.channels, c, lane;
+	float scale = (float)(1U << (hist.bits - 1));
+	int32_t top = (1 << hist.bits) - 1, code;
+	uint32_t *h;
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		lane = (i & (HISTOGRAM_LANES - 1)) << hist.bits;
+		for (c = 0; c < ch; c++) {
+			code = (int32_t)floorf(*frames++ * scale) + (1 << (hist.bits - 1));
+			if (code < 0)
+				code = 0;
+			else if (code > top)
+				code = top;
+			h = hist.counts + ((size_t)c * HISTOGRAM_LANES << hist.bits);
+			h[lane + code]++;
+		}
+		if (++hist.frames == hist.interval) {
+			hist.elapsed += histogram_interval;
+			histogram_report(0);
+			hist.frames = 0;
+		}
+	}
+}
+
+static void histogram_stop(void)
+{
+	if (hist.out && hist.frames) {
+		hist.elapsed += (double)hist.frames / meter_ring.rate;
+		histogram_report(1);
+	}
+	meter_log_close(hist.out);
+	hist.out = NULL;
+	free(hist.counts);
+	free(hist.merged);
+}
+
+/*
+ * --tones: a bank of Goertzel detectors, one per listed frequency and
+ * channel, run over Hann windowed blocks of --tone-block ms. A tone
+ * goes on after two blocks at or above --tone-threshold dBFS and off
+ * after two blocks 3 dB below it; each change is written as a JSON line
+ * to --tone-log (or stderr) and queued as an event for control socket
+ * clients that sent "events". The time is stream time since the meter
+ * started, the wall clock is when the change was detected. All the
+ * filters of a channel are advanced together, sample by sample, which
+ * keeps the inner loop a straight pass over arrays.
+ */
+
+#define TONES_MAX	64
+#define TONE_DEBOUNCE	2	/* blocks */
+#define TONE_HYSTERESIS	3.0	/* dB */
+
+static struct {
+	unsigned int count, channels;
+	float freq[TONES_MAX];
+	float coef[TONES_MAX];	/* 2 cos(2 pi f / rate) */
+	float *s1, *s2;		/* channels x count */
+	unsigned char *on;	/* channels x count */
+	signed char *run;	/* blocks towards the other state */
+	float *window;
+	size_t block, fill;
+	unsigned long long frames;
+	double rate, norm;
+	FILE *out;
+} tones;
+
+static int tones_parse(const char *list)
+{
+	char *copy, *tok, *end;
+	double f;
+
+	copy = strdup(list);
+	if (!copy)
+		return -ENOMEM;
+	tones.count = 0;
+	for (tok = strtok(copy, ","); tok; tok = strtok(NULL, ",")) {
+		f = strtod(tok, &end);
+		if (*end || f <= 0 || tones.count == TONES_MAX) {
+			free(copy);
+			return -EINVAL;
+		}
+		tones.freq[tones.count++] = f;
+	}
+	free(copy);
+	return tones.count ? 0 : -EINVAL;
+}
+
+static void tones_start(void)
+{
+	unsigned int k;
+	size_t n, states;
+
+	tones.channels = meter_ring.channels;
+	tones.rate = meter_ring.rate;
+	tones.block = tones.rate * tone_block_ms / 1000;
+	if (tones.block < 16)
+		tones.block = 16;
+	for (k = 0; k < tones.count; k++) {
+		if (tones.freq[k] >= tones.rate / 2) {
+			error(_("tone %.1f Hz is above the Nyquist frequency"),
+			      tones.freq[k]);
 			prg_exit(EXIT_FAILURE);
 		}
-		if (r > 0) {
-			if (vumeter)
-				compute_max_peak(data, r * hwparams.channels);
-			result += r;
-			count -= r;
-			data += r * bits_per_frame / 8;
+		tones.coef[k] = 2 * cos(2 * M_PI * tones.freq[k] / tones.rate);
+	}
+	states = (size_t)tones.channels * tones.count;
+	tones.s1 = calloc(states, sizeof(float));
+	tones.s2 = calloc(states, sizeof(float));
+	tones.on = calloc(states, 1);
+	tones.run = calloc(states, 1);
+	tones.window = malloc(tones.block * sizeof(float));
+	if (!tones.s1 || !tones.s2 || !tones.on || !tones.run || !tones.window) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
+	}
+	for (n = 0; n < tones.block; n++)
+		tones.window[n] = 0.5 - 0.5 * cos(2 * M_PI * n / tones.block);
+	/* a full scale tone gives |X| = block / 4 through the Hann window */
+	tones.norm = 4.0 / tones.block;
+	tones.fill = 0;
+	tones.frames = 0;
+	tones.out = meter_log_open(tone_log);
+}
+
+static void tones_event(unsigned int c, unsigned int k, int on, double db)
+{
+	char wall[32];
+	double t = (double)tones.frames / tones.rate;
+
+	meter_wallclock(wall, sizeof(wall));
+	fprintf(tones.out, "{\"event\":\"tone_%s\",\"channel\":%u,"
+		"\"freq\":%.1f,\"level\":%.1f,\"time\":%.3f,"
+		"\"wallclock\":\"%s\"}\n",
+		on ? "on" : "off", c, tones.freq[k], db, t, wall);
+	fflush(tones.out);
+	control_event("tone_%s channel=%u freq=%.1f level=%.1f time=%.3f",
+		      on ? "on" : "off", c, tones.freq[k], db, t);
+}
+
+/* a block is complete: decide every detector, then reset them */
+static void tones_decide(void)
+{
+	unsigned int c, k, i;
+	double power, db;
+
+	for (c = 0; c < tones.channels; c++) {
+		for (k = 0; k < tones.count; k++) {
+			i = c * tones.count + k;
+			power = tones.s1[i] * tones.s1[i] + tones.s2[i] * tones.s2[i] -
+				tones.coef[k] * tones.s1[i] * tones.s2[i];
+			db = power > 0 ? 20 * log10(sqrt(power) * tones.norm) : -200;
+			tones.s1[i] = tones.s2[i] = 0;
+			if (tones.on[i] ? db < tone_threshold - TONE_HYSTERESIS :
+			    db >= tone_threshold) {
+				if (++tones.run[i] < TONE_DEBOUNCE)
+					continue;
+				tones.on[i] = !tones.on[i];
+				tones_event(c, k, tones.on[i], db);
+			}
+			tones.run[i] = 0;
 		}
 	}
-abort:
-	return rcount;
 }
 
-static ssize_t pcm_readv(u_char **data, unsigned int channels, size_t rcount)
+static void tones_process(const float *frames, size_t count)
 {
-	ssize_t r;
-	size_t result = 0;
-	size_t count = rcount;
+	unsigned int ch = tones.channels, n = tones.count, c, k;
+	float x, s0, *s1, *s2;
+
+	while (count-- > 0) {
+		for (c = 0; c < ch; c++) {
+			x = frames[c] * tones.window[tones.fill];
+			s1 = tones.s1 + c * n;
+			s2 = tones.s2 + c * n;
+			for (k = 0; k < n; k++) {
+				s0 = x + tones.coef[k] * s1[k] - s2[k];
+				s2[k] = s1[k];
+				s1[k] = s0;
+			}
+		}
+		frames += ch;
+		tones.frames++;
+		if (++tones.fill == tones.block) {
+			tones_decide();
+			tones.fill = 0;
+		}
+	}
+}
 
-	if (count != chunk_size) {
-		count = chunk_size;
+static void tones_stop(void)
+{
+	meter_log_close(tones.out);
+	tones.out = NULL;
+	free(tones.s1);
+	free(tones.s2);
+	free(tones.on);
+	free(tones.run);
+	free(tones.window);
+}
+
+/*
+ * --anomalies: per-channel detection of runs of full scale samples
+ * (clipping), of the same non-zero value (a stuck converter or a
+ * stalled stream repeating its last sample) and of digital zero
+ * (dropouts), at least --clip-run, --stuck-run and --dropout-run frames
+ * long. One pass updates the three run lengths of every channel of a
+ * frame without branching and only falls back to per-channel work when
+ * some channel enters or leaves an anomaly. The start and end of each
+ * go to --anomaly-log (or stderr) as JSON lines and to control socket
+ * event subscribers; totals per channel are written when the meter
+ * stops.
+ */
+
+#define ANOMALY_CLIP	1
+#define ANOMALY_STUCK	2
+#define ANOMALY_DROPOUT	4
+
+static const char *const anomaly_names[] = { "clip", "stuck", "dropout" };
+
+static struct {
+	unsigned int channels;
+	float clip_level;
+	float *prev;
+	uint32_t *clip_run, *same_run, *zero_run;
+	unsigned char *state;	/* ANOMALY_* bits active per channel */
+	unsigned long long *since;	/* channels x 3, frame each started */
+	unsigned long long *events, *samples;	/* channels x 3 */
+	unsigned long long frames;
+	FILE *out;
+} anom;
+
+static void anomalies_start(void)
+{
+	unsigned int ch = meter_ring.channels;
+
+	anom.channels = ch;
+	/* the largest positive code, the negative one is further out */
+	anom.clip_level = snd_pcm_format_float(meter_ring.format) ? 1.0f :
+		1.0f - 1.0f / (1U << (snd_pcm_format_width(meter_ring.format) - 1));
+	anom.prev = calloc(ch, sizeof(float));
+	anom.clip_run = calloc(ch, sizeof(uint32_t));
+	anom.same_run = calloc(ch, sizeof(uint32_t));
+	anom.zero_run = calloc(ch, sizeof(uint32_t));
+	anom.state = calloc(ch, 1);
+	anom.since = calloc(ch * 3, sizeof(unsigned long long));
+	anom.events = calloc(ch * 3, sizeof(unsigned long long));
+	anom.samples = calloc(ch * 3, sizeof(unsigned long long));
+	if (!anom.prev || !anom.clip_run || !anom.same_run || !anom.zero_run ||
+	    !anom.state || !anom.since || !anom.events || !anom.samples) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
+	}
+	anom.frames = 0;
+	anomaly_clip_events = 0;
+	anom.out = meter_log_open(anomaly_log);
+}
+
+static void anomalies_event(unsigned int c, unsigned int kind, int start,
+			    unsigned long long at)
+{
+	char wall[32];
+	double t = (double)at / meter_ring.rate;
+	double len = (double)(at - anom.since[c * 3 + kind]) / meter_ring.rate;
+
+	meter_wallclock(wall, sizeof(wall));
+	if (start) {
+		fprintf(anom.out, "{\"event\":\"%s_start\",\"channel\":%u,"
+			"\"time\":%.6f,\"wallclock\":\"%s\"}\n",
+			anomaly_names[kind], c, t, wall);
+		control_event("%s_start channel=%u time=%.6f",
+			      anomaly_names[kind], c, t);
+	} else {
+		fprintf(anom.out, "{\"event\":\"%s_end\",\"channel\":%u,"
+			"\"time\":%.6f,\"duration\":%.6f,\"wallclock\":\"%s\"}\n",
+			anomaly_names[kind], c, t, len, wall);
+		control_event("%s_end channel=%u time=%.6f duration=%.6f",
+			      anomaly_names[kind], c, t, len);
+	}
+	fflush(anom.out);
+}
+
+/*
+ * Some channel changed state in the frame just processed. A run is
+ * only recognised once it is long enough, so its start is dated back
+ * to its first frame.
+ */
+static void anomalies_update(void)
+{
+	unsigned int c, kind;
+	unsigned char now, diff;
+	uint32_t run;
+	size_t i;
+
+	for (c = 0; c < anom.channels; c++) {
+		now = (anom.clip_run[c] >= (uint32_t)clip_run_min ? ANOMALY_CLIP : 0) |
+			(anom.same_run[c] >= (uint32_t)stuck_run_min ? ANOMALY_STUCK : 0) |
+			(anom.zero_run[c] >= (uint32_t)dropout_run_min ? ANOMALY_DROPOUT : 0);
+		diff = now ^ anom.state[c];
+		for (kind = 0; diff; kind++, diff >>= 1) {
+			if (!(diff & 1))
+				continue;
+			i = c * 3 + kind;
+			if (now & (1 << kind)) {
+				run = kind == 0 ? anom.clip_run[c] :
+					kind == 1 ? anom.same_run[c] : anom.zero_run[c];
+				anom.since[i] = anom.frames - run;
+				anom.events[i]++;
+				if (kind == 0)
+					anomaly_clip_events++;
+				anomalies_event(c, kind, 1, anom.since[i]);
+			} else {
+				/* the run ended with the frame before */
+				anom.samples[i] += anom.frames - 1 - anom.since[i];
+				anomalies_event(c, kind, 0, anom.frames - 1);
+			}
+		}
+		anom.state[c] = now;
+	}
+}
+
+static void anomalies_process(const float *frames, size_t count)
+{
+	unsigned int ch = anom.channels, c;
+	float level = anom.clip_level, x;
+	uint32_t clip_min = clip_run_min, stuck_min = stuck_run_min;
+	uint32_t zero_min = dropout_run_min;
+	uint32_t cr, sr, zr;
+	unsigned int changed;
+
+	while (count-- > 0) {
+		changed = 0;
+		for (c = 0; c < ch; c++) {
+			x = frames[c];
+			cr = (anom.clip_run[c] + 1) & -(uint32_t)(fabsf(x) >= level);
+			zr = (anom.zero_run[c] + 1) & -(uint32_t)(x == 0);
+			sr = ((anom.same_run[c] + 1) & -(uint32_t)(x == anom.prev[c])) |
+				!(x == anom.prev[c]);
+			/* a zero run or clipping is never also a stuck value */
+			sr &= -(uint32_t)(x != 0 && !cr);
+			changed |= ((cr >= clip_min) * ANOMALY_CLIP |
+				    (sr >= stuck_min) * ANOMALY_STUCK |
+				    (zr >= zero_min) * ANOMALY_DROPOUT) ^ anom.state[c];
+			anom.clip_run[c] = cr;
+			anom.same_run[c] = sr;
+			anom.zero_run[c] = zr;
+			anom.prev[c] = x;
+		}
+		frames += ch;
+		anom.frames++;
+		if (changed)
+			anomalies_update();
+	}
+}
+
+static void anomalies_stop(void)
+{
+	unsigned int c, kind;
+	size_t i;
+
+	for (c = 0; c < anom.channels; c++) {
+		for (kind = 0; kind < 3; kind++) {
+			i = c * 3 + kind;
+			if (anom.state[c] & (1 << kind)) {
+				anom.samples[i] += anom.frames - anom.since[i];
+				anomalies_event(c, kind, 0, anom.frames);
+			}
+		}
+		fprintf(anom.out, "{\"final\":true,\"channel\":%u,\"frames\":%llu,"
+			"\"clip_events\":%llu,\"clip_frames\":%llu,"
+			"\"stuck_events\":%llu,\"stuck_frames\":%llu,"
+			"\"dropout_events\":%llu,\"dropout_frames\":%llu}\n",
+			c, anom.frames,
+			anom.events[c * 3], anom.samples[c * 3],
+			anom.events[c * 3 + 1], anom.samples[c * 3 + 1],
+			anom.events[c * 3 + 2], anom.samples[c * 3 + 2]);
+	}
+	meter_log_close(anom.out);
+	anom.out = NULL;
+	free(anom.prev);
+	free(anom.clip_run);
+	free(anom.same_run);
+	free(anom.zero_run);
+	free(anom.state);
+	free(anom.since);
+	free(anom.events);
+	free(anom.samples);
+}
+
+/*
+ * --delay-calibrate: estimates how far each channel lags the reference
+ * channel. Blocks of DELAY_CAL_BLOCK frames are zero padded to twice
+ * that, and the cross spectrum of every channel with the reference is
+ * summed over the whole stream. When the meter stops, each sum is
+ * whitened (GCC-PHAT, so that the peak is narrow whatever the signal
+ * spectrum) and transformed back; the peak of that cross-correlation,
+ * refined between frames by evaluating it directly, is the lag. The
+ * --channel-delay list that lines the channels up is printed with it.
+ */
+
+#define DELAY_CAL_BLOCK	8192	/* frames, lags up to this are found */
+
+static struct {
+	unsigned int channels, ref;
+	struct fft_plan fft;
+	float *in;		/* DELAY_CAL_BLOCK interleaved frames */
+	size_t fill;
+	float *rre, *rim, *xre, *xim;
+	double *sre, *sim;	/* channels x 2 DELAY_CAL_BLOCK */
+	unsigned long blocks;
+} dcal;
+
+static void delay_cal_start(void)
+{
+	size_t n = 2 * DELAY_CAL_BLOCK, ch = meter_ring.channels;
+
+	if (delay_reference >= ch) {
+		error(_("delay reference channel %u, the stream has %u"),
+		      delay_reference, (unsigned int)ch);
+		prg_exit(EXIT_FAILURE);
+	}
+	dcal.channels = ch;
+	dcal.ref = delay_reference;
+	dcal.in = malloc(DELAY_CAL_BLOCK * ch * sizeof(float));
+	dcal.rre = malloc(n * sizeof(float));
+	dcal.rim = malloc(n * sizeof(float));
+	dcal.xre = malloc(n * sizeof(float));
+	dcal.xim = malloc(n * sizeof(float));
+	dcal.sre = calloc(n * ch, sizeof(double));
+	dcal.sim = calloc(n * ch, sizeof(double));
+	if (!dcal.in || !dcal.rre || !dcal.rim || !dcal.xre || !dcal.xim ||
+	    !dcal.sre || !dcal.sim || fft_plan_init(&dcal.fft, n) < 0) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
+	}
+	dcal.fill = 0;
+	dcal.blocks = 0;
+}
+
+static void delay_cal_block(void)
+{
+	size_t n = 2 * DELAY_CAL_BLOCK, k;
+	unsigned int ch = dcal.channels, c;
+	double *sre, *sim;
+
+	memset(dcal.rre + DELAY_CAL_BLOCK, 0, DELAY_CAL_BLOCK * sizeof(float));
+	memset(dcal.rim, 0, n * sizeof(float));
+	for (k = 0; k < DELAY_CAL_BLOCK; k++)
+		dcal.rre[k] = dcal.in[k * ch + dcal.ref];
+	fft_run(&dcal.fft, dcal.rre, dcal.rim);
+	for (c = 0; c < ch; c++) {
+		if (c == dcal.ref)
+			continue;
+		memset(dcal.xre + DELAY_CAL_BLOCK, 0, DELAY_CAL_BLOCK * sizeof(float));
+		memset(dcal.xim, 0, n * sizeof(float));
+		for (k = 0; k < DELAY_CAL_BLOCK; k++)
+			dcal.xre[k] = dcal.in[k * ch + c];
+		fft_run(&dcal.fft, dcal.xre, dcal.xim);
+		/* conj(R) X */
+		sre = dcal.sre + c * n;
+		sim = dcal.sim + c * n;
+		for (k = 0; k < n; k++) {
+			sre[k] += dcal.rre[k] * dcal.xre[k] + dcal.rim[k] * dcal.xim[k];
+			sim[k] += dcal.rre[k] * dcal.xim[k] - dcal.rim[k] * dcal.xre[k];
+		}
 	}
+	dcal.blocks++;
+}
+
+static void delay_cal_process(const float *frames, size_t count)
+{
+	unsigned int ch = dcal.channels;
+	size_t n;
 
 	while (count > 0) {
-		if (in_aborting)
-			goto abort;
-		unsigned int channel;
-		void *bufs[channels];
-		size_t offset = result;
-		for (channel = 0; channel < channels; channel++)
-			bufs[channel] = data[channel] + offset * bits_per_sample / 8;
-		if (test_position)
-			do_test_position();
-		check_stdin();
-		r = readn_func(handle, bufs, count);
-		if (test_position)
-			do_test_position();
-		if (r == -EAGAIN || (r >= 0 && (size_t)r < count)) {
-			if (!test_nowait)
-				snd_pcm_wait(handle, 100);
-		} else if (r == -EPIPE) {
-			xrun();
-		} else if (r == -ESTRPIPE) {
-			suspend();
-		} else if (r < 0) {
-			error(_("readv error: %s"), snd_strerror(r));
-			prg_exit(EXIT_FAILURE);
+		n = DELAY_CAL_BLOCK - dcal.fill;
+		if (n > count)
+			n = count;
+		memcpy(dcal.in + dcal.fill * ch, frames, n * ch * sizeof(float));
+		dcal.fill += n;
+		frames += n * ch;
+		count -= n;
+		if (dcal.fill == DELAY_CAL_BLOCK) {
+			delay_cal_block();
+			dcal.fill = 0;
 		}
-		if (r > 0) {
-			if (vumeter) {
-				for (channel = 0; channel < channels; channel++)
-					compute_max_peak(data[channel], r);
+	}
+}
+
+/* the whitened cross-correlation of channel c at a lag of t frames */
+static double delay_cal_corr(unsigned int c, double t)
+{
+	size_t n = 2 * DELAY_CAL_BLOCK, k;
+	double *sre = dcal.sre + c * n, *sim = dcal.sim + c * n;
+	double mag, w, sum = 0;
+	long f;
+
+	for (k = 0; k < n; k++) {
+		mag = hypot(sre[k], sim[k]);
+		if (mag == 0)
+			continue;
+		f = k < n / 2 ? (long)k : (long)k - (long)n;
+		w = 2 * M_PI * f * t / n;
+		sum += (sre[k] * cos(w) - sim[k] * sin(w)) / mag;
+	}
+	return sum / n;
+}
+
+/* lag of channel c behind the reference, in frames; *peak is 0 to 1 */
+static double delay_cal_lag(unsigned int c, double *peak)
+{
+	const double g = (sqrt(5) - 1) / 2;
+	size_t n = 2 * DELAY_CAL_BLOCK, k, best = 0;
+	double *sre = dcal.sre + c * n, *sim = dcal.sim + c * n;
+	double mag, lo, hi, x1, x2, f1, f2;
+	int i;
+
+	/* the inverse transform as the conjugate of a forward one */
+	for (k = 0; k < n; k++) {
+		mag = hypot(sre[k], sim[k]);
+		dcal.xre[k] = mag > 0 ? sre[k] / mag : 0;
+		dcal.xim[k] = mag > 0 ? -sim[k] / mag : 0;
+	}
+	fft_run(&dcal.fft, dcal.xre, dcal.xim);
+	for (k = 1; k < n; k++)
+		if (dcal.xre[k] > dcal.xre[best])
+			best = k;
+	/* then between frames, by golden section on the exact correlation */
+	lo = (best < n / 2 ? (double)best : (double)best - n) - 1;
+	hi = lo + 2;
+	x1 = hi - g * (hi - lo);
+	x2 = lo + g * (hi - lo);
+	f1 = delay_cal_corr(c, x1);
+	f2 = delay_cal_corr(c, x2);
+	for (i = 0; i < 30; i++) {
+		if (f1 > f2) {
+			hi = x2;
+			x2 = x1;
+			f2 = f1;
+			x1 = hi - g * (hi - lo);
+			f1 = delay_cal_corr(c, x1);
+		} else {
+			lo = x1;
+			x1 = x2;
+			f1 = f2;
+			x2 = lo + g * (hi - lo);
+			f2 = delay_cal_corr(c, x2);
+		}
+	}
+	*peak = f1 > f2 ? f1 : f2;
+	return (lo + hi) / 2;
+}
+
+static void delay_cal_stop(void)
+{
+	unsigned int ch = dcal.channels, c;
+	double *lag, peak, latest = 0;
+
+	lag = calloc(ch, sizeof(double));
+	if (!dcal.blocks) {
+		fprintf(stderr, _("Delay calibration needs at least %u frames\n"),
+			DELAY_CAL_BLOCK);
+	} else if (lag) {
+		fprintf(stderr, _("Delay calibration against channel %u, "
+				  "%lu blocks:\n"), dcal.ref, dcal.blocks);
+		for (c = 0; c < ch; c++) {
+			if (c == dcal.ref)
+				continue;
+			lag[c] = delay_cal_lag(c, &peak);
+			if (lag[c] > latest)
+				latest = lag[c];
+			fprintf(stderr, _("  channel %u lags by %+.2f frames "
+					  "(peak %.2f)\n"), c, lag[c], peak);
+		}
+		fprintf(stderr, "  --channel-delay=");
+		for (c = 0; c < ch; c++)
+			fprintf(stderr, "%s%.2f", c ? "," : "", latest - lag[c]);
+		fprintf(stderr, "\n");
+	}
+	free(lag);
+	fft_plan_free(&dcal.fft);
+	free(dcal.in);
+	free(dcal.rre);
+	free(dcal.rim);
+	free(dcal.xre);
+	free(dcal.xim);
+	free(dcal.sre);
+	free(dcal.sim);
+}
+
+static const struct meter meters[] = {
+	{ &spectrum_meter, spectrum_start, spectrum_process, spectrum_stop },
+	{ &loudness_meter, loudness_start, loudness_process, loudness_stop },
+	{ &histogram_meter, histogram_start, histogram_process, histogram_stop },
+	{ &tone_meter, tones_start, tones_process, tones_stop },
+	{ &anomaly_meter, anomalies_start, anomalies_process, anomalies_stop },
+	{ &delay_calibrate, delay_cal_start, delay_cal_process, delay_cal_stop },
+};
+
+#define METER_COUNT	(sizeof(meters) / sizeof(meters[0]))
+
+static int meter_wanted(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < METER_COUNT; i++)
+		if (*meters[i].enabled)
+			return 1;
+	return 0;
+}
+
+static void *meter_thread(void *arg)
+{
+	float *fbuf = meter_ring.fbuf;
+	size_t w, r, n, idx;
+	unsigned int i;
+	int quit;
+
+	for (;;) {
+		quit = __atomic_load_n(&meter_ring.quit, __ATOMIC_ACQUIRE);
+		w = __atomic_load_n(&meter_ring.write_pos, __ATOMIC_ACQUIRE);
+		r = meter_ring.read_pos;
+		if (w == r) {
+			if (quit)
+				break;
+			poll(NULL, 0, METER_POLL_MS);
+			continue;
+		}
+		/* one contiguous piece at a time */
+		idx = r & (meter_ring.capacity - 1);
+		n = w - r;
+		if (n > meter_ring.capacity - idx)
+			n = meter_ring.capacity - idx;
+		if (n > METER_BLOCK)
+			n = METER_BLOCK;
+		meter_to_float(meter_ring.buf + idx * meter_ring.frame_bytes, fbuf,
+			       n * meter_ring.channels, meter_ring.format);
+		__atomic_store_n(&meter_ring.read_pos, r + n, __ATOMIC_RELEASE);
+		for (i = 0; i < METER_COUNT; i++)
+			if (*meters[i].enabled)
+				meters[i].process(fbuf, n);
+	}
+	return NULL;
+}
+
+static void meter_stop(void)
+{
+	unsigned int i;
+
+	if (!meter_ring.running)
+		return;
+	__atomic_store_n(&meter_ring.quit, 1, __ATOMIC_RELEASE);
+	pthread_join(meter_ring.thread, NULL);
+	meter_ring.running = 0;
+	for (i = 0; i < METER_COUNT; i++)
+		if (*meters[i].enabled)
+			meters[i].stop();
+	if (meter_ring.dropped && !quiet_mode)
+		fprintf(stderr, _("Meters fell behind, %lu frames not metered\n"),
+			meter_ring.dropped);
+	free(meter_ring.buf);
+	meter_ring.buf = NULL;
+	free(meter_ring.fbuf);
+	meter_ring.fbuf = NULL;
+}
+
+static int meter_format_ok(snd_pcm_format_t format)
+{
+	if (snd_pcm_format_float(format))
+		return snd_pcm_format_physical_width(format) == 32;
+	return snd_pcm_format_linear(format) &&
+		snd_pcm_format_physical_width(format) <= 32;
+}
+
+/* (re)start the metering thread for the format set_params() chose */
+static void meter_start(void)
+{
+	unsigned int i;
+	int err;
+
+	if (!meter_wanted() || !interleaved)
+		return;
+	if (meter_ring.running && meter_ring.format == hwparams.format &&
+	    meter_ring.channels == hwparams.channels &&
+	    meter_ring.rate == hwparams.rate)
+		return;
+	meter_stop();
+	if (!meter_format_ok(hwparams.format)) {
+		fprintf(stderr, _("Warning: no meters for format %s\n"),
+			snd_pcm_format_name(hwparams.format));
+		return;
+	}
+
+	meter_ring.format = hwparams.format;
+	meter_ring.channels = hwparams.channels;
+	meter_ring.rate = hwparams.rate;
+	meter_ring.frame_bytes = bits_per_frame / 8;
+	/* half a second, and at least a few periods */
+	for (meter_ring.capacity = 1024;
+	     meter_ring.capacity < hwparams.rate / 2 ||
+	     meter_ring.capacity < chunk_size * 4;
+	     meter_ring.capacity <<= 1)
+		;
+	meter_ring.buf = malloc(meter_ring.capacity * meter_ring.frame_bytes);
+	meter_ring.fbuf = malloc(METER_BLOCK * meter_ring.channels * sizeof(float));
+	if (!meter_ring.buf || !meter_ring.fbuf) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
+	}
+	meter_ring.write_pos = meter_ring.read_pos = 0;
+	meter_ring.dropped = 0;
+	meter_ring.quit = 0;
+	for (i = 0; i < METER_COUNT; i++)
+		if (*meters[i].enabled)
+			meters[i].start();
+	err = pthread_create(&meter_ring.thread, NULL, meter_thread, NULL);
+	if (err) {
+		error(_("cannot start metering thread: %s"), strerror(err));
+		prg_exit(EXIT_FAILURE);
+	}
+	meter_ring.running = 1;
+}
+
+/* called from the I/O loops with every block moved, never blocks */
+static void meter_push(const u_char *data, size_t frames)
+{
+	size_t w = meter_ring.write_pos, idx, n;
+	size_t r = __atomic_load_n(&meter_ring.read_pos, __ATOMIC_ACQUIRE);
+
+	if (meter_ring.capacity - (w - r) < frames) {
+		meter_ring.dropped += frames;
+		return;
+	}
+	idx = w & (meter_ring.capacity - 1);
+	n = meter_ring.capacity - idx;
+	if (n > frames)
+		n = frames;
+	memcpy(meter_ring.buf + idx * meter_ring.frame_bytes, data,
+	       n * meter_ring.frame_bytes);
+	memcpy(meter_ring.buf, data + n * meter_ring.frame_bytes,
+	       (frames - n) * meter_ring.frame_bytes);
+	__atomic_store_n(&meter_ring.write_pos, w + frames, __ATOMIC_RELEASE);
+}
+
+static void do_test_position(void)
+{
+	static long counter = 0;
+	static time_t tmr = -1;
+	time_t now;
+	static float availsum, delaysum, samples;
+	static snd_pcm_sframes_t maxavail, maxdelay;
+	static snd_pcm_sframes_t minavail, mindelay;
+	static snd_pcm_sframes_t badavail = 0, baddelay = 0;
+	snd_pcm_sframes_t outofrange;
+	snd_pcm_sframes_t avail, delay, savail, sdelay;
+	snd_pcm_status_t *status;
+	int err;
+
+	snd_pcm_status_alloca(&status);
+	err = snd_pcm_avail_delay(handle, &avail, &delay);
+	if (err < 0)
+		return;
+	err = snd_pcm_status(handle, status);
+	if (err < 0)
+		return;
+	savail = snd_pcm_status_get_avail(status);
+	sdelay = snd_pcm_status_get_delay(status);
+	outofrange = (test_coef * (snd_pcm_sframes_t)buffer_frames) / 2;
+	if (avail > outofrange || avail < -outofrange ||
+	    delay > outofrange || delay < -outofrange) {
+		badavail = avail; baddelay = delay;
+		availsum = delaysum = samples = 0;
+		maxavail = maxdelay = 0;
+		minavail = mindelay = buffer_frames * 16;
+		fprintf(stderr, _("Suspicious buffer position (%li total): "
+			"avail = %li, delay = %li, buffer = %li\n"),
+			++counter, (long)avail, (long)delay, (long)buffer_frames);
+	} else if (savail > outofrange || savail < -outofrange ||
+		   sdelay > outofrange || sdelay < -outofrange) {
+		badavail = savail; baddelay = sdelay;
+		availsum = delaysum = samples = 0;
+		maxavail = maxdelay = 0;
+		minavail = mindelay = buffer_frames * 16;
+		fprintf(stderr, _("Suspicious status buffer position (%li total): "
+			"avail = %li, delay = %li, buffer = %li\n"),
+			++counter, (long)savail, (long)sdelay, (long)buffer_frames);
+	} else if (stream == SND_PCM_STREAM_CAPTURE && avail > delay) {
+		fprintf(stderr, _("Suspicious buffer position avail > delay (%li total): "
+			"avail = %li, delay = %li\n"),
+			++counter, (long)avail, (long)delay);
+	} else if (stream == SND_PCM_STREAM_CAPTURE && savail > sdelay) {
+		fprintf(stderr, _("Suspicious status buffer position avail > delay (%li total): "
+			"avail = %li, delay = %li\n"),
+			++counter, (long)savail, (long)sdelay);
+	} else if (verbose) {
+		time(&now);
+		if (tmr == (time_t) -1) {
+			tmr = now;
+			availsum = delaysum = samples = 0;
+			maxavail = maxdelay = 0;
+			minavail = mindelay = buffer_frames * 16;
+		}
+		if (avail > maxavail)
+			maxavail = avail;
+		if (savail > maxavail)
+			maxavail = savail;
+		if (delay > maxdelay)
+			maxdelay = delay;
+		if (sdelay > maxdelay)
+			maxdelay = sdelay;
+		if (avail < minavail)
+			minavail = avail;
+		if (savail < minavail)
+			minavail = savail;
+		if (delay < mindelay)
+			mindelay = delay;
+		if (sdelay < mindelay)
+			mindelay = sdelay;
+		availsum += avail;
+		delaysum += delay;
+		samples++;
+		if ((maxavail != 0 || maxdelay != 0) && now != tmr) {
+			fprintf(stderr, "BUFPOS: avg%li/%li "
+				"min%li/%li max%li/%li (%li) (%li:%li/%li)\n",
+                         (long)(availsum / samples),
+				(long)(delaysum / samples),
+				(long)minavail, (long)mindelay,
+				(long)maxavail, (long)maxdelay,
+				(long)buffer_frames,
+				counter, badavail, baddelay);
+			tmr = now;
+		}
+	}
+	if (verbose == 1) {
+		fprintf(stderr, _("Status(R/W) (standalone avail=%li delay=%li):\n"), (long)avail, (long)delay);
+		snd_pcm_status_dump(status, log_out);
+	}
+}
+
+/*
+ */
+#ifdef CONFIG_SUPPORT_CHMAP
+static u_char *remap_data(u_char *data, size_t count)
+{
+	static u_char *tmp, *src, *dst;
+	static size_t tmp_size;
+	size_t sample_bytes = bits_per_sample / 8;
+	size_t step = bits_per_frame / 8;
+	size_t chunk_bytes;
+	unsigned int ch, i;
+
+	if (!hw_map)
+		return data;
+
+	chunk_bytes = count * bits_per_frame / 8;
+	if (tmp_size < chunk_bytes) {
+		free(tmp);
+		tmp = malloc(chunk_bytes);
+		if (!tmp) {
+			error(_("not enough memory"));
+			exit(1);
+		}
+		tmp_size = count;
+	}
+
+	src = data;
+	dst = tmp;
+	for (i = 0; i < count; i++) {
+		for (ch = 0; ch < hwparams.channels; ch++) {
+			memcpy(dst, src + sample_bytes * hw_map[ch],
+			       sample_bytes);
+			dst += sample_bytes;
+		}
+		src += step;
+	}
+	return tmp;
+}
+
+static u_char **remap_datav(u_char **data, size_t count)
+{
+	static u_char **tmp;
+	unsigned int ch;
+
+	if (!hw_map)
+		return data;
+
+	if (!tmp) {
+		tmp = malloc(sizeof(*tmp) * hwparams.channels);
+		if (!tmp) {
+			error(_("not enough memory"));
+			exit(1);
+		}
+		for (ch = 0; ch < hwparams.channels; ch++)
+			tmp[ch] = data[hw_map[ch]];
+	}
+	return tmp;
+}
+#else
+#define remap_data(data, count)		(data)
+#define remap_datav(data, count)	(data)
+#endif
+
+/*
+ *  write function
+ */
+
+static ssize_t pcm_write(u_char *data, size_t count)
+{
+	ssize_t r;
+	ssize_t result = 0;
+
+	if (count < chunk_size) {
+		snd_pcm_format_set_silence(hwparams.format, data + count * bits_per_frame / 8, (chunk_size - count) * hwparams.channels);
+		count = chunk_size;
+	}
+	data = remap_data(data, count);
+	while (count > 0 && !in_aborting) {
+		if (test_position)
+			do_test_position();
+		check_stdin();
+		check_control();
+		r = writei_func(handle, data, count);
+		if (test_position)
+			do_test_position();
+		if (r == -EAGAIN || (r >= 0 && (size_t)r < count)) {
+			pcm_wait();
+		} else if (r == -EPIPE) {
+			xrun();
+		} else if (r == -ESTRPIPE) {
+			suspend();
+		} else if (r < 0) {
+			error(_("write error: %s"), snd_strerror(r));
+			prg_exit(EXIT_FAILURE);
+		}
+		if (r > 0) {
+			if (vumeter)
+				compute_max_peak(data, r * hwparams.channels);
+			if (meter_ring.running)
+				meter_push(data, r);
+			result += r;
+			count -= r;
+			frames_total += r;
+			data += r * bits_per_frame / 8;
+		}
+	}
+	return result;
+}
+
+static ssize_t pcm_writev(u_char **data, unsigned int channels, size_t count)
+{
+	ssize_t r;
+	size_t result = 0;
+
+	if (count != chunk_size) {
+		unsigned int channel;
+		size_t offset = count;
+		size_t remaining = chunk_size - count;
+		for (channel = 0; channel < channels; channel++)
+			snd_pcm_format_set_silence(hwparams.format, data[channel] + offset * bits_per_sample / 8, remaining);
+		count = chunk_size;
+	}
+	data = remap_datav(data, count);
+	while (count > 0 && !in_aborting) {
+		unsigned int channel;
+		void *bufs[channels];
+		size_t offset = result;
+		for (channel = 0; channel < channels; channel++)
+			bufs[channel] = data[channel] + offset * bits_per_sample / 8;
+		if (test_position)
+			do_test_position();
+		check_stdin();
+		check_control();
+		r = writen_func(handle, bufs, count);
+		if (test_position)
+			do_test_position();
+		if (r == -EAGAIN || (r >= 0 && (size_t)r < count)) {
+			pcm_wait();
+		} else if (r == -EPIPE) {
+			xrun();
+		} else if (r == -ESTRPIPE) {
+			suspend();
+		} else if (r < 0) {
+			error(_("writev error: %s"), snd_strerror(r));
+			prg_exit(EXIT_FAILURE);
+		}
+		if (r > 0) {
+			if (vumeter) {
+				for (channel = 0; channel < channels; channel++)
+					compute_max_peak(data[channel], r);
+			}
+			result += r;
+			count -= r;
+			frames_total += r;
+		}
+	}
+	return result;
+}
+
+/*
+ *  read function
+ */
+
+static ssize_t pcm_read(u_char *data, size_t rcount)
+{
+	ssize_t r;
+	size_t result = 0;
+	size_t count = rcount;
+
+	if (count != chunk_size) {
+		count = chunk_size;
+	}
+
+	while (count > 0) {
+		if (in_aborting)
+			goto abort;
+		if (test_position)
+			do_test_position();
+		check_stdin();
+		check_control();
+		r = readi_func(handle, data, count);
+		if (test_position)
+			do_test_position();
+		if (r == -EAGAIN || (r >= 0 && (size_t)r < count)) {
+			pcm_wait();
+		} else if (r == -EPIPE) {
+			xrun();
+		} else if (r == -ESTRPIPE) {
+			suspend();
+		} else if (r < 0) {
+			error(_("read error: %s"), snd_strerror(r));
+			prg_exit(EXIT_FAILURE);
+		}
+		if (r > 0) {
+			if (vumeter)
+				compute_max_peak(data, r * hwparams.channels);
+			if (meter_ring.running)
+				meter_push(data, r);
+			result += r;
+			count -= r;
+			frames_total += r;
+			data += r * bits_per_frame / 8;
+		}
+	}
+abort:
+	return rcount;
+}
+
+static ssize_t pcm_readv(u_char **data, unsigned int channels, size_t rcount)
+{
+	ssize_t r;
+	size_t result = 0;
+	size_t count = rcount;
+
+	if (count != chunk_size) {
+		count = chunk_size;
+	}
+
+	while (count > 0) {
+		if (in_aborting)
+			goto abort;
+		unsigned int channel;
+		void *bufs[channels];
+		size_t offset = result;
+		for (channel = 0; channel < channels; channel++)
+			bufs[channel] = data[channel] + offset * bits_per_sample / 8;
+		if (test_position)
+			do_test_position();
+		check_stdin();
+		check_control();
+		r = readn_func(handle, bufs, count);
+		if (test_position)
+			do_test_position();
+		if (r == -EAGAIN || (r >= 0 && (size_t)r < count)) {
+			pcm_wait();
+		} else if (r == -EPIPE) {
+			xrun();
+		} else if (r == -ESTRPIPE) {
+			suspend();
+		} else if (r < 0) {
+			error(_("readv error: %s"), snd_strerror(r));
+			prg_exit(EXIT_FAILURE);
+		}
+		if (r > 0) {
+			if (vumeter) {
+				for (channel = 0; channel < channels; channel++)
+					compute_max_peak(data[channel], r);
+			}
+			result += r;
+			count -= r;
+			frames_total += r;
+		}
+	}
+abort:
+	return rcount;
+}
+
+/* setting the globals for playing raw data */
+static void init_raw_data(void)
+{
+	hwparams = rhwparams;
+}
+
+/* calculate the data count to read from/to dsp */
+static off64_t calc_count(void)
+{
+	off64_t count;
+
+	if (timelimit == 0)
+		if (sampleslimit == 0)
+			count = pbrec_count;
+		else
+			count = snd_pcm_format_size(hwparams.format, sampleslimit * hwparams.channels);
+	else {
+		count = snd_pcm_format_size(hwparams.format, hwparams.rate * hwparams.channels);
+		count *= (off64_t)timelimit;
+	}
+	return count < pbrec_count ? count : pbrec_count;
+}
+
+/*
+ *  packed 24-bit files
+ *
+ *  S24_LE and S32_LE devices carry 24 significant bits in 4 bytes.
+ *  With --file-format=S24_3LE the capture is stored with 3 bytes per
+ *  sample and playback expands such files again, so the hardware keeps
+ *  its container. S32_LE keeps its top 24 bits. On little endian hosts
+ *  four samples are moved as three 32-bit words at a time.
+ */
+
+static int is_s24_container(snd_pcm_format_t format)
+{
+	return format == SND_PCM_FORMAT_S24_LE || format == SND_PCM_FORMAT_S32_LE;
+}
+
+static void pack_s24_3le(const u_char *src, u_char *dst, size_t samples,
+			 snd_pcm_format_t from)
+{
+	int skip = from == SND_PCM_FORMAT_S32_LE;
+
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+	uint32_t s[4], w[3];
+	int shift = skip ? 8 : 0;
+
+	for (; samples >= 4; samples -= 4, src += 16, dst += 12) {
+		memcpy(s, src, sizeof(s));
+		s[0] >>= shift;
+		s[1] >>= shift;
+		s[2] >>= shift;
+		s[3] >>= shift;
+		w[0] = (s[0] & 0xffffff) | s[1] << 24;
+		w[1] = (s[1] >> 8 & 0xffff) | s[2] << 16;
+		w[2] = (s[2] >> 16 & 0xff) | s[3] << 8;
+		memcpy(dst, w, sizeof(w));
+	}
+#endif
+	for (; samples > 0; samples--, src += 4, dst += 3) {
+		dst[0] = src[skip];
+		dst[1] = src[skip + 1];
+		dst[2] = src[skip + 2];
+	}
+}
+
+static void unpack_s24_3le(const u_char *src, u_char *dst, size_t samples,
+			   snd_pcm_format_t to)
+{
+	int s32 = to == SND_PCM_FORMAT_S32_LE;
+
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+	uint32_t w[3], s[4];
+
+	for (; samples >= 4; samples -= 4, src += 12, dst += 16) {
+		memcpy(w, src, sizeof(w));
+		s[0] = w[0] << 8;
+		s[1] = w[0] >> 24 << 8 | w[1] << 16;
+		s[2] = w[1] >> 16 << 8 | w[2] << 24;
+		s[3] = w[2] & 0xffffff00;
+		if (!s32) {
+			/* sign extended into the container */
+			s[0] = (int32_t)s[0] >> 8;
+			s[1] = (int32_t)s[1] >> 8;
+			s[2] = (int32_t)s[2] >> 8;
+			s[3] = (int32_t)s[3] >> 8;
+		}
+		memcpy(dst, s, sizeof(s));
+	}
+#endif
+	for (; samples > 0; samples--, src += 3, dst += 4) {
+		if (s32) {
+			dst[0] = 0;
+			dst[1] = src[0];
+			dst[2] = src[1];
+			dst[3] = src[2];
+		} else {
+			dst[0] = src[0];
+			dst[1] = src[1];
+			dst[2] = src[2];
+			dst[3] = src[2] & 0x80 ? 0xff : 0;
+		}
+	}
+}
+
+/* whether playback reads a file format other than the device's */
+static int playback_converting(void)
+{
+	return stream == SND_PCM_STREAM_PLAYBACK &&
+		file_format != SND_PCM_FORMAT_UNKNOWN &&
+		file_format != hwparams.format;
+}
+
+/* whether playback goes through --channel-delay */
+static int playback_delaying(void)
+{
+	return stream == SND_PCM_STREAM_PLAYBACK && channel_delay_count;
+}
+
+static unsigned long playback_clipped;
+
+/*
+ * safe_read() for playback: count is in device bytes. With another
+ * --file-format the matching number of file samples is read and
+ * expanded (S24_3LE) or converted and clipped (FLOAT_LE) into buf.
+ * With --channel-delay whole frames go through floats and the delay
+ * stage on the way. A partial sample or frame at the end of the file
+ * is dropped.
+ */
+static ssize_t playback_read(int rfd, u_char *buf, size_t count)
+{
+	static u_char *file_buf;
+	static size_t file_buf_size;
+	static float *float_buf;
+	static size_t float_buf_size;
+	snd_pcm_format_t format = playback_converting() ? file_format :
+		hwparams.format;
+	size_t fbytes = snd_pcm_format_physical_width(format) / 8;
+	size_t samples, frames;
+	ssize_t r;
+
+	if (!playback_converting() && !playback_delaying())
+		return safe_read(rfd, buf, count);
+	samples = count / (bits_per_sample / 8);
+	if (playback_delaying())
+		samples -= samples % hwparams.channels;
+	if (samples * fbytes > file_buf_size) {
+		free(file_buf);
+		file_buf_size = samples * fbytes;
+		file_buf = malloc(file_buf_size);
+		if (!file_buf) {
+			error(_("not enough memory"));
+			prg_exit(EXIT_FAILURE);
+		}
+	}
+	r = safe_read(rfd, file_buf, samples * fbytes);
+	if (r <= 0)
+		return r;
+	samples = r / fbytes;
+	if (playback_delaying()) {
+		frames = samples / hwparams.channels;
+		samples = frames * hwparams.channels;
+		if (samples > float_buf_size) {
+			free(float_buf);
+			float_buf_size = samples;
+			float_buf = malloc(float_buf_size * sizeof(float));
+			if (!float_buf) {
+				error(_("not enough memory"));
+				prg_exit(EXIT_FAILURE);
+			}
+		}
+		meter_to_float(file_buf, float_buf, samples, format);
+		channel_delay_process(float_buf, frames, hwparams.channels);
+		playback_clipped += float_to_format(float_buf, buf, samples,
+						    hwparams.format);
+	} else if (file_format == SND_PCM_FORMAT_S24_3LE)
+		unpack_s24_3le(file_buf, buf, samples, hwparams.format);
+	else
+		playback_clipped += float_to_format((float *)file_buf, buf,
+						    samples, hwparams.format);
+	return samples * (bits_per_sample / 8);
+}
+
+/* after each playback, when samples had to be clipped */
+static void playback_report(void)
+{
+	if (playback_clipped && !quiet_mode) {
+		if (playback_converting())
+			fprintf(stderr, _("%lu samples clipped converting %s to %s\n"),
+				playback_clipped, snd_pcm_format_name(file_format),
+				snd_pcm_format_name(hwparams.format));
+		else
+			fprintf(stderr, _("%lu samples clipped by --channel-delay\n"),
+				playback_clipped);
+	}
+	playback_clipped = 0;
+}
+
+/* the --channel-delay state for a new playback stream */
+static void playback_delay_setup(void)
+{
+	if (!playback_delaying())
+		return;
+	if (!interleaved) {
+		error(_("-I does not support --channel-delay"));
+		prg_exit(EXIT_FAILURE);
+	}
+	if (!meter_format_ok(hwparams.format) ||
+	    (playback_converting() && !meter_format_ok(file_format))) {
+		error(_("--channel-delay does not support format %s"),
+		      snd_pcm_format_name(hwparams.format));
+		prg_exit(EXIT_FAILURE);
+	}
+	channel_delay_setup();
+}
+
+/* check --file-format against the format set_params() chose */
+static void file_format_check(void)
+{
+	if (file_format == SND_PCM_FORMAT_UNKNOWN ||
+	    stream != SND_PCM_STREAM_PLAYBACK || file_format == hwparams.format)
+		return;
+	if (file_format == SND_PCM_FORMAT_FLOAT_LE &&
+	    meter_format_ok(hwparams.format))
+		return;
+	if (file_format != SND_PCM_FORMAT_S24_3LE ||
+	    !is_s24_container(hwparams.format)) {
+		error(_("--file-format on playback needs S24_3LE files on an "
+			"S24_LE or S32_LE device, or FLOAT_LE files"));
+		prg_exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * No -f with FLOAT_LE files: play them as FLOAT_LE when the device
+ * takes it, else convert to the widest integer format it has.
+ */
+static int set_fallback_format(snd_pcm_hw_params_t *params)
+{
+	static const snd_pcm_format_t formats[] = {
+		SND_PCM_FORMAT_S32_LE, SND_PCM_FORMAT_S24_LE,
+		SND_PCM_FORMAT_S24_3LE, SND_PCM_FORMAT_S16_LE,
+	};
+	unsigned int i;
+
+	for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+		if (snd_pcm_hw_params_test_format(handle, params, formats[i]) < 0)
+			continue;
+		hwparams.format = formats[i];
+		if (!quiet_mode)
+			fprintf(stderr, _("FLOAT_LE is not available, playing as %s\n"),
+				snd_pcm_format_name(hwparams.format));
+		return snd_pcm_hw_params_set_format(handle, params, hwparams.format);
+	}
+	return -EINVAL;
+}
+
+static void header(char *name)
+{
+	if (!quiet_mode) {
+		if (! name)
+			name = (stream == SND_PCM_STREAM_PLAYBACK) ? "stdout" : "stdin";
+		fprintf(stderr, "%s raw '%s' : ",
+			(stream == SND_PCM_STREAM_PLAYBACK) ? _("Playing") : _("Recording"),
+			name);
+		if (file_format != SND_PCM_FORMAT_UNKNOWN &&
+		    file_format != hwparams.format)
+			fprintf(stderr, stream == SND_PCM_STREAM_PLAYBACK ?
+				_("%s (played as %s), ") : _("%s (captured as %s), "),
+				snd_pcm_format_description(file_format),
+				snd_pcm_format_name(hwparams.format));
+		else
+			fprintf(stderr, "%s, ", snd_pcm_format_description(hwparams.format));
+		if (stream == SND_PCM_STREAM_CAPTURE && decimate_factor > 1)
+			fprintf(stderr, _("Rate %u Hz (captured at %u Hz), "),
+				capture_output_rate(), hwparams.rate);
+		else
+			fprintf(stderr, _("Rate %d Hz, "), hwparams.rate);
+		if (hwparams.channels == 1)
+			fprintf(stderr, _("Mono"));
+		else if (hwparams.channels == 2)
+			fprintf(stderr, _("Stereo"));
+		else
+			fprintf(stderr, _("Channels %i"), hwparams.channels);
+		fprintf(stderr, "\n");
+	}
+}
+
+/* playing raw data */
+
+static void playback_go(int fd, size_t loaded, off64_t count, char *name)
+{
+	int l, r;
+	off64_t written = 0;
+	off64_t c;
+
+	header(name);
+	set_params();
+
+	while (loaded > chunk_bytes && written < count && !in_aborting) {
+		if (pcm_write(audiobuf + written, chunk_size) <= 0)
+			return;
+		written += chunk_bytes;
+		loaded -= chunk_bytes;
+	}
+	if (written > 0 && loaded > 0)
+		memmove(audiobuf, audiobuf + written, loaded);
+
+	l = loaded;
+	while (written < count && !in_aborting) {
+		off64_t left = control_frames_left();
+		if (left == 0)
+			break;
+		do {
+			c = count - written;
+			if (c > chunk_bytes)
+				c = chunk_bytes;
+			if (left > 0 && c > left * bits_per_frame / 8)
+				c = left * bits_per_frame / 8;
+
+			/* c < l, there is more data loaded
+			 * then we actually need to write
+			 */
+			if (c < l)
+				l = c;
+
+			c -= l;
+
+			if (c == 0)
+				break;
+			r = playback_read(fd, audiobuf + l, c);
+			if (r < 0) {
+				perror(name);
+				prg_exit(EXIT_FAILURE);
+			}
+			fdcount += r;
+			if (r == 0)
+				break;
+			l += r;
+		} while ((size_t)l < chunk_bytes);
+		l = l * 8 / bits_per_frame;
+		r = pcm_write(audiobuf, l);
+		if (r != l)
+			break;
+		r = r * bits_per_frame / 8;
+		written += r;
+		l = 0;
+	}
+	if (!in_aborting) {
+		snd_pcm_nonblock(handle, 0);
+		snd_pcm_drain(handle);
+		snd_pcm_nonblock(handle, nonblock);
+	}
+}
+
+static int playback_raw(char *name, int *loaded)
+{
+	init_raw_data();
+	pbrec_count = calc_count();
+	playback_go(fd, *loaded, pbrec_count, name);
+
+	return 0;
+}
+
+/*
+ *  let's play or capture it (capture_type says VOC/WAVE/raw)
+ */
+
+static int open_playback_file(char *name)
+{
+	int pfd;
+
+	if (!strcmp(name, "-"))
+		return fileno(stdin);
+	pfd = open(name, O_RDONLY, 0);
+	if (pfd == -1) {
+		perror(name);
+		prg_exit(EXIT_FAILURE);
+	}
+	if (is_stripe_manifest(pfd)) {
+		close(pfd);
+		pfd = stripe_open_reader(name);
+	}
+	return pfd;
+}
+
+static void playback(char *name)
+{
+	int loaded = 0;
+
+	pbrec_count = LLONG_MAX;
+	fdcount = 0;
+	if (!name || !strcmp(name, "-")) {
+		fd = fileno(stdin);
+		name = "stdin";
+	} else {
+		init_stdin();
+		fd = open_playback_file(name);
+	}
+
+	cur_file_name = name;
+	playback_raw(name, &loaded);
+	playback_report();
+	cur_file_name = NULL;
+
+	if (fd != fileno(stdin))
+		close(fd);
+}
+
+/*
+ *  gapless playback: the device is configured once for all files, the
+ *  next file is opened and its head read ahead while the current one
+ *  plays, and periods are filled across file boundaries, so the stream
+ *  is neither drained nor restarted until the last file ends
+ */
+
+static void playback_gapless(char **names, unsigned int count)
+{
+	unsigned int i;
+	int next_fd;
+	size_t frame_bytes, l = 0;
+	off64_t limit, done;
+	ssize_t r;
+
+	init_raw_data();
+	header(names[0]);
+	set_params();
+	frame_bytes = bits_per_frame / 8;
+
+	next_fd = open_playback_file(names[0]);
+	for (i = 0; i < count && !in_aborting; i++) {
+		fd = next_fd;
+		cur_file_name = names[i];
+		if (i > 0)
+			header(names[i]);
+		if (fd != fileno(stdin))
+			init_stdin();
+		next_fd = -1;
+		if (i + 1 < count) {
+			next_fd = open_playback_file(names[i + 1]);
+#ifdef POSIX_FADV_WILLNEED
+			/* two seconds is well beyond any buffer size */
+			posix_fadvise(next_fd, 0,
+				      (off_t)hwparams.rate * frame_bytes * 2,
+				      POSIX_FADV_WILLNEED);
+#endif
+		}
+
+		pbrec_count = LLONG_MAX;
+		fdcount = 0;
+		limit = calc_count();
+		limit -= limit % frame_bytes;
+		done = 0;
+		while (done < limit && !in_aborting) {
+			size_t c = chunk_bytes - l;
+			off64_t left = control_frames_left();
+			if ((off64_t)c > limit - done)
+				c = limit - done;
+			if (left >= 0) {
+				/* frames still buffered count against the stop */
+				left = left * frame_bytes - l;
+				if (left <= 0)
+					break;
+				if ((off64_t)c > left)
+					c = left;
+			}
+			r = playback_read(fd, audiobuf + l, c);
+			if (r < 0) {
+				perror(names[i]);
+				prg_exit(EXIT_FAILURE);
+			}
+			if (r == 0)
+				break;
+			l += r;
+			done += r;
+			fdcount += r;
+			if (l == chunk_bytes) {
+				if (pcm_write(audiobuf, chunk_size) != (ssize_t)chunk_size)
+					break;
+				l = 0;
+			}
+		}
+		/* drop a trailing partial frame to keep the next file aligned */
+		l -= l % frame_bytes;
+
+		if (fd != fileno(stdin))
+			close(fd);
+		fd = -1;
+		if (control_frames_left() == 0 ||
+		    (control_frames_left() > 0 &&
+		     control_frames_left() * (off64_t)frame_bytes <= (off64_t)l))
+			break;
+	}
+	cur_file_name = NULL;
+	if (next_fd >= 0 && next_fd != fileno(stdin))
+		close(next_fd);
+	if (l > 0 && !in_aborting)
+		pcm_write(audiobuf, l / frame_bytes);
+	playback_report();
+	if (!in_aborting) {
+		snd_pcm_nonblock(handle, 0);
+		snd_pcm_drain(handle);
+		snd_pcm_nonblock(handle, nonblock);
+	}
+}
+
+/**
+ * mystrftime
+ *
+ *   Variant of strftime(3) that supports additional format
+ *   specifiers in the format string.
+ *
+ * Parameters:
+ *
+ *   s	  - destination string
+ *   max	- max number of bytes to write
+ *   userformat - format string
+ *   tm	 - time information
+ *   filenumber - the number of the file, starting at 1
+ *
+ * Returns: number of bytes written to the string s
+ */
+size_t mystrftime(char *s, size_t max, const char *userformat,
+		  const struct tm *tm, const int filenumber)
+{
+	char formatstring[PATH_MAX] = "";
+	char tempstring[PATH_MAX] = "";
+	char *format, *tempstr;
+	const char *pos_userformat;
+
+	format = formatstring;
+
+	/* if mystrftime is called with userformat = NULL we return a zero length string */
+	if (userformat == NULL) {
+		*s = '\0';
+		return 0;
+	}
+
+	for (pos_userformat = userformat; *pos_userformat; ++pos_userformat) {
+		if (*pos_userformat == '%') {
+			tempstr = tempstring;
+			tempstr[0] = '\0';
+			switch (*++pos_userformat) {
+
+				case '\0': // end of string
+					--pos_userformat;
+					break;
+
+				case 'v': // file number 
+					sprintf(tempstr, "%02d", filenumber);
+					break;
+
+				default: // All other codes will be handled by strftime
+					*format++ = '%';
+					*format++ = *pos_userformat;
+					continue;
+			}
+
+			/* If a format specifier was found and used, copy the result. */
+			if (tempstr[0]) {
+				while ((*format = *tempstr++) != '\0')
+					++format;
+				continue;
+			}
+		}
+
+		/* For any other character than % we simply copy the character */
+		*format++ = *pos_userformat;
+	}
+
+	*format = '\0';
+	format = formatstring;
+	return strftime(s, max, format, tm);
+}
+
+/* a sidecar follows when the first capture file is renamed */
+static void rename_sidecar(const char *from, const char *to,
+			   const char *suffix)
+{
+	char a[PATH_MAX+12], b[PATH_MAX+12];
+
+	snprintf(a, sizeof(a), "%s%s", from, suffix);
+	snprintf(b, sizeof(b), "%s%s", to, suffix);
+	remove(b);
+	rename(a, b);
+}
+
+static int new_capture_file(char *name, char *namebuf, size_t namelen,
+			    int filecount)
+{
+	char *s;
+	char buf[PATH_MAX-10];
+	time_t t;
+	struct tm *tmp;
+
+	if (use_strftime) {
+		t = time(NULL);
+		tmp = localtime(&t);
+		if (tmp == NULL) {
+			perror("localtime");
+			prg_exit(EXIT_FAILURE);
+		}
+		if (mystrftime(namebuf, namelen, name, tmp, filecount+1) == 0) {
+			fprintf(stderr, "mystrftime returned 0");
+			prg_exit(EXIT_FAILURE);
+		}
+		return filecount;
+	}
+
+	/* get a copy of the original filename */
+	strncpy(buf, name, sizeof(buf));
+	buf[sizeof(buf)-1] = '\0';
+
+	/* separate extension from filename */
+	s = buf + strlen(buf);
+	while (s > buf && *s != '.' && *s != '/')
+		--s;
+	if (*s == '.')
+		*s++ = 0;
+	else if (*s == '/')
+		s = buf + strlen(buf);
+
+	/* upon first jump to this if block rename the first file */
+	if (filecount == 1) {
+		if (*s)
+			snprintf(namebuf, namelen, "%s-01.%s", buf, s);
+		else
+			snprintf(namebuf, namelen, "%s-01", buf);
+		remove(namebuf);
+		rename(name, namebuf);
+		if (crc_block_size)
+			rename_sidecar(name, namebuf, ".crc32c");
+		if (overview)
+			rename_sidecar(name, namebuf, ".overview");
+		filecount = 2;
+	}
+
+	/* name of the current file */
+	if (*s)
+		snprintf(namebuf, namelen, "%s-%02i.%s", buf, filecount, s);
+	else
+		snprintf(namebuf, namelen, "%s-%02i", buf, filecount);
+
+	return filecount;
+}
+
+/**
+ * create_path
+ *
+ *   This function creates a file path, like mkdir -p. 
+ *
+ * Parameters:
+ *
+ *   path - the path to create
+ *
+ * Returns: 0 on success, -1 on failure
+ * On failure, a message has been printed to stderr.
+ */
+int create_path(const char *path)
+{
+	char *start;
+	mode_t mode = S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+
+	if (path[0] == '/')
+		start = strchr(path + 1, '/');
+	else
+		start = strchr(path, '/');
+
+	while (start) {
+		char *buffer = strdup(path);
+		buffer[start-path] = 0x00;
+
+		if (mkdir(buffer, mode) == -1 && errno != EEXIST) {
+			fprintf(stderr, "Problem creating directory %s", buffer);
+			perror(" ");
+			free(buffer);
+			return -1;
+		}
+		free(buffer);
+		start = strchr(start + 1, '/');
+	}
+	return 0;
+}
+
+static int safe_open(const char *name)
+{
+	int fd;
+
+	fd = open(name, O_WRONLY | O_CREAT, 0644);
+	if (fd == -1) {
+		if (errno != ENOENT || !use_strftime)
+			return -1;
+		if (create_path(name) == 0)
+			fd = open(name, O_WRONLY | O_CREAT, 0644);
+	}
+	return fd;
+}
+
+/*
+ *  CRC32C integrity sidecar
+ *
+ *  With --crc32c every file capture() writes gets a sidecar NAME.crc32c
+ *  holding the CRC32C (Castagnoli) of each crc_block_size block of the
+ *  file, computed by whichever thread writes the data, right after the
+ *  write. --verify reads files back in parallel and checks them against
+ *  their sidecars. The CRC uses the SSE4.2 or ARMv8 CRC instructions
+ *  when the CPU has them.
+ */
+
+#define CRC_MAGIC	"fplay-crc32c"
+
+static uint32_t crc32c_table[8][256];
+
+static void crc32c_init_table(void)
+{
+	uint32_t c;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = (c >> 1) ^ (0x82f63b78 & -(c & 1));
+		crc32c_table[0][i] = c;
+	}
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			crc32c_table[j][i] = (crc32c_table[j - 1][i] >> 8) ^
+				crc32c_table[0][crc32c_table[j - 1][i] & 0xff];
+}
+
+/* slicing by 8, for CPUs without a CRC32C instruction */
+static uint32_t crc32c_sw(uint32_t crc, const u_char *p, size_t len)
+{
+	uint64_t v;
+
+	crc = ~crc;
+	while (len && ((uintptr_t)p & 7)) {
+		crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+		len--;
+	}
+	while (len >= 8) {
+		memcpy(&v, p, 8);
+		v = le64toh(v) ^ crc;
+		crc = crc32c_table[7][v & 0xff] ^
+			crc32c_table[6][(v >> 8) & 0xff] ^
+			crc32c_table[5][(v >> 16) & 0xff] ^
+			crc32c_table[4][(v >> 24) & 0xff] ^
+			crc32c_table[3][(v >> 32) & 0xff] ^
+			crc32c_table[2][(v >> 40) & 0xff] ^
+			crc32c_table[1][(v >> 48) & 0xff] ^
+			crc32c_table[0][v >> 56];
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+	return ~crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const u_char *p, size_t len)
+{
+	uint64_t c = ~crc, v;
+
+	while (len && ((uintptr_t)p & 7)) {
+		c = __builtin_ia32_crc32qi(c, *p++);
+		len--;
+	}
+	while (len >= 8) {
+		memcpy(&v, p, 8);
+		c = __builtin_ia32_crc32di(c, v);
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		c = __builtin_ia32_crc32qi(c, *p++);
+	return ~(uint32_t)c;
+}
+
+static int crc32c_hw_available(void)
+{
+	return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__aarch64__) && defined(__GNUC__)
+#include <sys/auxv.h>
+#include <arm_acle.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32	(1 << 7)
+#endif
+
+__attribute__((target("+crc")))
+static uint32_t crc32c_hw(uint32_t crc, const u_char *p, size_t len)
+{
+	uint64_t v;
+
+	crc = ~crc;
+	while (len && ((uintptr_t)p & 7)) {
+		crc = __crc32cb(crc, *p++);
+		len--;
+	}
+	while (len >= 8) {
+		memcpy(&v, p, 8);
+		crc = __crc32cd(crc, v);
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = __crc32cb(crc, *p++);
+	return ~crc;
+}
+
+static int crc32c_hw_available(void)
+{
+	return !!(getauxval(AT_HWCAP) & HWCAP_CRC32);
+}
+#else
+#define crc32c_hw		crc32c_sw
+#define crc32c_hw_available()	0
+#endif
+
+static uint32_t (*crc32c)(uint32_t crc, const u_char *p, size_t len);
+
+static void crc32c_init(void)
+{
+	if (crc32c)
+		return;
+	crc32c_init_table();
+	crc32c = crc32c_hw_available() ? crc32c_hw : crc32c_sw;
+}
+
+/* one sidecar per open output file, looked up by descriptor */
+struct crc_file {
+	struct crc_file *next;
+	int fd;
+	FILE *out;
+	char *name;
+	uint32_t crc;
+	size_t fill;		/* bytes in the current block */
+	off64_t bytes;
+};
+
+static struct crc_file *crc_files;
+static pthread_mutex_t crc_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void crc_open(int wfd, const char *name)
+{
+	struct crc_file *cf;
+	char path[PATH_MAX+8];
+
+	if (!crc_block_size)
+		return;
+	crc32c_init();
+	snprintf(path, sizeof(path), "%s.crc32c", name);
+	cf = calloc(1, sizeof(*cf));
+	if (!cf || !(cf->name = strdup(path))) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
+	}
+	cf->out = fopen(path, "w");
+	if (!cf->out) {
+		perror(path);
+		prg_exit(EXIT_FAILURE);
+	}
+	fprintf(cf->out, "%s 1\nblock %zu\n", CRC_MAGIC, crc_block_size);
+	cf->fd = wfd;
+	pthread_mutex_lock(&crc_mutex);
+	cf->next = crc_files;
+	crc_files = cf;
+	pthread_mutex_unlock(&crc_mutex);
+}
+
+static struct crc_file *crc_find(int wfd)
+{
+	struct crc_file *cf;
+
+	pthread_mutex_lock(&crc_mutex);
+	for (cf = crc_files; cf && cf->fd != wfd; cf = cf->next)
+		;
+	pthread_mutex_unlock(&crc_mutex);
+	return cf;
+}
+
+/* account for data just written to wfd */
+static void crc_update(int wfd, const u_char *data, size_t len)
+{
+	struct crc_file *cf;
+	size_t n;
+
+	if (!crc_block_size || !(cf = crc_find(wfd)))
+		return;
+	while (len > 0) {
+		n = crc_block_size - cf->fill;
+		if (n > len)
+			n = len;
+		cf->crc = crc32c(cf->crc, data, n);
+		cf->fill += n;
+		cf->bytes += n;
+		data += n;
+		len -= n;
+		if (cf->fill == crc_block_size) {
+			fprintf(cf->out, "%08x\n", cf->crc);
+			cf->crc = 0;
+			cf->fill = 0;
+		}
+	}
+}
+
+/* finish the sidecar of wfd, just before wfd is closed */
+static void crc_close(int wfd)
+{
+	struct crc_file **pp, *cf;
+
+	if (!crc_block_size)
+		return;
+	pthread_mutex_lock(&crc_mutex);
+	for (pp = &crc_files; *pp && (*pp)->fd != wfd; pp = &(*pp)->next)
+		;
+	cf = *pp;
+	if (cf)
+		*pp = cf->next;
+	pthread_mutex_unlock(&crc_mutex);
+	if (!cf)
+		return;
+	if (cf->fill)
+		fprintf(cf->out, "%08x\n", cf->crc);
+	fprintf(cf->out, "bytes %lld\n", (long long)cf->bytes);
+	if (fclose(cf->out))
+		perror(cf->name);
+	free(cf->name);
+	free(cf);
+}
+
+/*
+ * Verification: the blocks of a file are handed out to worker threads
+ * in runs of CRC_VERIFY_RUN, each read with large sequential preads.
+ */
+
+#define CRC_VERIFY_RUN	16
+
+struct crc_verify {
+	const char *name;
+	int fd;
+	size_t block;
+	uint32_t *crcs;
+	off64_t nblocks;
+	off64_t bytes;
+	off64_t next;		/* next block to hand out */
+	off64_t bad;
+	pthread_mutex_t mutex;
+};
+
+static void *crc_verify_thread(void *arg)
+{
+	struct crc_verify *cv = arg;
+	off64_t first, last, i;
+	u_char *buf;
+	ssize_t want, r;
+
+	buf = malloc(cv->block);
+	if (!buf) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
+	}
+	for (;;) {
+		pthread_mutex_lock(&cv->mutex);
+		first = cv->next;
+		cv->next += CRC_VERIFY_RUN;
+		pthread_mutex_unlock(&cv->mutex);
+		if (first >= cv->nblocks)
+			break;
+		last = first + CRC_VERIFY_RUN;
+		if (last > cv->nblocks)
+			last = cv->nblocks;
+		for (i = first; i < last; i++) {
+			want = cv->block;
+			if (cv->bytes >= 0 && (i + 1) * (off64_t)cv->block > cv->bytes)
+				want = cv->bytes - i * (off64_t)cv->block;
+			r = pread(cv->fd, buf, want, i * (off64_t)cv->block);
+			if (r != want || crc32c(0, buf, want) != cv->crcs[i]) {
+				pthread_mutex_lock(&cv->mutex);
+				cv->bad++;
+				fprintf(stderr, _("%s: block %lld at offset %lld: %s\n"),
+					cv->name, (long long)i,
+					(long long)i * cv->block,
+					r != want ? _("short read") : _("CRC mismatch"));
+				pthread_mutex_unlock(&cv->mutex);
+			}
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+static int crc_verify_file(const char *name, int nthreads)
+{
+	struct crc_verify cv;
+	char path[PATH_MAX+8], line[64];
+	pthread_t *threads;
+	struct stat st;
+	off64_t alloc = 0;
+	unsigned int crc;
+	int i, version = 0;
+	FILE *in;
+
+	memset(&cv, 0, sizeof(cv));
+	cv.name = name;
+	cv.bytes = -1;
+	snprintf(path, sizeof(path), "%s.crc32c", name);
+	in = fopen(path, "r");
+	if (!in) {
+		perror(path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), in)) {
+		if (sscanf(line, CRC_MAGIC " %d", &version) == 1 ||
+		    sscanf(line, "block %zu", &cv.block) == 1 ||
+		    sscanf(line, "bytes %lld", (long long *)&cv.bytes) == 1)
+			continue;
+		if (sscanf(line, "%x", &crc) != 1)
+			continue;
+		if (cv.nblocks == alloc) {
+			alloc = alloc ? alloc * 2 : 1024;
+			cv.crcs = realloc(cv.crcs, alloc * sizeof(*cv.crcs));
+			if (!cv.crcs) {
+				error(_("not enough memory"));
+				prg_exit(EXIT_FAILURE);
+			}
+		}
+		cv.crcs[cv.nblocks++] = crc;
+	}
+	fclose(in);
+	if (version != 1 || !cv.block) {
+		error(_("%s: invalid CRC sidecar"), path);
+		free(cv.crcs);
+		return -1;
+	}
+
+	cv.fd = open(name, O_RDONLY);
+	if (cv.fd < 0 || fstat(cv.fd, &st) < 0) {
+		perror(name);
+		free(cv.crcs);
+		return -1;
+	}
+	if (cv.bytes < 0) {
+		/* the capture did not finish, check the complete blocks */
+		if (!quiet_mode)
+			fprintf(stderr, _("%s: sidecar incomplete, checking %lld blocks\n"),
+				name, (long long)cv.nblocks);
+		cv.bytes = st.st_size;
+		if (cv.nblocks * (off64_t)cv.block < cv.bytes)
+			cv.bytes = cv.nblocks * (off64_t)cv.block;
+	} else if (st.st_size != cv.bytes) {
+		fprintf(stderr, _("%s: size %lld, sidecar says %lld\n"), name,
+			(long long)st.st_size, (long long)cv.bytes);
+		cv.bad++;
+	}
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(cv.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	pthread_mutex_init(&cv.mutex, NULL);
+	threads = calloc(nthreads, sizeof(*threads));
+	if (!threads) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&threads[i], NULL, crc_verify_thread, &cv))
+			break;
+	if (!i)
+		crc_verify_thread(&cv);
+	while (i-- > 0)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	close(cv.fd);
+	free(cv.crcs);
+
+	if (!quiet_mode)
+		fprintf(stderr, _("%s: %lld blocks, %s\n"), name,
+			(long long)cv.nblocks, cv.bad ? _("FAILED") : _("OK"));
+	return cv.bad ? -1 : 0;
+}
+
+static int crc_verify_files(char **names, int count)
+{
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	int i, ret = 0;
+
+	crc32c_init();
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads > 16)
+		nthreads = 16;
+	for (i = 0; i < count; i++)
+		if (crc_verify_file(names[i], nthreads) < 0)
+			ret = -1;
+	return ret;
+}
+
+/*
+ *  waveform overview
+ *
+ *  With --overview capture() writes NAME.overview next to every file
+ *  it captures, so that a viewer can draw the whole file without
+ *  reading it. For each channel it holds the minimum, maximum and RMS
+ *  of every bucket of 256, 4096 and 65536 frames, and a summary of the
+ *  whole file. The finest level is streamed out as the capture goes;
+ *  the coarser ones are built from it, kept in memory and appended
+ *  when the file is finished, together with the summaries. Then the
+ *  header is rewritten with where everything is. A header that still
+ *  says 0 frames belongs to a capture that never finished that file.
+ *  The samples are those written to the file, after any processing.
+ *
+ *  Layout, host byte order: struct overview_header; the buckets of
+ *  each level, channels interleaved, as struct overview_bucket, the
+ *  last one possibly partial; one struct overview_summary per channel.
+ */
+
+#define OVERVIEW_MAGIC		"FPLAYOV1"
+#define OVERVIEW_LEVELS		3
+
+static const unsigned int overview_frames[OVERVIEW_LEVELS] = {
+	256, 4096, 65536,
+};
+
+struct overview_header {
+	char magic[8];
+	uint32_t header_size;
+	uint32_t channels;
+	uint32_t rate;
+	uint32_t levels;
+	uint64_t frames;
+	uint64_t summary_offset;
+	struct {
+		uint32_t frames;	/* per bucket */
+		uint32_t reserved;
+		uint64_t buckets;
+		uint64_t offset;	/* of the first bucket */
+	} level[OVERVIEW_LEVELS];
+};
+
+struct overview_bucket {
+	float min, max, rms;
+};
+
+struct overview_summary {
+	float min, max;
+	double mean, rms;
+	uint64_t full_scale;	/* samples at the largest code or beyond */
+};
+
+static struct {
+	FILE *out;
+	char *name;
+	unsigned int channels;
+	snd_pcm_format_t format;
+	float clip_level;
+	float *fbuf;
+	size_t fbuf_samples;
+	struct overview_header hdr;
+	/* the bucket being filled at each level */
+	float *min[OVERVIEW_LEVELS], *max[OVERVIEW_LEVELS];
+	double *sq[OVERVIEW_LEVELS];
+	unsigned int fill[OVERVIEW_LEVELS];
+	double *sum;		/* of the finest bucket, for the mean */
+	struct overview_bucket *coarse[OVERVIEW_LEVELS];
+	size_t coarse_size[OVERVIEW_LEVELS];
+	struct overview_summary *summary;
+} ovw;
+
+static void overview_reset(int level)
+{
+	unsigned int c;
+
+	for (c = 0; c < ovw.channels; c++) {
+		ovw.min[level][c] = HUGE_VALF;
+		ovw.max[level][c] = -HUGE_VALF;
+		ovw.sq[level][c] = 0;
+		if (!level)
+			ovw.sum[c] = 0;
+	}
+	ovw.fill[level] = 0;
+}
+
+static void overview_open(const char *name)
+{
+	char path[PATH_MAX+12];
+	unsigned int c;
+	int l;
+
+	if (!overview)
+		return;
+	ovw.format = capture_file_format();
+	if (!meter_format_ok(ovw.format)) {
+		fprintf(stderr, _("Warning: no overview for format %s\n"),
+			snd_pcm_format_name(ovw.format));
+		return;
+	}
+	snprintf(path, sizeof(path), "%s.overview", name);
+	ovw.name = strdup(path);
+	ovw.channels = hwparams.channels;
+	ovw.clip_level = snd_pcm_format_float(ovw.format) ? 1.0f :
+		1.0f - 1.0f / (1U << (snd_pcm_format_width(ovw.format) - 1));
+	for (l = 0; l < OVERVIEW_LEVELS; l++) {
+		ovw.min[l] = malloc(ovw.channels * sizeof(float));
+		ovw.max[l] = malloc(ovw.channels * sizeof(float));
+		ovw.sq[l] = malloc(ovw.channels * sizeof(double));
+		if (!ovw.min[l] || !ovw.max[l] || !ovw.sq[l])
+			break;
+		ovw.coarse[l] = NULL;
+		ovw.coarse_size[l] = 0;
+	}
+	ovw.sum = malloc(ovw.channels * sizeof(double));
+	ovw.summary = calloc(ovw.channels, sizeof(*ovw.summary));
+	if (!ovw.name || l < OVERVIEW_LEVELS || !ovw.sum || !ovw.summary) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
+	}
+	for (l = 0; l < OVERVIEW_LEVELS; l++)
+		overview_reset(l);
+	for (c = 0; c < ovw.channels; c++) {
+		ovw.summary[c].min = HUGE_VALF;
+		ovw.summary[c].max = -HUGE_VALF;
+	}
+
+	memset(&ovw.hdr, 0, sizeof(ovw.hdr));
+	memcpy(ovw.hdr.magic, OVERVIEW_MAGIC, sizeof(ovw.hdr.magic));
+	ovw.hdr.header_size = sizeof(ovw.hdr);
+	ovw.hdr.channels = ovw.channels;
+	ovw.hdr.rate = capture_output_rate();
+	ovw.hdr.levels = OVERVIEW_LEVELS;
+	for (l = 0; l < OVERVIEW_LEVELS; l++)
+		ovw.hdr.level[l].frames = overview_frames[l];
+	ovw.hdr.level[0].offset = sizeof(ovw.hdr);
+	ovw.out = fopen(path, "w");
+	if (!ovw.out || fwrite(&ovw.hdr, sizeof(ovw.hdr), 1, ovw.out) != 1) {
+		perror(path);
+		prg_exit(EXIT_FAILURE);
+	}
+}
+
+/* a bucket of level is complete (or the file ends): emit, pass it up */
+static void overview_flush(int level)
+{
+	struct overview_bucket *b;
+	unsigned int c, n = ovw.fill[level];
+	int up = level + 1 < OVERVIEW_LEVELS;
+
+	if (level && ovw.hdr.level[level].buckets >= ovw.coarse_size[level]) {
+		ovw.coarse_size[level] = ovw.coarse_size[level] ?
+			ovw.coarse_size[level] * 2 : 64;
+		b = realloc(ovw.coarse[level], ovw.coarse_size[level] *
+			    ovw.channels * sizeof(*b));
+		if (!b) {
+			error(_("not enough memory"));
+			prg_exit(EXIT_FAILURE);
+		}
+		ovw.coarse[level] = b;
+	}
+	for (c = 0; c < ovw.channels; c++) {
+		struct overview_bucket rec = {
+			ovw.min[level][c], ovw.max[level][c],
+			sqrt(ovw.sq[level][c] / n),
+		};
+
+		if (!level) {
+			if (fwrite(&rec, sizeof(rec), 1, ovw.out) != 1) {
+				perror(ovw.name);
+				prg_exit(EXIT_FAILURE);
+			}
+			if (rec.min < ovw.summary[c].min)
+				ovw.summary[c].min = rec.min;
+			if (rec.max > ovw.summary[c].max)
+				ovw.summary[c].max = rec.max;
+			ovw.summary[c].mean += ovw.sum[c];
+			ovw.summary[c].rms += ovw.sq[0][c];
+		} else {
+			ovw.coarse[level][ovw.hdr.level[level].buckets *
+					  ovw.channels + c] = rec;
+		}
+		if (up) {
+			if (rec.min < ovw.min[level + 1][c])
+				ovw.min[level + 1][c] = rec.min;
+			if (rec.max > ovw.max[level + 1][c])
+				ovw.max[level + 1][c] = rec.max;
+			ovw.sq[level + 1][c] += ovw.sq[level][c];
+		}
+	}
+	ovw.hdr.level[level].buckets++;
+	overview_reset(level);
+	if (up) {
+		ovw.fill[level + 1] += n;
+		if (ovw.fill[level + 1] == overview_frames[level + 1])
+			overview_flush(level + 1);
+	}
+}
+
+/* account for bytes just written to the capture file */
+static void overview_update(const u_char *data, size_t len)
+{
+	unsigned int ch = ovw.channels, c;
+	float *min = ovw.min[0], *max = ovw.max[0];
+	double *sq = ovw.sq[0], *sum = ovw.sum;
+	size_t samples, frames, n;
+	const float *f;
+	float x;
+
+	if (!ovw.out)
+		return;
+	samples = len / (snd_pcm_format_physical_width(ovw.format) / 8);
+	frames = samples / ch;
+	if (samples > ovw.fbuf_samples) {
+		free(ovw.fbuf);
+		ovw.fbuf_samples = samples;
+		ovw.fbuf = malloc(samples * sizeof(float));
+		if (!ovw.fbuf) {
+			error(_("not enough memory"));
+			prg_exit(EXIT_FAILURE);
+		}
+	}
+	meter_to_float(data, ovw.fbuf, frames * ch, ovw.format);
+	f = ovw.fbuf;
+	ovw.hdr.frames += frames;
+	while (frames > 0) {
+		n = overview_frames[0] - ovw.fill[0];
+		if (n > frames)
+			n = frames;
+		frames -= n;
+		ovw.fill[0] += n;
+		for (; n > 0; n--, f += ch) {
+			for (c = 0; c < ch; c++) {
+				x = f[c];
+				min[c] = x < min[c] ? x : min[c];
+				max[c] = x > max[c] ? x : max[c];
+				sum[c] += x;
+				sq[c] += x * x;
+				ovw.summary[c].full_scale += fabsf(x) >= ovw.clip_level;
+			}
+		}
+		if (ovw.fill[0] == overview_frames[0])
+			overview_flush(0);
+	}
+}
+
+/* finish the overview of the file just captured */
+static void overview_close(void)
+{
+	struct overview_summary *s;
+	unsigned int c;
+	int l, err = 0;
+
+	if (!ovw.out)
+		return;
+	/* the partial buckets at the end, finest first */
+	for (l = 0; l < OVERVIEW_LEVELS; l++)
+		if (ovw.fill[l])
+			overview_flush(l);
+	for (l = 1; l < OVERVIEW_LEVELS && !err; l++) {
+		ovw.hdr.level[l].offset = ftello(ovw.out);
+		err = ovw.hdr.level[l].buckets &&
+			fwrite(ovw.coarse[l],
+			       sizeof(struct overview_bucket) * ovw.channels,
+			       ovw.hdr.level[l].buckets, ovw.out) !=
+			ovw.hdr.level[l].buckets;
+	}
+	for (c = 0; c < ovw.channels; c++) {
+		s = &ovw.summary[c];
+		if (ovw.hdr.frames) {
+			s->mean /= ovw.hdr.frames;
+			s->rms = sqrt(s->rms / ovw.hdr.frames);
+		} else {
+			s->min = s->max = 0;
+		}
+	}
+	ovw.hdr.summary_offset = ftello(ovw.out);
+	if (err ||
+	    fwrite(ovw.summary, sizeof(*ovw.summary), ovw.channels, ovw.out) !=
+	    ovw.channels || fseeko(ovw.out, 0, SEEK_SET) < 0 ||
+	    fwrite(&ovw.hdr, sizeof(ovw.hdr), 1, ovw.out) != 1)
+		err = 1;
+	if (fclose(ovw.out))
+		err = 1;
+	if (err)
+		perror(ovw.name);
+	ovw.out = NULL;
+	for (l = 0; l < OVERVIEW_LEVELS; l++) {
+		free(ovw.min[l]);
+		free(ovw.max[l]);
+		free(ovw.sq[l]);
+		free(ovw.coarse[l]);
+	}
+	free(ovw.sum);
+	free(ovw.summary);
+	free(ovw.name);
+}
+
+/*
+ *  elastic spill buffer
+ *
+ *  With --spill-buffer capture() hands every period to a queue of
+ *  memory blocks instead of writing it, and a writer thread drains the
+ *  queue to disk. Blocks are allocated on demand up to the configured
+ *  cap and handed back once the queue has drained, so a long write
+ *  stall costs memory, not samples. Warnings are printed as the queue
+ *  crosses a quarter, half, three quarters and 90% of the cap; beyond
+ *  the cap spill_policy decides what gives.
+ */
+
+#define SPILL_BLOCK_SIZE	(256 * 1024)
+#define SPILL_RESERVE		4	/* idle blocks kept for the next burst */
+
+struct spill_block {
+	struct spill_block *next;
+	int fd;
+	int close_fd;		/* close fd once this block is written */
+	size_t len;
+	size_t done;
+	u_char data[SPILL_BLOCK_SIZE];
+};
+
+/* a file to close that has no block left in the queue */
+struct spill_close {
+	struct spill_close *next;
+	int fd;
+};
+
+static const int spill_levels[] = { 25, 50, 75, 90 };
+
+static void *spill_writer(void *arg)
+{
+	struct spill_block *b;
+	size_t from, to;
+	ssize_t r;
+
+	pthread_mutex_lock(&spill.mutex);
+	for (;;) {
+		b = spill.head;
+		while (!spill.quit && !spill.closes &&
+		       !(b && (b->done < b->len || b != spill.tail ||
+			       b->close_fd))) {
+			pthread_cond_wait(&spill.cond, &spill.mutex);
+			b = spill.head;
+		}
+		if (spill.closes) {
+			struct spill_close *c = spill.closes;
+			spill.closes = c->next;
+			pthread_mutex_unlock(&spill.mutex);
+			crc_close(c->fd);
+			close(c->fd);
+			free(c);
+			pthread_mutex_lock(&spill.mutex);
+			continue;
+		}
+		if (!b)
+			break;
+		from = b->done;
+		to = b->len;
+		pthread_mutex_unlock(&spill.mutex);
+
+		r = to > from && !spill.failed ?
+			xwrite(b->fd, b->data + from, to - from) : (ssize_t)(to - from);
+		if (r != (ssize_t)(to - from) && !spill.failed) {
+			error(_("spill buffer write error: %s"), strerror(errno));
+			spill.failed = 1;
+			in_aborting = 1;
+		}
+		crc_update(b->fd, b->data + from, to - from);
+
+		pthread_mutex_lock(&spill.mutex);
+		b->done = to;
+		spill.queued -= to - from;
+		/* after spill_finish() nothing is appended to the tail */
+		if (b->done < b->len ||
+		    (b == spill.tail && !b->close_fd && !spill.quit))
+			continue;	/* still being filled */
+		spill.head = b->next;
+		if (!spill.head)
+			spill.tail = NULL;
+		if (b->close_fd) {
+			pthread_mutex_unlock(&spill.mutex);
+			crc_close(b->fd);
+			close(b->fd);
+			pthread_mutex_lock(&spill.mutex);
+		}
+		if (spill.nfree < SPILL_RESERVE) {
+			b->next = spill.free;
+			spill.free = b;
+			spill.nfree++;
+		} else {
+			free(b);
+			spill.allocated -= SPILL_BLOCK_SIZE;
+		}
+		if (!spill.queued && spill.level) {
+			if (quiet_mode)
+				;
+			else if (spill.overflow)
+				fprintf(stderr, _("Spill buffer drained, %lld bytes dropped "
+						  "while it was full\n"),
+					(long long)spill.dropped_now);
+			else
+				fprintf(stderr, _("Spill buffer drained\n"));
+			spill.level = 0;
+			spill.overflow = 0;
+			spill.dropped_now = 0;
+		}
+		pthread_cond_broadcast(&spill.cond);
+	}
+	pthread_mutex_unlock(&spill.mutex);
+	return NULL;
+}
+
+static void spill_start(void)
+{
+	int err;
+
+	pthread_mutex_init(&spill.mutex, NULL);
+	pthread_cond_init(&spill.cond, NULL);
+	err = pthread_create(&spill.writer, NULL, spill_writer, NULL);
+	if (err) {
+		error(_("cannot start writer thread: %s"), strerror(err));
+		prg_exit(EXIT_FAILURE);
+	}
+}
+
+/* called with spill.mutex held, NULL when the cap is reached */
+static struct spill_block *spill_get_block(int fd)
+{
+	struct spill_block *b;
+
+	if (spill.free) {
+		b = spill.free;
+		spill.free = b->next;
+		spill.nfree--;
+	} else {
+		if (spill.allocated + SPILL_BLOCK_SIZE > (size_t)spill_size * 1024 * 1024)
+			return NULL;
+		b = malloc(sizeof(*b));
+		if (!b)
+			return NULL;
+		spill.allocated += SPILL_BLOCK_SIZE;
+	}
+	b->next = NULL;
+	b->fd = fd;
+	b->close_fd = 0;
+	b->len = b->done = 0;
+	if (spill.tail)
+		spill.tail->next = b;
+	else
+		spill.head = b;
+	spill.tail = b;
+	return b;
+}
+
+/*
+ * Throw away the oldest queued block the writer is not busy with. A
+ * block that closes its file loses its data but stays queued, so the
+ * file is still closed in order.
+ */
+static int spill_drop_oldest(void)
+{
+	struct spill_block *prev, *b;
+	size_t n;
+
+	if (!spill.head)
+		return 0;
+	for (prev = spill.head, b = prev->next; b && b != spill.tail;
+	     prev = b, b = b->next) {
+		n = b->len - b->done;
+		spill.queued -= n;
+		spill.dropped += n;
+		spill.dropped_now += n;
+		if (b->close_fd) {
+			b->len = b->done;
+			continue;
+		}
+		prev->next = b->next;
+		b->next = spill.free;
+		spill.free = b;
+		spill.nfree++;
+		return 1;
+	}
+	return 0;
+}
+
+static void spill_check_level(void)
+{
+	off64_t cap = (off64_t)spill_size * 1024 * 1024;
+	int i, level = 0;
+
+	for (i = 0; i < (int)(sizeof(spill_levels) / sizeof(spill_levels[0])); i++)
+		if (spill.queued * 100 >= cap * spill_levels[i])
+			level = spill_levels[i];
+	if (level > spill.level && !quiet_mode)
+		fprintf(stderr, _("Warning: spill buffer %d%% full (%.1f of %d MiB), "
+				  "disk is behind\n"),
+			level, spill.queued / (1024.0 * 1024), spill_size);
+	if (level > spill.level || !spill.queued)
+		spill.level = level;
+}
+
+/* queue one period for fd, never waiting for the disk unless asked to */
+static void spill_write(int fd, u_char *data, size_t count)
+{
+	struct spill_block *b;
+	size_t n;
+	int dropping = 0;
+
+	pthread_mutex_lock(&spill.mutex);
+	while (count > 0) {
+		b = spill.tail;
+		if (!b || b->fd != fd || b->close_fd || b->len == SPILL_BLOCK_SIZE)
+			b = spill_get_block(fd);
+		if (!b && spill_policy == SPILL_DROP_OLD && spill_drop_oldest()) {
+			dropping = 1;
+			continue;
+		}
+		if (!b && spill_policy == SPILL_BLOCK) {
+			pthread_cond_wait(&spill.cond, &spill.mutex);
+			continue;
+		}
+		if (!b) {
+			/* drop the rest of this period */
+			spill.dropped += count;
+			spill.dropped_now += count;
+			dropping = 1;
+			break;
+		}
+		n = SPILL_BLOCK_SIZE - b->len;
+		if (n > count)
+			n = count;
+		memcpy(b->data + b->len, data, n);
+		b->len += n;
+		spill.queued += n;
+		data += n;
+		count -= n;
+	}
+	if (dropping && !spill.overflow) {
+		spill.overflow = 1;
+		if (!quiet_mode)
+			fprintf(stderr, _("Warning: spill buffer full, dropping the %s data\n"),
+				spill_policy == SPILL_DROP_OLD ? _("oldest") : _("new"));
+	}
+	spill_check_level();
+	pthread_cond_signal(&spill.cond);
+	pthread_mutex_unlock(&spill.mutex);
+}
+
+/*
+ * Close fd once everything queued for it is on disk, never waiting for
+ * the disk or for a free block. Blocks are queued in file order, so if
+ * the tail is not fd's, nothing of fd is left (it got no block, or its
+ * blocks were dropped) and the writer may close it whenever it likes.
+ */
+static void spill_close(int fd)
+{
+	struct spill_block *b;
+	struct spill_close *c;
+
+	pthread_mutex_lock(&spill.mutex);
+	b = spill.tail;
+	if (b && b->fd == fd && !b->close_fd) {
+		b->close_fd = 1;
+	} else {
+		c = malloc(sizeof(*c));
+		if (!c) {
+			pthread_mutex_unlock(&spill.mutex);
+			error(_("not enough memory"));
+			prg_exit(EXIT_FAILURE);
+		}
+		c->fd = fd;
+		c->next = spill.closes;
+		spill.closes = c;
+	}
+	pthread_cond_signal(&spill.cond);
+	pthread_mutex_unlock(&spill.mutex);
+}
+
+static void spill_finish(void)
+{
+	struct spill_block *b;
+
+	pthread_mutex_lock(&spill.mutex);
+	spill.quit = 1;
+	pthread_cond_signal(&spill.cond);
+	pthread_mutex_unlock(&spill.mutex);
+	pthread_join(spill.writer, NULL);
+	while ((b = spill.free) != NULL) {
+		spill.free = b->next;
+		free(b);
+	}
+	spill.nfree = 0;
+	spill.allocated = 0;
+	if (spill.dropped && !quiet_mode)
+		fprintf(stderr, _("Spill buffer dropped %lld bytes in total\n"),
+			(long long)spill.dropped);
+}
+
+/*
+ *  striped capture
+ *
+ *  With --stripe the capture stream is cut into blocks of
+ *  stripe_block_size bytes that go round robin to one file per
+ *  directory, each written by its own thread, so the volumes work in
+ *  parallel. The capture file name itself becomes a small text
+ *  manifest listing the block size, the stripe files in order and,
+ *  once the file is complete, the total size. playback() recognizes
+ *  the manifest and plays the reassembled stream, --unstripe copies it
+ *  out to a plain file.
+ */
+
+#define STRIPE_MAGIC	"fplay-stripe"
+#define STRIPE_DEPTH	4	/* blocks in flight per volume */
+
+struct stripe_block {
+	struct stripe_block *next;
+	size_t len;
+	u_char data[];
+};
+
+struct stripe_volume {
+	char path[PATH_MAX+8];
+	int fd;
+	pthread_t thread;
+	struct stripe_block *head, *tail;
+	off64_t bytes;
+	double busy;		/* seconds spent in write() */
+	int quit;
+};
+
+static struct {
+	struct stripe_volume *vol;
+	struct stripe_block *free;
+	struct stripe_block *cur;	/* being filled by capture */
+	unsigned int next;		/* volume cur goes to */
+	off64_t bytes;
+	unsigned long stalls;
+	struct timespec start;
+	const char *manifest;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+} stripe;
+
+static double stripe_elapsed(const struct timespec *since)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) +
+		(now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+static void *stripe_writer(void *arg)
+{
+	struct stripe_volume *v = arg;
+	struct stripe_block *b;
+	struct timespec t0;
+	ssize_t r;
+
+	pthread_mutex_lock(&stripe.mutex);
+	for (;;) {
+		while (!v->head && !v->quit)
+			pthread_cond_wait(&stripe.cond, &stripe.mutex);
+		b = v->head;
+		if (!b)
+			break;
+		v->head = b->next;
+		if (!v->head)
+			v->tail = NULL;
+		pthread_mutex_unlock(&stripe.mutex);
+
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		r = xwrite(v->fd, b->data, b->len);
+		if (r != (ssize_t)b->len) {
+			error(_("%s: write error: %s"), v->path, strerror(errno));
+			in_aborting = 1;
+		}
+		crc_update(v->fd, b->data, b->len);
+
+		pthread_mutex_lock(&stripe.mutex);
+		v->busy += stripe_elapsed(&t0);
+		v->bytes += b->len;
+		b->next = stripe.free;
+		stripe.free = b;
+		pthread_cond_broadcast(&stripe.cond);
+	}
+	pthread_mutex_unlock(&stripe.mutex);
+	return NULL;
+}
+
+static void stripe_write_manifest(int complete)
+{
+	char tmpname[PATH_MAX+16];
+	unsigned int i;
+	FILE *out;
+
+	snprintf(tmpname, sizeof(tmpname), "%s.%d", stripe.manifest, getpid());
+	out = fopen(tmpname, "w");
+	if (!out) {
+		perror(tmpname);
+		prg_exit(EXIT_FAILURE);
+	}
+	fprintf(out, "%s 1\n", STRIPE_MAGIC);
+	fprintf(out, "format %s\nrate %u\nchannels %u\n",
+		snd_pcm_format_name(capture_file_format()), capture_output_rate(),
+		hwparams.channels);
+	fprintf(out, "block %zu\n", stripe_block_size);
+	if (complete)
+		fprintf(out, "bytes %lld\n", (long long)stripe.bytes);
+	for (i = 0; i < stripe_count; i++)
+		fprintf(out, "stripe %s\n", stripe.vol[i].path);
+	if (fclose(out) || rename(tmpname, stripe.manifest)) {
+		perror(stripe.manifest);
+		remove(tmpname);
+		prg_exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * DIR/NAME.sNN, with the whole capture name escaped into one file name
+ * ('/' as %2F, '%' as %25), so captures whose names only differ in the
+ * directory part never share stripe files.
+ */
+static int stripe_file_name(char *buf, size_t size, const char *dir,
+			    const char *name, unsigned int i)
+{
+	size_t len;
+	int n;
+
+	n = snprintf(buf, size, "%s/", dir);
+	if (n < 0 || (size_t)n >= size)
+		return -1;
+	len = n;
+	for (; *name; name++) {
+		if (*name == '/' || *name == '%')
+			n = snprintf(buf + len, size - len, "%%%02X",
+				     (unsigned char)*name);
+		else
+			n = snprintf(buf + len, size - len, "%c", *name);
+		if (n < 0 || (size_t)n >= size - len)
+			return -1;
+		len += n;
+	}
+	n = snprintf(buf + len, size - len, ".s%02u", i);
+	if (n < 0 || (size_t)n >= size - len)
+		return -1;
+	return 0;
+}
+
+static void stripe_open(const char *name)
+{
+	struct stripe_block *b;
+	unsigned int i;
+	int err;
+
+	if (!stripe.vol) {
+		/* allocated once, reused for every capture file */
+		stripe.vol = calloc(stripe_count, sizeof(*stripe.vol));
+		if (!stripe.vol) {
+			error(_("not enough memory"));
+			prg_exit(EXIT_FAILURE);
+		}
+		for (i = 0; i < stripe_count * STRIPE_DEPTH + 1; i++) {
+			b = malloc(sizeof(*b) + stripe_block_size);
+			if (!b) {
+				error(_("not enough memory"));
+				prg_exit(EXIT_FAILURE);
+			}
+			b->next = stripe.free;
+			stripe.free = b;
+		}
+		pthread_mutex_init(&stripe.mutex, NULL);
+		pthread_cond_init(&stripe.cond, NULL);
+	}
+
+	stripe.manifest = name;
+	stripe.bytes = 0;
+	stripe.next = 0;
+	stripe.stalls = 0;
+	stripe.cur = stripe.free;
+	stripe.free = stripe.cur->next;
+	stripe.cur->len = 0;
+	for (i = 0; i < stripe_count; i++) {
+		struct stripe_volume *v = &stripe.vol[i];
+
+		if (stripe_file_name(v->path, sizeof(v->path), stripe_dirs[i],
+				     name, i) < 0) {
+			error(_("stripe file name too long"));
+			prg_exit(EXIT_FAILURE);
+		}
+		remove(v->path);
+		v->fd = safe_open(v->path);
+		if (v->fd < 0) {
+			perror(v->path);
+			prg_exit(EXIT_FAILURE);
+		}
+		crc_open(v->fd, v->path);
+		v->head = v->tail = NULL;
+		v->bytes = 0;
+		v->busy = 0;
+		v->quit = 0;
+		err = pthread_create(&v->thread, NULL, stripe_writer, v);
+		if (err) {
+			error(_("cannot start writer thread: %s"), strerror(err));
+			prg_exit(EXIT_FAILURE);
+		}
+	}
+	/* a usable manifest even if the capture never finishes */
+	stripe_write_manifest(0);
+	clock_gettime(CLOCK_MONOTONIC, &stripe.start);
+}
+
+/* called with stripe.mutex held */
+static void stripe_queue_cur(void)
+{
+	struct stripe_volume *v = &stripe.vol[stripe.next];
+
+	stripe.cur->next = NULL;
+	if (v->tail)
+		v->tail->next = stripe.cur;
+	else
+		v->head = stripe.cur;
+	v->tail = stripe.cur;
+	stripe.next = (stripe.next + 1) % stripe_count;
+	stripe.cur = NULL;
+	pthread_cond_broadcast(&stripe.cond);
+}
+
+static void stripe_write(u_char *data, size_t count)
+{
+	size_t n;
+
+	while (count > 0) {
+		n = stripe_block_size - stripe.cur->len;
+		if (n > count)
+			n = count;
+		memcpy(stripe.cur->data + stripe.cur->len, data, n);
+		stripe.cur->len += n;
+		stripe.bytes += n;
+		data += n;
+		count -= n;
+		if (stripe.cur->len < stripe_block_size)
+			break;
+
+		pthread_mutex_lock(&stripe.mutex);
+		stripe_queue_cur();
+		if (!stripe.free)
+			stripe.stalls++;
+		while (!stripe.free)
+			pthread_cond_wait(&stripe.cond, &stripe.mutex);
+		stripe.cur = stripe.free;
+		stripe.free = stripe.cur->next;
+		stripe.cur->len = 0;
+		pthread_mutex_unlock(&stripe.mutex);
+	}
+}
+
+static void stripe_close(void)
+{
+	double elapsed;
+	unsigned int i;
+
+	pthread_mutex_lock(&stripe.mutex);
+	if (stripe.cur->len) {
+		stripe_queue_cur();
+	} else {
+		stripe.cur->next = stripe.free;
+		stripe.free = stripe.cur;
+		stripe.cur = NULL;
+	}
+	for (i = 0; i < stripe_count; i++)
+		stripe.vol[i].quit = 1;
+	pthread_cond_broadcast(&stripe.cond);
+	pthread_mutex_unlock(&stripe.mutex);
+
+	for (i = 0; i < stripe_count; i++) {
+		pthread_join(stripe.vol[i].thread, NULL);
+		crc_close(stripe.vol[i].fd);
+		if (close(stripe.vol[i].fd) < 0)
+			perror(stripe.vol[i].path);
+	}
+	stripe_write_manifest(1);
+
+	if (quiet_mode)
+		return;
+	elapsed = stripe_elapsed(&stripe.start);
+	for (i = 0; i < stripe_count; i++) {
+		struct stripe_volume *v = &stripe.vol[i];
+		fprintf(stderr, _("Stripe %s: %lld bytes, %.1f MB/s while writing, "
+				  "busy %.0f%%\n"),
+			v->path, (long long)v->bytes,
+			v->busy > 0 ? v->bytes / v->busy / 1e6 : 0,
+			elapsed > 0 ? v->busy * 100 / elapsed : 0);
+	}
+	fprintf(stderr, _("Striped %lld bytes over %u volumes, %.1f MB/s, "
+			  "%lu waits for a free block\n"),
+		(long long)stripe.bytes, stripe_count,
+		elapsed > 0 ? stripe.bytes / elapsed / 1e6 : 0, stripe.stalls);
+}
+
+/*
+ * Reassembly: a thread reads the stripes block by block in manifest
+ * order and feeds the plain stream into a socket, whose other end
+ * stands in for the file descriptor of an ordinary raw file.
+ */
+
+struct stripe_reader {
+	int out;
+	unsigned int count;
+	int *fds;
+	size_t block;
+	off64_t bytes;		/* -1 if the capture did not finish */
+};
+
+static void *stripe_reader_thread(void *arg)
+{
+	struct stripe_reader *r = arg;
+	off64_t done = 0;
+	u_char *buf;
+	ssize_t n, s, sent;
+	unsigned int k;
+
+	buf = malloc(r->block);
+	for (k = 0; buf && (r->bytes < 0 || done < r->bytes); k++) {
+		n = safe_read(r->fds[k % r->count], buf, r->block);
+		if (n <= 0)
+			break;
+		if (r->bytes >= 0 && n > r->bytes - done)
+			n = r->bytes - done;
+		for (sent = 0; sent < n; sent += s) {
+			s = send(r->out, buf + sent, n - sent, MSG_NOSIGNAL);
+			if (s <= 0)
+				goto __end;	/* the player is gone */
+		}
+		done += n;
+		if ((size_t)n < r->block)
+			break;
+	}
+      __end:
+	for (k = 0; k < r->count; k++)
+		close(r->fds[k]);
+	close(r->out);
+	free(buf);
+	free(r->fds);
+	free(r);
+	return NULL;
+}
+
+/* open a stripe manifest, returns a descriptor delivering the data */
+static int stripe_open_reader(const char *name)
+{
+	struct stripe_reader *r;
+	char line[PATH_MAX + 32], *p;
+	int sv[2], version = 0, err;
+	pthread_t thread;
+	FILE *in;
+
+	in = fopen(name, "r");
+	r = calloc(1, sizeof(*r));
+	if (!in || !r) {
+		perror(name);
+		prg_exit(EXIT_FAILURE);
+	}
+	r->bytes = -1;
+	while (fgets(line, sizeof(line), in)) {
+		line[strcspn(line, "\n")] = '\0';
+		p = strchr(line, ' ');
+		if (!p)
+			continue;
+		*p++ = '\0';
+		if (!strcmp(line, STRIPE_MAGIC)) {
+			version = atoi(p);
+		} else if (!strcmp(line, "block")) {
+			r->block = strtoul(p, NULL, 10);
+		} else if (!strcmp(line, "bytes")) {
+			r->bytes = strtoll(p, NULL, 10);
+		} else if (!strcmp(line, "stripe")) {
+			r->fds = realloc(r->fds, (r->count + 1) * sizeof(int));
+			if (!r->fds) {
+				error(_("not enough memory"));
+				prg_exit(EXIT_FAILURE);
+			}
+			r->fds[r->count] = open(p, O_RDONLY);
+			if (r->fds[r->count] < 0) {
+				perror(p);
+				prg_exit(EXIT_FAILURE);
+			}
+#ifdef POSIX_FADV_SEQUENTIAL
+			posix_fadvise(r->fds[r->count], 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+			r->count++;
+		}
+	}
+	fclose(in);
+	if (version != 1 || !r->block || !r->count) {
+		error(_("%s: invalid stripe manifest"), name);
+		prg_exit(EXIT_FAILURE);
+	}
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+		error(_("socketpair: %s"), strerror(errno));
+		prg_exit(EXIT_FAILURE);
+	}
+	r->out = sv[1];
+	err = pthread_create(&thread, NULL, stripe_reader_thread, r);
+	if (err) {
+		error(_("cannot start reader thread: %s"), strerror(err));
+		prg_exit(EXIT_FAILURE);
+	}
+	pthread_detach(thread);
+	return sv[0];
+}
+
+/* is name a stripe manifest rather than audio data? */
+static int is_stripe_manifest(int pfd)
+{
+	char magic[sizeof(STRIPE_MAGIC)];
+
+	if (pread(pfd, magic, sizeof(magic), 0) != sizeof(magic))
+		return 0;
+	return !memcmp(magic, STRIPE_MAGIC " ", sizeof(magic));
+}
+
+static void stripe_extract(const char *name, const char *out)
+{
+	u_char buf[65536];
+	ssize_t n;
+	int in, ofd;
+
+	in = stripe_open_reader(name);
+	if (!out || !strcmp(out, "-")) {
+		ofd = fileno(stdout);
+		out = "stdout";
+	} else {
+		remove(out);
+		ofd = safe_open(out);
+		if (ofd < 0) {
+			perror(out);
+			prg_exit(EXIT_FAILURE);
+		}
+	}
+	while ((n = safe_read(in, buf, sizeof(buf))) > 0) {
+		if (xwrite(ofd, buf, n) != n) {
+			perror(out);
+			prg_exit(EXIT_FAILURE);
+		}
+	}
+	close(in);
+	if (ofd != fileno(stdout))
+		close(ofd);
+}
+
+/*
+ *  capture processing
+ *
+ *  Optional stages that work on the captured frames before capture()
+ *  writes them. A period is converted to float once, every enabled
+ *  stage runs on it in place and the result is converted back to the
+ *  capture format, rounded and clipped.
+ */
+
+static struct {
+	float *buf;
+	u_char *out;
+	size_t frames;		/* capacity of buf and out */
+	unsigned long clipped;
+} proc;
+
+/* the inverse of meter_to_float(), returns the number of clipped samples */
+static unsigned long float_to_format(const float *src, u_char *dst,
+				     size_t samples, snd_pcm_format_t format)
+{
+	int phys = snd_pcm_format_physical_width(format) / 8;
+	int width = snd_pcm_format_width(format);
+	int little = snd_pcm_format_little_endian(format);
+	int is_float = snd_pcm_format_float(format);
+	uint32_t flip = snd_pcm_format_unsigned(format) ? 1U << (width - 1) : 0;
+	float scale = (float)(1U << (width - 1));
+	int32_t max = (int32_t)((1U << (width - 1)) - 1), min = -max - 1;
+	unsigned long clipped = 0;
+	long v;
+	uint32_t u;
+	int i;
+
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+	if (format == SND_PCM_FORMAT_FLOAT_LE) {
+		memcpy(dst, src, samples * sizeof(float));
+		return 0;
+	}
+	if (format == SND_PCM_FORMAT_S16_LE) {
+		int16_t *d16 = (int16_t *)dst;
+		size_t n;
+		for (n = 0; n < samples; n++) {
+			v = lrintf(src[n] * 32768.0f);
+			if (v > 32767) {
+				v = 32767;
+				clipped++;
+			} else if (v < -32768) {
+				v = -32768;
+				clipped++;
+			}
+			d16[n] = v;
+		}
+		return clipped;
+	}
+#endif
+	while (samples-- > 0) {
+		if (is_float) {
+			memcpy(&u, src++, sizeof(u));
+		} else {
+			v = lrintf(*src++ * scale);
+			if (v > max) {
+				v = max;
+				clipped++;
+			} else if (v < min) {
+				v = min;
+				clipped++;
+			}
+			u = (uint32_t)v ^ flip;
+		}
+		if (little) {
+			for (i = 0; i < phys; i++)
+				dst[i] = u >> (8 * i);
+		} else {
+			for (i = 0; i < phys; i++)
+				dst[phys - 1 - i] = u >> (8 * i);
+		}
+		dst += phys;
+	}
+	return clipped;
+}
+
+/*
+ * IQ correction: removes the DC offset of the I/Q pair in channels 0
+ * and 1 and the gain and phase imbalance between them. The estimators
+ * are exponential averages updated once per period from block sums;
+ * the correction itself is a fixed 2x2 matrix applied to every frame,
+ *
+ *	I' = I
+ *	Q' = (Q / g - I sin(phi)) / cos(phi)
+ *
+ * where g is the Q/I amplitude ratio and phi the phase error, both
+ * derived from the powers of I and Q and their cross correlation.
+ */
+
+#define IQ_DC_TAU	1.0	/* seconds */
+#define IQ_IMBALANCE_TAU	2.0
+
+static struct {
+	double dc_i, dc_q;
+	double p_i, p_q, c_iq;
+	float m21, m22;		/* Q' = m21 * I + m22 * Q */
+	double gain, phase;
+	int primed;
+	off64_t frames;
+	off64_t next_report;
+} iqc;
+
+static void iq_correct_process(float *f, size_t frames, unsigned int channels)
+{
+	double si = 0, sq = 0, sii = 0, sqq = 0, siq = 0, i, q;
+	double a_dc, a_im, s, c;
+	float dc_i, dc_q, m21, m22;
+	size_t n;
+
+	if (!frames)
+		return;
+	/* block statistics, with the current DC estimate removed */
+	dc_i = iqc.dc_i;
+	dc_q = iqc.dc_q;
+	for (n = 0; n < frames; n++) {
+		i = f[n * channels] - dc_i;
+		q = f[n * channels + 1] - dc_q;
+		si += i;
+		sq += q;
+		sii += i * i;
+		sqq += q * q;
+		siq += i * q;
+	}
+	si /= frames;
+	sq /= frames;
+	sii = sii / frames - si * si;
+	sqq = sqq / frames - sq * sq;
+	siq = siq / frames - si * sq;
+
+	if (!iqc.primed) {
+		a_dc = a_im = 1;
+		iqc.primed = 1;
+	} else {
+		a_dc = 1 - exp(-(double)frames / (IQ_DC_TAU * hwparams.rate));
+		a_im = 1 - exp(-(double)frames / (IQ_IMBALANCE_TAU * hwparams.rate));
+	}
+	iqc.dc_i += a_dc * si;
+	iqc.dc_q += a_dc * sq;
+	iqc.p_i += a_im * (sii - iqc.p_i);
+	iqc.p_q += a_im * (sqq - iqc.p_q);
+	iqc.c_iq += a_im * (siq - iqc.c_iq);
+
+	if (iqc.p_i > 1e-12 && iqc.p_q > 1e-12) {
+		iqc.gain = sqrt(iqc.p_q / iqc.p_i);
+		s = iqc.c_iq / sqrt(iqc.p_i * iqc.p_q);
+		if (s > 0.99)
+			s = 0.99;
+		else if (s < -0.99)
+			s = -0.99;
+		c = sqrt(1 - s * s);
+		iqc.phase = asin(s);
+		iqc.m21 = -s / c;
+		iqc.m22 = 1 / (iqc.gain * c);
+	} else {
+		iqc.gain = 1;
+		iqc.phase = 0;
+		iqc.m21 = 0;
+		iqc.m22 = 1;
+	}
+
+	/* the per frame work: DC removal and the 2x2 correction */
+	dc_i = iqc.dc_i;
+	dc_q = iqc.dc_q;
+	m21 = iqc.m21;
+	m22 = iqc.m22;
+	for (n = 0; n < frames; n++) {
+		float fi = f[0] - dc_i, fq = f[1] - dc_q;
+		f[0] = fi;
+		f[1] = m21 * fi + m22 * fq;
+		f += channels;
+	}
+
+	iqc.frames += frames;
+	if (iq_report && iqc.frames >= iqc.next_report) {
+		iqc.next_report = iqc.frames + (off64_t)iq_report * hwparams.rate;
+		if (!quiet_mode)
+			fprintf(stderr, _("IQ: DC I %+.5f Q %+.5f, gain %+.3f dB, "
+					  "phase %+.3f deg\n"),
+				iqc.dc_i, iqc.dc_q, 20 * log10(iqc.gain),
+				iqc.phase * 180 / M_PI);
+	}
+}
+
+/*
+ * --channel-delay: a fixed delay per channel, in frames, to line up
+ * channels whose cables or filters differ. Whole frames come from a
+ * ring buffer per channel. A fractional part goes through a short
+ * windowed sinc FIR, which needs CHANNEL_DELAY_TAPS / 2 - 1 frames of
+ * look-ahead; when any channel is fractional, every channel is delayed
+ * by that much more so that their relative alignment is as asked. The
+ * first frames of each channel are silence, and the last ones stay in
+ * the ring when the stream stops.
+ */
+
+#define CHANNEL_DELAY_TAPS	16
+#define CHANNEL_DELAY_MAX	(1 << 22)	/* frames */
+
+static struct {
+	unsigned int channels;
+	unsigned int *shift;	/* whole frames, bulk delay included */
+	float *coef;		/* channels x CHANNEL_DELAY_TAPS, or NULL */
+	unsigned char *fir;	/* channel uses its coef row */
+	float *ring;		/* channels x (mask + 1) */
+	size_t mask, pos;
+} cdelay;
+
+static int channel_delay_parse(const char *list)
+{
+	char *copy, *tok, *end;
+	double d, *v;
+
+	copy = strdup(list);
+	if (!copy)
+		return -ENOMEM;
+	channel_delay_count = 0;
+	for (tok = strtok(copy, ","); tok; tok = strtok(NULL, ",")) {
+		d = strtod(tok, &end);
+		if (*end || d < 0 || d > CHANNEL_DELAY_MAX) {
+			free(copy);
+			return -EINVAL;
+		}
+		v = realloc(channel_delays,
+			    (channel_delay_count + 1) * sizeof(double));
+		if (!v) {
+			free(copy);
+			return -ENOMEM;
+		}
+		channel_delays = v;
+		channel_delays[channel_delay_count++] = d;
+	}
+	free(copy);
+	return channel_delay_count ? 0 : -EINVAL;
+}
+
+/* for the channels set_params() chose, keeps nothing of an earlier run */
+static void channel_delay_setup(void)
+{
+	unsigned int ch = hwparams.channels, c, bulk = 0, max = 0;
+	double d, frac, x, w, sum;
+	float *h;
+	int k;
+
+	if (channel_delay_count > ch) {
+		error(_("--channel-delay lists %u channels, the stream has %u"),
+		      channel_delay_count, ch);
+		prg_exit(EXIT_FAILURE);
+	}
+	free(cdelay.shift);
+	free(cdelay.coef);
+	free(cdelay.fir);
+	free(cdelay.ring);
+	cdelay.channels = ch;
+	cdelay.shift = calloc(ch, sizeof(unsigned int));
+	cdelay.coef = calloc((size_t)ch * CHANNEL_DELAY_TAPS, sizeof(float));
+	cdelay.fir = calloc(ch, 1);
+	if (!cdelay.shift || !cdelay.coef || !cdelay.fir) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
+	}
+	for (c = 0; c < channel_delay_count; c++)
+		if (channel_delays[c] != floor(channel_delays[c]))
+			bulk = CHANNEL_DELAY_TAPS / 2 - 1;
+	for (c = 0; c < ch; c++) {
+		d = c < channel_delay_count ? channel_delays[c] : 0;
+		frac = d - floor(d);
+		cdelay.shift[c] = (unsigned int)floor(d);
+		if (frac == 0) {
+			cdelay.shift[c] += bulk;
+		} else {
+			cdelay.fir[c] = 1;
+			h = cdelay.coef + (size_t)c * CHANNEL_DELAY_TAPS;
+			sum = 0;
+			for (k = 0; k < CHANNEL_DELAY_TAPS; k++) {
+				x = k - (bulk + frac);
+				/* Blackman, zero CHANNEL_DELAY_TAPS / 2 either side */
+				w = 0.42 + 0.5 * cos(2 * M_PI * x / CHANNEL_DELAY_TAPS) +
+					0.08 * cos(4 * M_PI * x / CHANNEL_DELAY_TAPS);
+				h[k] = sin(M_PI * x) / (M_PI * x) * w;
+				sum += h[k];
+			}
+			for (k = 0; k < CHANNEL_DELAY_TAPS; k++)
+				h[k] /= sum;
+		}
+		if (cdelay.shift[c] > max)
+			max = cdelay.shift[c];
+	}
+	for (cdelay.mask = 1; cdelay.mask < max + CHANNEL_DELAY_TAPS;
+	     cdelay.mask <<= 1)
+		;
+	cdelay.ring = calloc((size_t)ch * cdelay.mask, sizeof(float));
+	if (!cdelay.ring) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
+	}
+	cdelay.mask--;
+	cdelay.pos = 0;
+}
+
+/* delays the interleaved float frames at f in place */
+static void channel_delay_process(float *f, size_t frames, unsigned int channels)
+{
+	size_t mask = cdelay.mask, n, p;
+	unsigned int c, shift;
+	const float *h;
+	float *r, acc;
+	int k;
+
+	for (c = 0; c < channels; c++) {
+		r = cdelay.ring + c * (mask + 1);
+		shift = cdelay.shift[c];
+		h = cdelay.coef + (size_t)c * CHANNEL_DELAY_TAPS;
+		for (n = 0; n < frames; n++) {
+			p = (cdelay.pos + n) & mask;
+			r[p] = f[n * channels + c];
+			if (!cdelay.fir[c]) {
+				f[n * channels + c] = r[(p - shift) & mask];
+				continue;
+			}
+			acc = 0;
+			for (k = 0; k < CHANNEL_DELAY_TAPS; k++)
+				acc += h[k] * r[(p - shift - k) & mask];
+			f[n * channels + c] = acc;
+		}
+	}
+	cdelay.pos += frames;
+}
+
+/*
+ * Decimation by an integer factor: a windowed sinc low pass of
+ * DECIMATE_TAPS_PER_FACTOR taps per unit of the factor, evaluated only
+ * at the output instants, which is what a polyphase decimator computes.
+ * Each channel keeps its own contiguous history so that the inner loop
+ * is a plain dot product; four partial sums keep it pipelined.
+ */
+
+#define DECIMATE_TAPS_PER_FACTOR	24
+
+static struct {
+	int taps;
+	float *coef;
+	float *hist;		/* per channel: taps - 1 old frames, then a period */
+	size_t stride;		/* floats per channel in hist */
+	size_t phase;		/* position of the next output in the period */
+} dec;
+
+static void decimate_setup(void)
+{
+	int n, taps = DECIMATE_TAPS_PER_FACTOR * decimate_factor + 1;
+	double fc = 0.45 / decimate_factor, x, w, sum = 0;
+
+	free(dec.coef);
+	free(dec.hist);
+	dec.taps = taps;
+	dec.stride = taps - 1 + chunk_size;
+	dec.coef = malloc(taps * sizeof(float));
+	dec.hist = calloc(dec.stride * hwparams.channels, sizeof(float));
+	if (!dec.coef || !dec.hist) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
+	}
+	for (n = 0; n < taps; n++) {
+		x = n - (taps - 1) / 2.0;
+		w = 0.42 - 0.5 * cos(2 * M_PI * n / (taps - 1)) +
+			0.08 * cos(4 * M_PI * n / (taps - 1));	/* Blackman */
+		dec.coef[n] = (x == 0 ? 2 * fc : sin(2 * M_PI * fc * x) / (M_PI * x)) * w;
+		sum += dec.coef[n];
+	}
+	for (n = 0; n < taps; n++)
+		dec.coef[n] /= sum;
+	dec.phase = 0;
+}
+
+/* filters and decimates in place, returns the output frame count */
+static size_t decimate_process(float *f, size_t frames, unsigned int channels)
+{
+	size_t keep = dec.taps - 1, out = 0, p, k;
+	unsigned int c;
+	float *h;
+
+	for (c = 0; c < channels; c++) {
+		h = dec.hist + c * dec.stride;
+		for (p = 0; p < frames; p++)
+			h[keep + p] = f[p * channels + c];
+	}
+	for (p = dec.phase; p < frames; p += decimate_factor, out++) {
+		for (c = 0; c < channels; c++) {
+			const float *x = dec.hist + c * dec.stride + p;
+			float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+			for (k = 0; k + 4 <= (size_t)dec.taps; k += 4) {
+				s0 += dec.coef[k] * x[k];
+				s1 += dec.coef[k + 1] * x[k + 1];
+				s2 += dec.coef[k + 2] * x[k + 2];
+				s3 += dec.coef[k + 3] * x[k + 3];
+			}
+			for (; k < (size_t)dec.taps; k++)
+				s0 += dec.coef[k] * x[k];
+			f[out * channels + c] = (s0 + s1) + (s2 + s3);
+		}
+	}
+	dec.phase = p - frames;
+	for (c = 0; c < channels; c++) {
+		h = dec.hist + c * dec.stride;
+		memmove(h, h + frames, keep * sizeof(float));
+	}
+	return out;
+}
+
+/*
+ * Requantization to a narrower --file-format. The samples are rounded
+ * to the grid of the file format here, after TPDF dither and, for
+ * DITHER_SHAPED, second order error feedback that moves the noise
+ * towards the top of the band, so float_to_format() only has to store
+ * them.
+ */
+
+static struct {
+	int bits;		/* of the file format, 0 when not reducing */
+	uint32_t seed;
+	float *e1, *e2;		/* last two quantization errors per channel */
+} dither;
+
+static inline float dither_uniform(void)
+{
+	/* xorshift32 */
+	dither.seed ^= dither.seed << 13;
+	dither.seed ^= dither.seed >> 17;
+	dither.seed ^= dither.seed << 5;
+	return (dither.seed >> 8) * (1.0f / 16777216);
+}
+
+static void dither_setup(void)
+{
+	int bits = snd_pcm_format_width(capture_file_format());
+	int src_bits = snd_pcm_format_float(hwparams.format) ? 25 :
+		significant_bits_per_sample;
+
+	dither.bits = bits < src_bits ? bits : 0;
+	if (!dither.bits || dither_mode == DITHER_NONE)
+		return;
+	dither.seed = 0x9e3779b9;
+	free(dither.e1);
+	free(dither.e2);
+	dither.e1 = calloc(hwparams.channels, sizeof(float));
+	dither.e2 = calloc(hwparams.channels, sizeof(float));
+	if (!dither.e1 || !dither.e2) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
+	}
+}
+
+/* channels from first on, interleaved */
+static void dither_process(float *f, size_t frames, unsigned int channels,
+			   unsigned int first)
+{
+	float scale = ldexpf(1, dither.bits - 1), lsb = 1 / scale;
+	float top = 1 - lsb, v, y;
+	int shaped = dither_mode == DITHER_SHAPED;
+	float *e1 = dither.e1 + first, *e2 = dither.e2 + first;
+	unsigned int c;
+	size_t i;
+
+	for (i = 0; i < frames; i++) {
+		for (c = 0; c < channels; c++, f++) {
+			v = *f;
+			if (shaped)
+				v -= 2 * e1[c] - e2[c];
+			y = rintf((v + (dither_uniform() + dither_uniform() - 1) *
+				   lsb) * scale) * lsb;
+			if (y > top)
+				y = top;
+			else if (y < -1)
+				y = -1;
+			if (shaped) {
+				e2[c] = e1[c];
+				e1[c] = y - v;
+			}
+			*f = y;
+		}
+	}
+}
+
+static int capture_processing(void)
+{
+	return iq_correct || decimate_factor > 1 || channelize_count ||
+		channel_delay_count || capture_file_format() != hwparams.format;
+}
+
+/* the format of the data capture() writes */
+static snd_pcm_format_t capture_file_format(void)
+{
+	return file_format != SND_PCM_FORMAT_UNKNOWN ? file_format :
+		hwparams.format;
+}
+
+/* the rate of the data capture() writes */
+static unsigned int capture_output_rate(void)
+{
+	return hwparams.rate / decimate_factor;
+}
+
+/* size the buffers for the period set_params() chose */
+static void capture_process_setup(void)
+{
+	if (!capture_processing())
+		return;
+	if (iq_correct && hwparams.channels < 2) {
+		error(_("--iq-correct needs at least two channels"));
+		prg_exit(EXIT_FAILURE);
+	}
+	if (!meter_format_ok(hwparams.format)) {
+		error(_("capture processing does not support format %s"),
+		      snd_pcm_format_name(hwparams.format));
+		prg_exit(EXIT_FAILURE);
+	}
+	if (decimate_factor > 1) {
+		if (hwparams.rate % decimate_factor && !quiet_mode)
+			fprintf(stderr, _("Warning: %u Hz is not a multiple of %d, "
+					  "the output rate is %.3f Hz\n"),
+				hwparams.rate, decimate_factor,
+				(double)hwparams.rate / decimate_factor);
+		decimate_setup();
+	}
+	if (channel_delay_count)
+		channel_delay_setup();
+	dither_setup();
+	if (proc.frames >= chunk_size)
+		return;
+	free(proc.buf);
+	free(proc.out);
+	proc.frames = chunk_size;
+	proc.buf = malloc(proc.frames * hwparams.channels * sizeof(float));
+	proc.out = malloc(proc.frames * hwparams.channels * sizeof(float));
+	if (!proc.buf || !proc.out) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
+	}
+}
+
+/* only packing into S24_3LE, which needs no float pass */
+static int capture_packing(void)
+{
+	return capture_file_format() == SND_PCM_FORMAT_S24_3LE &&
+		is_s24_container(hwparams.format) && !iq_correct &&
+		decimate_factor == 1 && !channel_delay_count &&
+		(dither_mode == DITHER_NONE ||
+		 hwparams.format == SND_PCM_FORMAT_S24_LE);
+}
+
+/* -I: convert the samples of one channel at *data to the file format */
+static size_t capture_convert(u_char **data, size_t samples,
+			      unsigned int channel)
+{
+	if (capture_packing()) {
+		pack_s24_3le(*data, proc.out, samples, hwparams.format);
+		*data = proc.out;
+		return samples * 3;
+	}
+	meter_to_float(*data, proc.buf, samples, hwparams.format);
+	if (dither.bits && dither_mode != DITHER_NONE)
+		dither_process(proc.buf, samples, 1, channel);
+	proc.clipped += float_to_format(proc.buf, proc.out, samples,
+					capture_file_format());
+	*data = proc.out;
+	return samples * snd_pcm_format_physical_width(capture_file_format()) / 8;
+}
+
+/*
+ * With --iq-correct as the only stage, the channels after the I/Q pair
+ * go to the file untouched: their samples are copied from the period
+ * instead of through floats, which would keep only 24 bits of S32.
+ */
+static int capture_iq_only(void)
+{
+	return iq_correct && hwparams.channels > 2 && decimate_factor == 1 &&
+		!channel_delay_count && capture_file_format() == hwparams.format;
+}
+
+static void capture_copy_untouched(const u_char *src, u_char *dst,
+				   size_t frames)
+{
+	size_t frame_bytes = bits_per_frame / 8;
+	size_t pair_bytes = 2 * bits_per_sample / 8;
+
+	while (frames-- > 0) {
+		memcpy(dst + pair_bytes, src + pair_bytes, frame_bytes - pair_bytes);
+		src += frame_bytes;
+		dst += frame_bytes;
+	}
+}
+
+/* run the stages on frames at *data, returns the bytes now at *data */
+static size_t capture_process(u_char **data, size_t frames)
+{
+	size_t samples = frames * hwparams.channels;
+
+	if (capture_packing()) {
+		pack_s24_3le(*data, proc.out, samples, hwparams.format);
+		*data = proc.out;
+		return samples * 3;
+	}
+	meter_to_float(*data, proc.buf, samples, hwparams.format);
+	if (iq_correct)
+		iq_correct_process(proc.buf, frames, hwparams.channels);
+	if (channel_delay_count)
+		channel_delay_process(proc.buf, frames, hwparams.channels);
+	if (decimate_factor > 1)
+		frames = decimate_process(proc.buf, frames, hwparams.channels);
+	if (dither.bits && dither_mode != DITHER_NONE)
+		dither_process(proc.buf, frames, hwparams.channels, 0);
+	samples = frames * hwparams.channels;
+	proc.clipped += float_to_format(proc.buf, proc.out, samples,
+					capture_file_format());
+	if (capture_iq_only())
+		capture_copy_untouched(*data, proc.out, frames);
+	*data = proc.out;
+	return samples * snd_pcm_format_physical_width(capture_file_format()) / 8;
+}
+
+static void capture(char *orig_name)
+{
+	int tostdout=0;		/* boolean which describes output stream */
+	int filecount=0;	/* number of files written */
+	char *name = orig_name;	/* current filename */
+	char *output_name = NULL;	/* from an "output" command, owned */
+	char namebuf[PATH_MAX+2];
+	off64_t count, rest;		/* number of bytes to capture */
+	struct stat statbuf;
+
+	/* get number of bytes to capture */
+	count = calc_count();
+	if (count == 0)
+		count = LLONG_MAX;
+	/* compute the number of bytes per file */
+	max_file_size = (long long) max_file_time *
+		snd_pcm_format_size(hwparams.format,
+				    hwparams.rate * hwparams.channels);
+	/* WAVE-file should be even (I'm not sure), but wasting one byte
+	   isn't a problem (this can only be in 8 bit mono) */
+	if (count < LLONG_MAX)
+		count += count % 2;
+	else
+		count -= count % 2;
+
+	/* display verbose output to console */
+	header(name);
+
+	/* setup sound hardware */
+	set_params();
+	capture_process_setup();
+
+	/* write to stdout? */
+	if (!name || !strcmp(name, "-")) {
+		fd = fileno(stdout);
+		name = "stdout";
+		tostdout = 1;
+	}
+	init_stdin();
+	if (spill_size)
+		spill_start();
+
+	do {
+		/* open a file to write */
+		if (!tostdout) {
+			/* upon the second file we start the numbering scheme */
+			if (filecount || use_strftime) {
+				filecount = new_capture_file(orig_name, namebuf,
+							     sizeof(namebuf),
+							     filecount);
+				name = namebuf;
+			}
+			
+			/* open a new file */
+			if (!lstat(name, &statbuf)) {
+				if (S_ISREG(statbuf.st_mode))
+					remove(name);
+			}
+			if (stripe_count) {
+				stripe_open(name);
+			} else {
+				fd = safe_open(name);
+				if (fd < 0) {
+					perror(name);
+					prg_exit(EXIT_FAILURE);
+				}
+				crc_open(fd, name);
+			}
+			overview_open(name);
+			filecount++;
+		}
+		cur_file_name = name;
+
+		/* the first file is open, now wait for the trigger */
+		if (standby && !standby_started)
+			standby_wait();
+
+		rest = count;
+		if (max_file_size && rest > max_file_size)
+			rest = max_file_size;
+
+		/* capture */
+		fdcount = 0;
+		while (rest > 0 && recycle_capture_file == 0 && !in_aborting) {
+			size_t c = (rest <= (off64_t)chunk_bytes) ?
+				(size_t)rest : chunk_bytes;
+			off64_t left = control_frames_left();
+			size_t f;
+			if (left == 0)
+				break;
+			if (left > 0 && (off64_t)c > left * bits_per_frame / 8)
+				c = left * bits_per_frame / 8;
+			f = c * 8 / bits_per_frame;
+			size_t read = pcm_read(audiobuf, f);
+			size_t save;
+			u_char *out = audiobuf;
+			if (read != f)
+				in_aborting = 1;
+			save = read * bits_per_frame / 8;
+			if (capture_processing())
+				save = capture_process(&out, read);
+			if (stripe_count)
+				stripe_write(out, save);
+			else if (spill_size)
+				spill_write(fd, out, save);
+			else if (xwrite(fd, out, save) != save) {
+				perror(name);
+				in_aborting = 1;
+				break;
+			} else
+				crc_update(fd, out, save);
+			overview_update(out, save);
+			count -= c;
+			rest -= c;
+			fdcount += save;
+		}
+
+		/* re-enable SIGUSR1 signal */
+		if (recycle_capture_file) {
+			recycle_capture_file = 0;
+			signal(SIGUSR1, signal_handler_recycle);
+		}
+
+		/* finish sample container */
+		if (!tostdout) {
+			if (stripe_count)
+				stripe_close();
+			else if (spill_size)
+				spill_close(fd);
+			else {
+				crc_close(fd);
+				close(fd);
+			}
+			overview_close();
+			fd = -1;
+		}
+		cur_file_name = NULL;
+
+		/* "output" command: continue with a fresh set of files */
+		if (control_output_name && !tostdout) {
+			free(output_name);
+			orig_name = name = output_name = control_output_name;
+			control_output_name = NULL;
+			filecount = 0;
+		}
+
+		if (in_aborting) {
+			if (spill_size)
+				spill_finish();
+			prg_exit(EXIT_FAILURE);
+		}
+
+		/* repeat the loop when format is raw without timelimit or
+		 * requested counts of data are recorded
+		 */
+	} while (((!timelimit && !sampleslimit) || count > 0) &&
+		 control_frames_left() != 0);
+	if (spill_size)
+		spill_finish();
+	free(output_name);
+	free(control_output_name);
+	control_output_name = NULL;
+}
+
+/*
+ *  scheduled capture
+ *
+ *  The schedule file lists one recording window per line as
+ *  START-END, each time being HH:MM[:SS] in local time. An hour of "*"
+ *  repeats the window every hour, e.g. "*:00-*:15" records the first
+ *  quarter of every hour, "22:30-23:00" once a day. Empty lines and
+ *  lines starting with '#' are ignored.
+ *
+ *  The PCM runs continuously. Window boundaries are mapped to frame
+ *  positions through the PCM timestamps, so every file starts at the
+ *  sample taken at the window start and holds exactly the window
+ *  duration worth of frames. The mapping is refreshed on every period
+ *  before a window opens, so clock drift between windows does not add up.
+ */
+
+struct schedule_window {
+	int hourly;
+	int start;	/* seconds from the start of the day or hour */
+	int end;
+};
+
+static struct schedule_window *schedule;
+static unsigned int schedule_count;
+
+static int parse_schedule_time(const char *str, int *hourly, int *secs)
+{
+	int h, m, s = 0;
+
+	if (str[0] == '*') {
+		if (sscanf(str, "*:%d:%d", &m, &s) < 1)
+			return -1;
+		h = 0;
+		*hourly = 1;
+	} else {
+		if (sscanf(str, "%d:%d:%d", &h, &m, &s) < 2)
+			return -1;
+		*hourly = 0;
+	}
+	if (h < 0 || h > 23 || m < 0 || m > 59 || s < 0 || s > 59)
+		return -1;
+	*secs = h * 3600 + m * 60 + s;
+	return 0;
+}
+
+static void load_schedule(const char *filename)
+{
+	FILE *f;
+	char line[256], *p, *dash;
+	int lineno = 0, hourly_end;
+	struct schedule_window w, *n;
+
+	f = fopen(filename, "r");
+	if (!f) {
+		perror(filename);
+		prg_exit(EXIT_FAILURE);
+	}
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		for (p = line; isspace((unsigned char)*p); p++)
+			;
+		if (!*p || *p == '#')
+			continue;
+		dash = strchr(p, '-');
+		if (!dash ||
+		    parse_schedule_time(p, &w.hourly, &w.start) < 0 ||
+		    parse_schedule_time(dash + 1, &hourly_end, &w.end) < 0 ||
+		    hourly_end != w.hourly) {
+			error(_("%s:%d: invalid window, expected HH:MM[:SS]-HH:MM[:SS]"),
+			      filename, lineno);
+			prg_exit(EXIT_FAILURE);
+		}
+		/* windows that wrap past midnight or the full hour */
+		if (w.end <= w.start)
+			w.end += w.hourly ? 3600 : 86400;
+		n = realloc(schedule, sizeof(*schedule) * (schedule_count + 1));
+		if (!n) {
+			error(_("not enough memory"));
+			prg_exit(EXIT_FAILURE);
+		}
+		schedule = n;
+		schedule[schedule_count++] = w;
+	}
+	fclose(f);
+	if (!schedule_count) {
+		error(_("%s: no recording windows"), filename);
+		prg_exit(EXIT_FAILURE);
+	}
+}
+
+/* the earliest window that has not ended at time t */
+static void schedule_next(time_t t, time_t *wstart, time_t *wend)
+{
+	struct tm tm;
+	time_t base, s, e;
+	unsigned int i;
+	int k;
+
+	*wstart = *wend = 0;
+	for (i = 0; i < schedule_count; i++) {
+		for (k = -1; k <= 1; k++) {
+			localtime_r(&t, &tm);
+			tm.tm_sec = 0;
+			tm.tm_min = 0;
+			if (schedule[i].hourly) {
+				base = mktime(&tm) + k * 3600;
+			} else {
+				tm.tm_hour = 0;
+				tm.tm_mday += k;
+				tm.tm_isdst = -1;
+				base = mktime(&tm);
+			}
+			s = base + schedule[i].start;
+			e = base + schedule[i].end;
+			if (e <= t)
+				continue;
+			if (!*wend || s < *wstart) {
+				*wstart = s;
+				*wend = e;
+			}
+		}
+	}
+}
+
+/* frame position of the sample taken at wall clock time t */
+static off64_t schedule_frame(off64_t frames_read, time_t t)
+{
+	snd_pcm_uframes_t avail;
+	snd_htimestamp_t ts;
+	double delta;
+
+	if (snd_pcm_htimestamp(handle, &avail, &ts) < 0 || !ts.tv_sec) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		avail = 0;
+	}
+	delta = (double)(t - ts.tv_sec) - ts.tv_nsec / 1e9;
+	return frames_read + avail + (off64_t)(delta * hwparams.rate + 0.5);
+}
+
+static void schedule_print(time_t wstart, time_t wend)
+{
+	struct tm tm;
+	char buf[64];
+
+	if (!verbose)
+		return;
+	localtime_r(&wstart, &tm);
+	strftime(buf, sizeof(buf), "%F %T", &tm);
+	fprintf(stderr, _("Next window at %s, %li seconds\n"), buf,
+		(long)(wend - wstart));
+}
+
+static void capture_schedule(char *orig_name)
+{
+	char namebuf[PATH_MAX+2];
+	size_t frame_bytes;
+	off64_t frames_read = 0, chunk_end, start_frame = 0, end_frame = 0;
+	off64_t from, to, count, last_frame;
+	time_t wstart, wend, prev_wend = 0;
+	struct tm tm;
+	int filecount = 0;
+
+	/* -d and -s bound the whole run, windows included */
+	count = calc_count();
+	if (count == 0)
+		count = LLONG_MAX;
+
+	header(orig_name);
+	set_params();
+	frame_bytes = bits_per_frame / 8;
+	last_frame = count / frame_bytes;
+	init_stdin();
+	fd = -1;
+
+	schedule_next(time(NULL), &wstart, &wend);
+	schedule_print(wstart, wend);
+	while (frames_read < last_frame && !in_aborting &&
+	       control_frames_left() != 0) {
+		if (pcm_read(audiobuf, chunk_size) != (ssize_t)chunk_size ||
+		    in_aborting)
+			break;
+		chunk_end = frames_read + chunk_size;
+
+		for (;;) {
+			/* follow the device clock until the file is open */
+			if (fd < 0) {
+				if (wstart == prev_wend) {
+					/* back to back with the last window */
+					start_frame = end_frame;
+				} else {
+					start_frame = schedule_frame(chunk_end, wstart);
+				}
+				if (start_frame < frames_read) {
+					/* started inside the window */
+					start_frame = frames_read;
+					end_frame = schedule_frame(chunk_end, wend);
+				} else {
+					end_frame = start_frame +
+						(off64_t)(wend - wstart) * hwparams.rate;
+				}
+			}
+			/* open the file ahead of the first frame */
+			if (fd < 0 && start_frame - chunk_end < (off64_t)hwparams.rate) {
+				localtime_r(&wstart, &tm);
+				if (mystrftime(namebuf, sizeof(namebuf), orig_name,
+					       &tm, ++filecount) == 0) {
+					error(_("mystrftime returned 0"));
+					prg_exit(EXIT_FAILURE);
+				}
+				remove(namebuf);
+				fd = safe_open(namebuf);
+				if (fd < 0) {
+					perror(namebuf);
+					prg_exit(EXIT_FAILURE);
+				}
+				cur_file_name = namebuf;
+				fdcount = 0;
 			}
-			result += r;
-			count -= r;
+			if (fd < 0)
+				break;
+
+			/* the part of this period inside the window */
+			from = frames_read > start_frame ? frames_read : start_frame;
+			to = chunk_end < end_frame ? chunk_end : end_frame;
+			if (to > last_frame)
+				to = last_frame;
+			if (to > from) {
+				size_t save = (to - from) * frame_bytes;
+				if ((size_t)xwrite(fd, audiobuf + (from - frames_read) * frame_bytes,
+						   save) != save) {
+					perror(namebuf);
+					prg_exit(EXIT_FAILURE);
+				}
+				fdcount += save;
+			}
+			if (end_frame > chunk_end || end_frame > last_frame)
+				break;
+
+			/* window complete, the next one may start in this period */
+			close(fd);
+			fd = -1;
+			cur_file_name = NULL;
+			prev_wend = wend;
+			schedule_next(wend, &wstart, &wend);
+			schedule_print(wstart, wend);
 		}
+		frames_read = chunk_end;
 	}
-abort:
-	return rcount;
+	if (fd >= 0) {
+		close(fd);
+		fd = -1;
+	}
+	cur_file_name = NULL;
 }
 
-/* setting the globals for playing raw data */
-static void init_raw_data(void)
+/*
+ *  triggered capture with pre-roll
+ *
+ *  Every period goes into a ring buffer allocated once at start. While
+ *  idle only the last preroll_time seconds are kept. A trigger (the
+ *  peak level reaching trigger_level percent, SIGUSR2 or the "trigger"
+ *  control command) starts an event: a writer thread opens a new file,
+ *  writes the pre-roll and keeps following the ring until hold_time
+ *  seconds after the last trigger. The capture thread only copies into
+ *  the ring, so slow file I/O never delays reading the PCM. If the
+ *  writer falls so far behind that the ring fills up, new periods are
+ *  dropped and counted.
+ */
+
+struct preroll_ring {
+	u_char *buf;
+	size_t frame_bytes;
+	off64_t capacity;	/* frames */
+	off64_t keep;		/* pre-roll frames kept while idle */
+	off64_t write_pos;	/* frames appended by the capture thread */
+	off64_t flush_pos;	/* oldest frame not yet written or dropped */
+	off64_t end_frame;	/* end of the current event */
+	int active;
+	int quit;
+	int failed;		/* the writer gave up, capture ends */
+	char file[PATH_MAX+2];	/* being written, empty between events */
+	off64_t file_bytes;
+	unsigned long events;
+	unsigned long dropped;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+static struct preroll_ring preroll;
+static char *preroll_name;
+
+static int preroll_copy_out(int wfd, const char *name, off64_t from, off64_t to)
 {
-	hwparams = rhwparams;
+	while (from < to) {
+		off64_t idx = from % preroll.capacity;
+		off64_t n = to - from;
+		size_t bytes;
+		if (n > preroll.capacity - idx)
+			n = preroll.capacity - idx;
+		bytes = n * preroll.frame_bytes;
+		if ((size_t)xwrite(wfd, preroll.buf + idx * preroll.frame_bytes,
+				   bytes) != bytes) {
+			perror(name);
+			return -1;
+		}
+		from += n;
+	}
+	return 0;
 }
 
-/* calculate the data count to read from/to dsp */
-static off64_t calc_count(void)
+/* stop the writer for good; the capture thread sees in_aborting */
+static void preroll_fail(void)
 {
-	off64_t count;
-
-	if (timelimit == 0)
-		if (sampleslimit == 0)
-			count = pbrec_count;
-		else
-			count = snd_pcm_format_size(hwparams.format, sampleslimit * hwparams.channels);
-	else {
-		count = snd_pcm_format_size(hwparams.format, hwparams.rate * hwparams.channels);
-		count *= (off64_t)timelimit;
-	}
-	return count < pbrec_count ? count : pbrec_count;
+	pthread_mutex_lock(&preroll.mutex);
+	preroll.failed = 1;
+	preroll.active = 0;
+	preroll.file[0] = 0;
+	in_aborting = 1;
+	pthread_mutex_unlock(&preroll.mutex);
 }
 
-static void header(char *name)
+static void *preroll_writer(void *arg)
 {
-	if (!quiet_mode) {
-		if (! name)
-			name = (stream == SND_PCM_STREAM_PLAYBACK) ? "stdout" : "stdin";
-		fprintf(stderr, "%s raw '%s' : ",
-			(stream == SND_PCM_STREAM_PLAYBACK) ? _("Playing") : _("Recording"),
-			name);
-		fprintf(stderr, "%s, ", snd_pcm_format_description(hwparams.format));
-		fprintf(stderr, _("Rate %d Hz, "), hwparams.rate);
-		if (hwparams.channels == 1)
-			fprintf(stderr, _("Mono"));
-		else if (hwparams.channels == 2)
-			fprintf(stderr, _("Stereo"));
-		else
-			fprintf(stderr, _("Channels %i"), hwparams.channels);
-		fprintf(stderr, "\n");
+	static char namebuf[PATH_MAX+2];
+	char *name = preroll_name;
+	int filecount = 0, wfd = -1;
+	unsigned long event;
+	off64_t from, to;
+
+	pthread_mutex_lock(&preroll.mutex);
+	for (;;) {
+		while (!preroll.quit &&
+		       !(preroll.active && preroll.flush_pos < preroll.write_pos))
+			pthread_cond_wait(&preroll.cond, &preroll.mutex);
+		if (!preroll.active)
+			break;	/* quit, and nothing left to write */
+
+		from = preroll.flush_pos;
+		to = preroll.write_pos < preroll.end_frame ?
+			preroll.write_pos : preroll.end_frame;
+		event = preroll.events;
+		pthread_mutex_unlock(&preroll.mutex);
+
+		if (wfd < 0) {
+			if (filecount || use_strftime) {
+				filecount = new_capture_file(preroll_name, namebuf,
+							     sizeof(namebuf),
+							     filecount);
+				name = namebuf;
+			}
+			remove(name);
+			wfd = safe_open(name);
+			if (wfd < 0) {
+				perror(name);
+				preroll_fail();
+				return NULL;
+			}
+			filecount++;
+			pthread_mutex_lock(&preroll.mutex);
+			snprintf(preroll.file, sizeof(preroll.file), "%s", name);
+			preroll.file_bytes = 0;
+			pthread_mutex_unlock(&preroll.mutex);
+			if (verbose)
+				fprintf(stderr, _("Event %lu: writing %s\n"),
+					event, name);
+		}
+		if (preroll_copy_out(wfd, name, from, to) < 0) {
+			close(wfd);
+			preroll_fail();
+			return NULL;
+		}
+
+		pthread_mutex_lock(&preroll.mutex);
+		preroll.flush_pos = to;
+		preroll.file_bytes += (to - from) * preroll.frame_bytes;
+		if (preroll.flush_pos >= preroll.end_frame) {
+			/* hold expired, the next trigger starts a new file */
+			preroll.active = 0;
+			preroll.file[0] = 0;
+			pthread_mutex_unlock(&preroll.mutex);
+			close(wfd);
+			wfd = -1;
+			pthread_mutex_lock(&preroll.mutex);
+		}
 	}
+	pthread_mutex_unlock(&preroll.mutex);
+	if (wfd >= 0)
+		close(wfd);
+	return NULL;
 }
 
-/* playing raw data */
-
-static void playback_go(int fd, size_t loaded, off64_t count, char *name)
+/* peak of one period in percent of full scale, as the VU meter shows it */
+static int preroll_level(u_char *data, size_t frames)
 {
-	int l, r;
-	off64_t written = 0;
-	off64_t c;
+	signed int max_peak[2];
+	signed int max = 1 << (significant_bits_per_sample - 1);
 
-	header(name);
-	set_params();
+	if (max <= 0)
+		max = 0x7fffffff;
+	if (find_max_peak(data, frames * hwparams.channels, 1, max_peak) < 0)
+		return 0;
+	if (max_peak[0] > max)
+		max_peak[0] = max;
+	return (long long)max_peak[0] * 100 / max;
+}
 
-	while (loaded > chunk_bytes && written < count && !in_aborting) {
-		if (pcm_write(audiobuf + written, chunk_size) <= 0)
-			return;
-		written += chunk_bytes;
-		loaded -= chunk_bytes;
+static void preroll_append(u_char *data, size_t frames, int trigger)
+{
+	static char file[PATH_MAX+2];
+	off64_t idx, n;
+	unsigned long dropped;
+
+	pthread_mutex_lock(&preroll.mutex);
+	/* the control status reads these on this thread */
+	strcpy(file, preroll.file);
+	cur_file_name = *file ? file : NULL;
+	fdcount = preroll.file_bytes;
+	if (preroll.write_pos + (off64_t)frames - preroll.flush_pos > preroll.capacity) {
+		/* the writer is behind, never wait for it */
+		preroll.dropped += frames;
+		dropped = preroll.dropped;
+		pthread_mutex_unlock(&preroll.mutex);
+		if (!quiet_mode)
+			fprintf(stderr, _("Warning: pre-roll ring full, %lu frames dropped\n"),
+				dropped);
+		return;
 	}
-	if (written > 0 && loaded > 0)
-		memmove(audiobuf, audiobuf + written, loaded);
+	n = frames;
+	idx = preroll.write_pos % preroll.capacity;
+	if (n > preroll.capacity - idx)
+		n = preroll.capacity - idx;
+	memcpy(preroll.buf + idx * preroll.frame_bytes, data,
+	       n * preroll.frame_bytes);
+	memcpy(preroll.buf, data + n * preroll.frame_bytes,
+	       (frames - n) * preroll.frame_bytes);
+	preroll.write_pos += frames;
+	if (!preroll.active && preroll.write_pos - preroll.flush_pos > preroll.keep)
+		preroll.flush_pos = preroll.write_pos - preroll.keep;
+	if (trigger && !preroll.failed) {
+		if (!preroll.active) {
+			preroll.active = 1;
+			preroll.events++;
+		}
+		preroll.end_frame = preroll.write_pos +
+			(off64_t)hold_time * hwparams.rate;
+	}
+	if (preroll.active)
+		pthread_cond_signal(&preroll.cond);
+	pthread_mutex_unlock(&preroll.mutex);
+}
 
-	l = loaded;
-	while (written < count && !in_aborting) {
-		do {
-			c = count - written;
-			if (c > chunk_bytes)
-				c = chunk_bytes;
+static void capture_triggered(char *orig_name)
+{
+	pthread_t writer;
+	off64_t count, done = 0;
+	off64_t headroom;
+	int trigger, err;
 
-			/* c < l, there is more data loaded
-			 * then we actually need to write
-			 */
-			if (c < l)
-				l = c;
+	count = calc_count();
+	if (count == 0)
+		count = LLONG_MAX;
 
-			c -= l;
+	header(orig_name);
+	set_params();
+	init_stdin();
 
-			if (c == 0)
-				break;
-			r = safe_read(fd, audiobuf + l, c);
-			if (r < 0) {
-				perror(name);
-				prg_exit(EXIT_FAILURE);
-			}
-			fdcount += r;
-			if (r == 0)
-				break;
-			l += r;
-		} while ((size_t)l < chunk_bytes);
-		l = l * 8 / bits_per_frame;
-		r = pcm_write(audiobuf, l);
-		if (r != l)
-			break;
-		r = r * bits_per_frame / 8;
-		written += r;
-		l = 0;
+	/* pre-roll plus room for the writer to lag behind */
+	preroll.frame_bytes = bits_per_frame / 8;
+	preroll.keep = (off64_t)preroll_time * hwparams.rate;
+	headroom = (off64_t)hwparams.rate * 2;
+	if (headroom < preroll.keep)
+		headroom = preroll.keep;
+	preroll.capacity = preroll.keep + headroom + chunk_size;
+	preroll.buf = malloc(preroll.capacity * preroll.frame_bytes);
+	if (!preroll.buf) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
 	}
-	if (!in_aborting) {
-		snd_pcm_nonblock(handle, 0);
-		snd_pcm_drain(handle);
-		snd_pcm_nonblock(handle, nonblock);
+	/* fault the whole ring in now rather than on the first pass */
+	memset(preroll.buf, 0, preroll.capacity * preroll.frame_bytes);
+	pthread_mutex_init(&preroll.mutex, NULL);
+	pthread_cond_init(&preroll.cond, NULL);
+	preroll_name = orig_name;
+	err = pthread_create(&writer, NULL, preroll_writer, NULL);
+	if (err) {
+		error(_("cannot start writer thread: %s"), strerror(err));
+		prg_exit(EXIT_FAILURE);
 	}
-}
 
-static int playback_raw(char *name, int *loaded)
-{
-	init_raw_data();
-	pbrec_count = calc_count();
-	playback_go(fd, *loaded, pbrec_count, name);
+	while (done < count && !in_aborting && control_frames_left() != 0) {
+		if (pcm_read(audiobuf, chunk_size) != (ssize_t)chunk_size ||
+		    in_aborting)
+			break;
+		trigger = preroll_trigger;
+		preroll_trigger = 0;
+		if (trigger_level > 0 &&
+		    preroll_level(audiobuf, chunk_size) >= trigger_level)
+			trigger = 1;
+		preroll_append(audiobuf, chunk_size, trigger);
+		done += chunk_bytes;
+	}
 
-	return 0;
+	/* write out what the current event has so far */
+	pthread_mutex_lock(&preroll.mutex);
+	preroll.quit = 1;
+	if (preroll.end_frame > preroll.write_pos)
+		preroll.end_frame = preroll.write_pos;
+	pthread_cond_signal(&preroll.cond);
+	pthread_mutex_unlock(&preroll.mutex);
+	pthread_join(writer, NULL);
+
+	if (!quiet_mode)
+		fprintf(stderr, _("%lu events recorded, %lu frames dropped\n"),
+			preroll.events, preroll.dropped);
+	free(preroll.buf);
+	preroll.buf = NULL;
+	cur_file_name = NULL;
+	if (preroll.failed)
+		prg_exit(EXIT_FAILURE);
 }
 
 /*
- *  let's play or capture it (capture_type says VOC/WAVE/raw)
+ *  black box capture
+ *
+ *  The box is one file of fixed size: a header page followed by a ring
+ *  of blackbox_time seconds of audio. It is preallocated when capture
+ *  starts and then only ever overwritten in place, so it never grows,
+ *  never rotates and always holds the most recent audio. The header is
+ *  rewritten about once a second with the ring write offset and the
+ *  wall clock times of the oldest and newest samples. Between updates
+ *  the header also says how many frames may be written past its write
+ *  offset, 0 once capture ends cleanly: after a crash those frames may
+ *  be newer than the header knows, and --blackbox-extract, which reads
+ *  the box back in order, leaves them out rather than play them as the
+ *  oldest.
  */
 
-static void playback(char *name)
+#define BLACKBOX_MAGIC		"FPLAYBB1"
+#define BLACKBOX_HEADER_SIZE	4096
+
+/* host byte order */
+struct blackbox_header {
+	char magic[8];
+	uint32_t header_size;
+	uint32_t format;	/* snd_pcm_format_t */
+	uint32_t channels;
+	uint32_t rate;
+	uint64_t data_bytes;	/* size of the ring, whole frames */
+	uint64_t write_offset;	/* next byte written, from the ring start */
+	uint64_t frames;	/* frames written since capture started */
+	int64_t oldest_sec;	/* CLOCK_REALTIME of the oldest frame */
+	int64_t oldest_nsec;
+	int64_t newest_sec;	/* CLOCK_REALTIME of the end of the ring */
+	int64_t newest_nsec;
+	uint64_t unsynced;	/* frames that may follow write_offset unrecorded */
+};
+
+/* one time anchor per header update, to date the oldest frame */
+struct blackbox_anchors {
+	struct {
+		off64_t frame;
+		struct timespec ts;
+	} *ring;
+	unsigned int size, first, used;
+};
+
+static double timespec_seconds(const struct timespec *ts)
 {
-	int loaded = 0;
+	return ts->tv_sec + ts->tv_nsec / 1e9;
+}
 
-	pbrec_count = LLONG_MAX;
-	fdcount = 0;
-	if (!name || !strcmp(name, "-")) {
-		fd = fileno(stdin);
-		name = "stdin";
-	} else {
-		init_stdin();
-		if ((fd = open(name, O_RDONLY, 0)) == -1) {
-			perror(name);
-			prg_exit(EXIT_FAILURE);
-		}
+static void split_seconds(double t, int64_t *sec, int64_t *nsec)
+{
+	*sec = (int64_t)t;
+	*nsec = (int64_t)((t - *sec) * 1e9);
+	if (*nsec < 0) {
+		*sec -= 1;
+		*nsec += 1000000000;
 	}
+}
 
-	playback_raw(name, &loaded);
+/* wall clock time of the frame that the next read returns */
+static void blackbox_now(struct timespec *now)
+{
+	snd_pcm_uframes_t avail;
+	double t;
 
-	if (fd != fileno(stdin))
-		close(fd);
+	if (snd_pcm_htimestamp(handle, &avail, now) < 0 || !now->tv_sec) {
+		clock_gettime(CLOCK_REALTIME, now);
+		return;
+	}
+	t = timespec_seconds(now) - (double)avail / hwparams.rate;
+	now->tv_sec = (time_t)t;
+	now->tv_nsec = (long)((t - now->tv_sec) * 1e9);
 }
 
-/**
- * mystrftime
- *
- *   Variant of strftime(3) that supports additional format
- *   specifiers in the format string.
- *
- * Parameters:
- *
- *   s	  - destination string
- *   max	- max number of bytes to write
- *   userformat - format string
- *   tm	 - time information
- *   filenumber - the number of the file, starting at 1
- *
- * Returns: number of bytes written to the string s
- */
-size_t mystrftime(char *s, size_t max, const char *userformat,
-		  const struct tm *tm, const int filenumber)
+static void blackbox_write_header(int bfd, struct blackbox_header *hdr)
 {
-	char formatstring[PATH_MAX] = "";
-	char tempstring[PATH_MAX] = "";
-	char *format, *tempstr;
-	const char *pos_userformat;
+	char page[BLACKBOX_HEADER_SIZE];
 
-	format = formatstring;
+	memset(page, 0, sizeof(page));
+	memcpy(page, hdr, sizeof(*hdr));
+	if (pwrite(bfd, page, sizeof(page), 0) != sizeof(page)) {
+		error(_("black box header write error: %s"), strerror(errno));
+		prg_exit(EXIT_FAILURE);
+	}
+}
 
-	/* if mystrftime is called with userformat = NULL we return a zero length string */
-	if (userformat == NULL) {
-		*s = '\0';
-		return 0;
+/* record where the ring stands now and rewrite the header */
+static void blackbox_sync(int bfd, struct blackbox_header *hdr,
+			  struct blackbox_anchors *an, off64_t write_offset)
+{
+	off64_t ring_frames = hdr->data_bytes / (bits_per_frame / 8);
+	off64_t oldest;
+	unsigned int i;
+	struct timespec now;
+
+	blackbox_now(&now);
+	if (an->used == an->size) {
+		an->first = (an->first + 1) % an->size;
+		an->used--;
 	}
+	i = (an->first + an->used++) % an->size;
+	an->ring[i].frame = hdr->frames;
+	an->ring[i].ts = now;
+
+	/* drop the anchors that are older than the ring */
+	oldest = (off64_t)hdr->frames > ring_frames ?
+		(off64_t)hdr->frames - ring_frames : 0;
+	while (an->used > 1 &&
+	       an->ring[(an->first + 1) % an->size].frame <= oldest) {
+		an->first = (an->first + 1) % an->size;
+		an->used--;
+	}
+	i = an->first;
+	if (an->ring[i].frame > oldest) {
+		/* nothing before the oldest frame, assume the nominal rate */
+		split_seconds(timespec_seconds(&now) -
+			      (double)(hdr->frames - oldest) / hwparams.rate,
+			      &hdr->oldest_sec, &hdr->oldest_nsec);
+	} else {
+		split_seconds(timespec_seconds(&an->ring[i].ts) +
+			      (double)(oldest - an->ring[i].frame) / hwparams.rate,
+			      &hdr->oldest_sec, &hdr->oldest_nsec);
+	}
+	hdr->newest_sec = now.tv_sec;
+	hdr->newest_nsec = now.tv_nsec;
+	hdr->write_offset = write_offset;
+	blackbox_write_header(bfd, hdr);
+}
 
-	for (pos_userformat = userformat; *pos_userformat; ++pos_userformat) {
-		if (*pos_userformat == '%') {
-			tempstr = tempstring;
-			tempstr[0] = '\0';
-			switch (*++pos_userformat) {
+static void capture_blackbox(char *name)
+{
+	struct blackbox_header hdr;
+	struct blackbox_anchors anchors;
+	size_t frame_bytes;
+	off64_t count, done = 0, ring_frames, next_sync, offset;
+	int bfd, err, failed = 0;
 
-				case '\0': // end of string
-					--pos_userformat;
-					break;
+	count = calc_count();
+	if (count == 0)
+		count = LLONG_MAX;
 
-				case 'v': // file number 
-					sprintf(tempstr, "%02d", filenumber);
-					break;
+	header(name);
+	set_params();
+	init_stdin();
+	frame_bytes = bits_per_frame / 8;
+	ring_frames = (off64_t)blackbox_time * hwparams.rate;
+	if (ring_frames < (off64_t)chunk_size) {
+		error(_("black box is shorter than one period"));
+		prg_exit(EXIT_FAILURE);
+	}
 
-				default: // All other codes will be handled by strftime
-					*format++ = '%';
-					*format++ = *pos_userformat;
-					continue;
-			}
+	bfd = open(name, O_RDWR | O_CREAT, 0644);
+	if (bfd < 0) {
+		perror(name);
+		prg_exit(EXIT_FAILURE);
+	}
+	/* reuse the blocks of an earlier box, drop any excess */
+	if (ftruncate(bfd, BLACKBOX_HEADER_SIZE + ring_frames * frame_bytes) < 0) {
+		perror(name);
+		prg_exit(EXIT_FAILURE);
+	}
+	err = posix_fallocate(bfd, 0, BLACKBOX_HEADER_SIZE +
+			      ring_frames * frame_bytes);
+	if (err) {
+		error(_("cannot preallocate %s: %s"), name, strerror(err));
+		prg_exit(EXIT_FAILURE);
+	}
 
-			/* If a format specifier was found and used, copy the result. */
-			if (tempstr[0]) {
-				while ((*format = *tempstr++) != '\0')
-					++format;
-				continue;
-			}
+	memset(&anchors, 0, sizeof(anchors));
+	anchors.size = blackbox_time + 2;
+	anchors.ring = calloc(anchors.size, sizeof(*anchors.ring));
+	if (!anchors.ring) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, BLACKBOX_MAGIC, sizeof(hdr.magic));
+	hdr.header_size = BLACKBOX_HEADER_SIZE;
+	hdr.format = hwparams.format;
+	hdr.channels = hwparams.channels;
+	hdr.rate = hwparams.rate;
+	hdr.data_bytes = ring_frames * frame_bytes;
+	blackbox_write_header(bfd, &hdr);
+	cur_file_name = name;
+	next_sync = 0;
+	offset = 0;
+
+	while (done < count && !in_aborting && control_frames_left() != 0) {
+		size_t n = chunk_size, part;
+
+		if (pcm_read(audiobuf, chunk_size) != (ssize_t)chunk_size ||
+		    in_aborting)
+			break;
+		/* the period may straddle the end of the ring */
+		part = (ring_frames - offset) < (off64_t)n ?
+			(size_t)(ring_frames - offset) : n;
+		if (pwrite(bfd, audiobuf, part * frame_bytes,
+			   BLACKBOX_HEADER_SIZE + offset * frame_bytes) !=
+		    (ssize_t)(part * frame_bytes) ||
+		    (part < n &&
+		     pwrite(bfd, audiobuf + part * frame_bytes,
+			    (n - part) * frame_bytes, BLACKBOX_HEADER_SIZE) !=
+		     (ssize_t)((n - part) * frame_bytes))) {
+			perror(name);
+			in_aborting = 1;
+			failed = 1;
+			break;
 		}
+		offset = (offset + n) % ring_frames;
+		hdr.frames += n;
+		done += chunk_bytes;
+		fdcount = hdr.frames * frame_bytes;
+		if ((off64_t)hdr.frames < next_sync)
+			continue;
+		next_sync = hdr.frames + hwparams.rate;
+		hdr.unsynced = hwparams.rate + chunk_size;
 
-		/* For any other character than % we simply copy the character */
-		*format++ = *pos_userformat;
+		blackbox_sync(bfd, &hdr, &anchors, offset * frame_bytes);
 	}
 
-	*format = '\0';
-	format = formatstring;
-	return strftime(s, max, format, tm);
+	hdr.unsynced = 0;
+	if (hdr.frames)
+		blackbox_sync(bfd, &hdr, &anchors, offset * frame_bytes);
+	if (close(bfd) < 0)
+		perror(name);
+	free(anchors.ring);
+	cur_file_name = NULL;
+	if (failed)
+		prg_exit(EXIT_FAILURE);
 }
 
-static int new_capture_file(char *name, char *namebuf, size_t namelen,
-			    int filecount)
+/*
+ * Parse one end of an extraction range: empty for the box start or end,
+ * "-SECONDS" back from the newest sample, "@EPOCH" or a local
+ * "YYYY-MM-DD HH:MM:SS" (a 'T' works as the separator, too).
+ */
+static int blackbox_parse_time(const char *str, double newest, double *t)
 {
-	char *s;
-	char buf[PATH_MAX-10];
-	time_t t;
-	struct tm *tmp;
+	struct tm tm;
+	char *end;
 
-	if (use_strftime) {
-		t = time(NULL);
-		tmp = localtime(&t);
-		if (tmp == NULL) {
-			perror("localtime");
+	if (!*str)
+		return 1;
+	if (str[0] == '-') {
+		*t = newest - strtod(str + 1, &end);
+	} else if (str[0] == '@') {
+		*t = strtod(str + 1, &end);
+	} else {
+		memset(&tm, 0, sizeof(tm));
+		end = strptime(str, "%Y-%m-%d %H:%M:%S", &tm);
+		if (!end)
+			end = strptime(str, "%Y-%m-%dT%H:%M:%S", &tm);
+		if (!end)
+			return -1;
+		tm.tm_isdst = -1;
+		*t = mktime(&tm);
+	}
+	return *end ? -1 : 0;
+}
+
+static void blackbox_extract(const char *box, const char *out)
+{
+	struct blackbox_header hdr;
+	char range[128], *comma;
+	double oldest, newest, from, to;
+	off64_t ring_frames, stored, skip, start, first, last, pos;
+	size_t frame_bytes, buf_frames;
+	u_char *buf;
+	int bfd, ofd, r;
+
+	bfd = open(box, O_RDONLY);
+	if (bfd < 0) {
+		perror(box);
+		prg_exit(EXIT_FAILURE);
+	}
+	if (pread(bfd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    memcmp(hdr.magic, BLACKBOX_MAGIC, sizeof(hdr.magic)) ||
+	    !hdr.channels || !hdr.rate) {
+		error(_("%s is not a black box file"), box);
+		prg_exit(EXIT_FAILURE);
+	}
+	hwparams.format = hdr.format;
+	hwparams.channels = hdr.channels;
+	hwparams.rate = hdr.rate;
+	frame_bytes = snd_pcm_format_physical_width(hwparams.format) *
+		hwparams.channels / 8;
+	ring_frames = hdr.data_bytes / frame_bytes;
+	stored = (off64_t)hdr.frames < ring_frames ?
+		(off64_t)hdr.frames : ring_frames;
+	oldest = hdr.oldest_sec + hdr.oldest_nsec / 1e9;
+	newest = hdr.newest_sec + hdr.newest_nsec / 1e9;
+	/* the oldest frames may have been overwritten after the last update */
+	skip = stored + (off64_t)hdr.unsynced - ring_frames;
+	if (skip > 0) {
+		if (skip > stored)
+			skip = stored;
+		stored -= skip;
+		oldest += (double)skip / hwparams.rate;
+		if (!quiet_mode)
+			fprintf(stderr, _("%s was not closed cleanly, leaving out "
+					  "%.3f seconds that may be out of order\n"),
+				box, (double)skip / hwparams.rate);
+	}
+
+	from = oldest;
+	to = newest;
+	strncpy(range, blackbox_range, sizeof(range));
+	range[sizeof(range) - 1] = '\0';
+	comma = strchr(range, ',');
+	if (comma)
+		*comma++ = '\0';
+	if (blackbox_parse_time(range, newest, &from) < 0 ||
+	    (comma && blackbox_parse_time(comma, newest, &to) < 0)) {
+		error(_("invalid extraction range '%s'"), blackbox_range);
+		prg_exit(EXIT_FAILURE);
+	}
+
+	/* map times to frames, spreading the measured span over the ring */
+	if (newest > oldest && stored) {
+		first = (from - oldest) * stored / (newest - oldest);
+		last = (to - oldest) * stored / (newest - oldest);
+	} else {
+		first = 0;
+		last = stored;
+	}
+	if (first < 0)
+		first = 0;
+	if (last > stored)
+		last = stored;
+
+	if (!out || !strcmp(out, "-")) {
+		ofd = fileno(stdout);
+		out = "stdout";
+	} else {
+		remove(out);
+		ofd = safe_open(out);
+		if (ofd < 0) {
+			perror(out);
 			prg_exit(EXIT_FAILURE);
 		}
-		if (mystrftime(namebuf, namelen, name, tmp, filecount+1) == 0) {
-			fprintf(stderr, "mystrftime returned 0");
+	}
+	if (!quiet_mode) {
+		fprintf(stderr, _("Black box '%s' : %s, Rate %d Hz, Channels %i\n"),
+			box, snd_pcm_format_description(hwparams.format),
+			hwparams.rate, hwparams.channels);
+		fprintf(stderr, _("Extracting %.3f seconds of %.3f stored\n"),
+			last > first ? (double)(last - first) / hwparams.rate : 0,
+			(double)stored / hwparams.rate);
+	}
+
+	buf_frames = 65536 / frame_bytes + 1;
+	buf = malloc(buf_frames * frame_bytes);
+	if (!buf) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
+	}
+
+	/* the oldest frame sits at the write offset once the ring wrapped */
+	start = hdr.write_offset / frame_bytes - stored;
+	if (start < 0)
+		start += ring_frames;
+	for (pos = first; pos < last; ) {
+		off64_t idx = (start + pos) % ring_frames;
+		off64_t n = last - pos;
+		size_t bytes;
+
+		if (n > ring_frames - idx)
+			n = ring_frames - idx;
+		if (n > (off64_t)buf_frames)
+			n = buf_frames;
+		bytes = n * frame_bytes;
+		r = pread(bfd, buf, bytes, hdr.header_size + idx * frame_bytes);
+		if (r != (ssize_t)bytes) {
+			error(_("read error on %s"), box);
 			prg_exit(EXIT_FAILURE);
 		}
-		return filecount;
+		if ((size_t)xwrite(ofd, buf, bytes) != bytes) {
+			perror(out);
+			prg_exit(EXIT_FAILURE);
+		}
+		pos += n;
 	}
+	if (ofd != fileno(stdout))
+		close(ofd);
+	close(bfd);
+	free(buf);
+}
 
-	/* get a copy of the original filename */
-	strncpy(buf, name, sizeof(buf));
-	buf[sizeof(buf)-1] = '\0';
+/*
+ *  Polyphase channelizer
+ *
+ *  --channelize=M splits the I/Q pair of a wideband capture into M
+ *  channels fs/M apart and writes the ones picked with --channels-out
+ *  to NAME.chK, each as an I/Q pair at fs/M in the capture format.
+ *  Channel K is centred at K * fs / M, the upper half being the
+ *  negative frequencies. Every M input frames the M branches of the
+ *  prototype low pass are folded into one M point FFT, which yields one
+ *  output frame of every channel at once. The output frames of a period
+ *  are shared out among a pool of worker threads.
+ */
 
-	/* separate extension from filename */
-	s = buf + strlen(buf);
-	while (s > buf && *s != '.' && *s != '/')
-		--s;
-	if (*s == '.')
-		*s++ = 0;
-	else if (*s == '/')
-		s = buf + strlen(buf);
+#define CHANNELIZER_TAPS_PER_BRANCH	16
+#define CHANNELIZER_MAX_THREADS		16
 
-	/* upon first jump to this if block rename the first file */
-	if (filecount == 1) {
-		if (*s)
-			snprintf(namebuf, namelen, "%s-01.%s", buf, s);
-		else
-			snprintf(namebuf, namelen, "%s-01", buf);
-		remove(namebuf);
-		rename(name, namebuf);
-		filecount = 2;
-	}
+struct chz_worker {
+	pthread_t thread;
+	unsigned int index;
+	float *re, *im;		/* FFT scratch, M of each */
+};
 
-	/* name of the current file */
-	if (*s)
-		snprintf(namebuf, namelen, "%s-%02i.%s", buf, filecount, s);
-	else
-		snprintf(namebuf, namelen, "%s-%02i", buf, filecount);
+static struct {
+	unsigned int m;
+	unsigned int taps;	/* M * CHANNELIZER_TAPS_PER_BRANCH */
+	float *coef;		/* prototype, each branch reversed */
+	float *hist_re, *hist_im;	/* taps - 1 old frames, then a period */
+	size_t phase;		/* newest frame of the next output */
+	unsigned int nsel;
+	int *sel;		/* channels written */
+	float **out;		/* per selected channel, I/Q interleaved */
+	unsigned int nworkers;
+	struct chz_worker *workers;
+	pthread_mutex_t mutex;
+	pthread_cond_t work, done;
+	unsigned long generation;
+	unsigned int pending;
+	size_t first, nout;	/* this period's output frames */
+	int quit;
+} chz = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
 
-	return filecount;
+static struct fft_plan chz_fft;
+
+/* fill chz.sel from --channels-out, all channels when none was given */
+static int channelize_select(const char *list)
+{
+	char *copy, *tok, *end;
+	long k;
+
+	chz.sel = malloc(chz.m * sizeof(int));
+	if (!chz.sel)
+		return -ENOMEM;
+	chz.nsel = 0;
+	if (!list) {
+		for (k = 0; k < (long)chz.m; k++)
+			chz.sel[chz.nsel++] = k;
+		return 0;
+	}
+	copy = strdup(list);
+	if (!copy)
+		return -ENOMEM;
+	for (tok = strtok(copy, ","); tok; tok = strtok(NULL, ",")) {
+		k = strtol(tok, &end, 0);
+		if (*end || k <= -(long)chz.m || k >= (long)chz.m ||
+		    chz.nsel == chz.m) {
+			error(_("invalid channel '%s' for %u channels"), tok, chz.m);
+			free(copy);
+			return -EINVAL;
+		}
+		chz.sel[chz.nsel++] = k < 0 ? k + chz.m : k;
+	}
+	free(copy);
+	return chz.nsel ? 0 : -EINVAL;
 }
 
-/**
- * create_path
- *
- *   This function creates a file path, like mkdir -p. 
- *
- * Parameters:
- *
- *   path - the path to create
- *
- * Returns: 0 on success, -1 on failure
- * On failure, a message has been printed to stderr.
- */
-int create_path(const char *path)
+/* one output frame of every channel, for the frame ending at hist[t] */
+static void channelize_frame(struct chz_worker *w, size_t t, size_t o)
 {
-	char *start;
-	mode_t mode = S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+	unsigned int m = chz.m, s, p, j;
+	const float *g, *xr, *xi;
+
+	memset(w->re, 0, m * sizeof(float));
+	memset(w->im, 0, m * sizeof(float));
+	for (p = 0; p < CHANNELIZER_TAPS_PER_BRANCH; p++) {
+		g = chz.coef + p * m;
+		xr = chz.hist_re + t + 1 - (p + 1) * m;
+		xi = chz.hist_im + t + 1 - (p + 1) * m;
+		for (s = 0; s < m; s++) {
+			w->re[s] += g[s] * xr[s];
+			w->im[s] += g[s] * xi[s];
+		}
+	}
+	fft_run(&chz_fft, w->re, w->im);
+	for (j = 0; j < chz.nsel; j++) {
+		chz.out[j][o * 2] = w->re[chz.sel[j]];
+		chz.out[j][o * 2 + 1] = w->im[chz.sel[j]];
+	}
+}
 
-	if (path[0] == '/')
-		start = strchr(path + 1, '/');
-	else
-		start = strchr(path, '/');
+static void channelize_slice(struct chz_worker *w)
+{
+	size_t from = chz.nout * w->index / chz.nworkers;
+	size_t to = chz.nout * (w->index + 1) / chz.nworkers, o;
 
-	while (start) {
-		char *buffer = strdup(path);
-		buffer[start-path] = 0x00;
+	for (o = from; o < to; o++)
+		channelize_frame(w, chz.taps - 1 + chz.first + o * chz.m, o);
+}
 
-		if (mkdir(buffer, mode) == -1 && errno != EEXIST) {
-			fprintf(stderr, "Problem creating directory %s", buffer);
-			perror(" ");
-			free(buffer);
-			return -1;
+static void *channelize_worker(void *arg)
+{
+	struct chz_worker *w = arg;
+	unsigned long seen = 0;
+
+	pthread_mutex_lock(&chz.mutex);
+	for (;;) {
+		while (!chz.quit && chz.generation == seen)
+			pthread_cond_wait(&chz.work, &chz.mutex);
+		if (chz.quit)
+			break;
+		seen = chz.generation;
+		pthread_mutex_unlock(&chz.mutex);
+		channelize_slice(w);
+		pthread_mutex_lock(&chz.mutex);
+		if (--chz.pending == 0)
+			pthread_cond_signal(&chz.done);
+	}
+	pthread_mutex_unlock(&chz.mutex);
+	return NULL;
+}
+
+static void channelize_setup(void)
+{
+	unsigned int m = chz.m, taps, n, p, s, i;
+	size_t max_out = chunk_size / m + 1;
+	double fc = 0.5 / m, x, w, sum = 0, *h;
+	long cpus;
+
+	taps = chz.taps = m * CHANNELIZER_TAPS_PER_BRANCH;
+	h = malloc(taps * sizeof(double));
+	chz.coef = malloc(taps * sizeof(float));
+	chz.hist_re = calloc(taps - 1 + chunk_size, sizeof(float));
+	chz.hist_im = calloc(taps - 1 + chunk_size, sizeof(float));
+	chz.out = calloc(chz.nsel, sizeof(float *));
+	if (!h || !chz.coef || !chz.hist_re || !chz.hist_im || !chz.out ||
+	    fft_plan_init(&chz_fft, m) < 0)
+		goto nomem;
+	for (i = 0; i < chz.nsel; i++)
+		if (!(chz.out[i] = malloc(max_out * 2 * sizeof(float))))
+			goto nomem;
+	for (n = 0; n < taps; n++) {
+		x = n - (taps - 1) / 2.0;
+		w = 0.42 - 0.5 * cos(2 * M_PI * n / (taps - 1)) +
+			0.08 * cos(4 * M_PI * n / (taps - 1));	/* Blackman */
+		h[n] = (x == 0 ? 2 * fc : sin(2 * M_PI * fc * x) / (M_PI * x)) * w;
+		sum += h[n];
+	}
+	/* branch p, element s multiplies hist[t + 1 - (p + 1) * M + s] */
+	for (p = 0; p < CHANNELIZER_TAPS_PER_BRANCH; p++)
+		for (s = 0; s < m; s++)
+			chz.coef[p * m + s] = h[(p + 1) * m - 1 - s] / sum;
+	free(h);
+	chz.phase = m - 1;
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	chz.nworkers = cpus < 1 ? 1 : cpus > CHANNELIZER_MAX_THREADS ?
+		CHANNELIZER_MAX_THREADS : cpus;
+	chz.workers = calloc(chz.nworkers, sizeof(*chz.workers));
+	if (!chz.workers)
+		goto nomem;
+	for (i = 0; i < chz.nworkers; i++) {
+		struct chz_worker *wk = &chz.workers[i];
+		wk->index = i;
+		wk->re = malloc(m * sizeof(float));
+		wk->im = malloc(m * sizeof(float));
+		if (!wk->re || !wk->im)
+			goto nomem;
+		if (pthread_create(&wk->thread, NULL, channelize_worker, wk)) {
+			error(_("cannot start the channelizer threads"));
+			prg_exit(EXIT_FAILURE);
 		}
-		free(buffer);
-		start = strchr(start + 1, '/');
 	}
-	return 0;
+	return;
+
+      nomem:
+	error(_("not enough memory"));
+	prg_exit(EXIT_FAILURE);
 }
 
-static int safe_open(const char *name)
+/* run the filter bank over the period in proc.buf */
+static void channelize_period(size_t frames)
 {
-	int fd;
+	size_t keep = chz.taps - 1, i;
 
-	fd = open(name, O_WRONLY | O_CREAT, 0644);
-	if (fd == -1) {
-		if (errno != ENOENT || !use_strftime)
-			return -1;
-		if (create_path(name) == 0)
-			fd = open(name, O_WRONLY | O_CREAT, 0644);
+	for (i = 0; i < frames; i++) {
+		chz.hist_re[keep + i] = proc.buf[i * hwparams.channels];
+		chz.hist_im[keep + i] = proc.buf[i * hwparams.channels + 1];
 	}
-	return fd;
+	chz.first = chz.phase;
+	chz.nout = chz.phase < frames ?
+		(frames - chz.phase + chz.m - 1) / chz.m : 0;
+	chz.phase = chz.phase + chz.nout * chz.m - frames;
+
+	pthread_mutex_lock(&chz.mutex);
+	chz.pending = chz.nworkers;
+	chz.generation++;
+	pthread_cond_broadcast(&chz.work);
+	while (chz.pending)
+		pthread_cond_wait(&chz.done, &chz.mutex);
+	pthread_mutex_unlock(&chz.mutex);
+
+	memmove(chz.hist_re, chz.hist_re + frames, keep * sizeof(float));
+	memmove(chz.hist_im, chz.hist_im + frames, keep * sizeof(float));
 }
 
-static void capture(char *orig_name)
+static void channelize_finish(void)
 {
-	int tostdout=0;		/* boolean which describes output stream */
-	int filecount=0;	/* number of files written */
-	char *name = orig_name;	/* current filename */
-	char namebuf[PATH_MAX+2];
-	off64_t count, rest;		/* number of bytes to capture */
-	struct stat statbuf;
+	unsigned int i;
+
+	pthread_mutex_lock(&chz.mutex);
+	chz.quit = 1;
+	pthread_cond_broadcast(&chz.work);
+	pthread_mutex_unlock(&chz.mutex);
+	for (i = 0; i < chz.nworkers; i++) {
+		if (chz.workers[i].thread)
+			pthread_join(chz.workers[i].thread, NULL);
+		free(chz.workers[i].re);
+		free(chz.workers[i].im);
+	}
+	free(chz.workers);
+	for (i = 0; i < chz.nsel; i++)
+		free(chz.out[i]);
+	free(chz.out);
+	free(chz.sel);
+	free(chz.coef);
+	free(chz.hist_re);
+	free(chz.hist_im);
+	fft_plan_free(&chz_fft);
+}
+
+static void capture_channelized(char *name)
+{
+	size_t sample_bytes, outbytes;
+	off64_t count, done = 0;
+	unsigned int i;
+	char path[PATH_MAX];
+	int *fds, failed = 0;
 
-	/* get number of bytes to capture */
 	count = calc_count();
 	if (count == 0)
 		count = LLONG_MAX;
-	/* compute the number of bytes per file */
-	max_file_size = (long long) max_file_time *
-		snd_pcm_format_size(hwparams.format,
-				    hwparams.rate * hwparams.channels);
-	/* WAVE-file should be even (I'm not sure), but wasting one byte
-	   isn't a problem (this can only be in 8 bit mono) */
-	if (count < LLONG_MAX)
-		count += count % 2;
-	else
-		count -= count % 2;
 
-	/* display verbose output to console */
 	header(name);
-
-	/* setup sound hardware */
 	set_params();
-
-	/* write to stdout? */
-	if (!name || !strcmp(name, "-")) {
-		fd = fileno(stdout);
-		name = "stdout";
-		tostdout = 1;
-	}
 	init_stdin();
+	chz.m = channelize_count;
+	if (hwparams.channels != 2 || !meter_format_ok(hwparams.format)) {
+		error(_("--channelize needs an I/Q pair in an integer or float format"));
+		prg_exit(EXIT_FAILURE);
+	}
+	if (channelize_select(channels_out) < 0) {
+		error(_("invalid --channels-out list"));
+		prg_exit(EXIT_FAILURE);
+	}
+	capture_process_setup();
+	channelize_setup();
 
-	do {
-		/* open a file to write */
-		if (!tostdout) {
-			/* upon the second file we start the numbering scheme */
-			if (filecount || use_strftime) {
-				filecount = new_capture_file(orig_name, namebuf,
-							     sizeof(namebuf),
-							     filecount);
-				name = namebuf;
-			}
-			
-			/* open a new file */
-			if (!lstat(name, &statbuf)) {
-				if (S_ISREG(statbuf.st_mode))
-					remove(name);
-			}
-			fd = safe_open(name);
-			if (fd < 0) {
-				perror(name);
-				prg_exit(EXIT_FAILURE);
-			}
-			filecount++;
+	sample_bytes = snd_pcm_format_physical_width(capture_file_format()) / 8;
+	fds = malloc(chz.nsel * sizeof(int));
+	if (!fds) {
+		error(_("not enough memory"));
+		prg_exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < chz.nsel; i++) {
+		int k = chz.sel[i];
+		if ((size_t)snprintf(path, sizeof(path), "%s.ch%d", name, k) >=
+		    sizeof(path)) {
+			error(_("file name too long: %s"), name);
+			prg_exit(EXIT_FAILURE);
 		}
+		fds[i] = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fds[i] < 0) {
+			perror(path);
+			prg_exit(EXIT_FAILURE);
+		}
+		crc_open(fds[i], path);
+		if (!quiet_mode)
+			fprintf(stderr, _("Channel %d: %+.3f Hz, %.3f Hz wide -> %s\n"),
+				k, (double)hwparams.rate *
+				(k < (int)chz.m / 2 ? k : k - (int)chz.m) / chz.m,
+				(double)hwparams.rate / chz.m, path);
+	}
+	cur_file_name = name;
 
-		rest = count;
-
-		/* capture */
-		fdcount = 0;
-		while (rest > 0 && recycle_capture_file == 0 && !in_aborting) {
-			size_t c = (rest <= (off64_t)chunk_bytes) ?
-				(size_t)rest : chunk_bytes;
-			size_t f = c * 8 / bits_per_frame;
-			size_t read = pcm_read(audiobuf, f);
-			size_t save;
-			if (read != f)
-				in_aborting = 1;
-			save = read * bits_per_frame / 8;
-			if (xwrite(fd, audiobuf, save) != save) {
-				perror(name);
+	while (done < count && !in_aborting) {
+		off64_t left = control_frames_left();
+		size_t f = chunk_size;
+		if (left == 0)
+			break;
+		if (count - done < (off64_t)chunk_bytes)
+			f = (count - done) * 8 / bits_per_frame;
+		if (left > 0 && (off64_t)f > left)
+			f = left;
+		if (f == 0 || pcm_read(audiobuf, f) != (ssize_t)f ||
+		    in_aborting)
+			break;
+		meter_to_float(audiobuf, proc.buf, f * 2, hwparams.format);
+		if (iq_correct)
+			iq_correct_process(proc.buf, f, 2);
+		channelize_period(f);
+		done += f * bits_per_frame / 8;
+		outbytes = chz.nout * 2 * sample_bytes;
+		for (i = 0; i < chz.nsel; i++) {
+			proc.clipped += float_to_format(chz.out[i], proc.out,
+							chz.nout * 2,
+							capture_file_format());
+			if (xwrite(fds[i], proc.out, outbytes) != (ssize_t)outbytes) {
+				snprintf(path, sizeof(path), "%s.ch%d", name,
+					 chz.sel[i]);
+				perror(path);
 				in_aborting = 1;
+				failed = 1;
 				break;
 			}
-			count -= c;
-			rest -= c;
-			fdcount += c;
-		}
-
-		/* re-enable SIGUSR1 signal */
-		if (recycle_capture_file) {
-			recycle_capture_file = 0;
-			signal(SIGUSR1, signal_handler_recycle);
+			crc_update(fds[i], proc.out, outbytes);
 		}
+		fdcount += outbytes * chz.nsel;
+	}
 
-		/* finish sample container */
-		if (!tostdout) {
-			close(fd);
-			fd = -1;
+	for (i = 0; i < chz.nsel; i++) {
+		crc_close(fds[i]);
+		if (close(fds[i]) < 0) {
+			snprintf(path, sizeof(path), "%s.ch%d", name,
+				 chz.sel[i]);
+			perror(path);
+			failed = 1;
 		}
-
-		if (in_aborting)
-			prg_exit(EXIT_FAILURE);
-
-		/* repeat the loop when format is raw without timelimit or
-		 * requested counts of data are recorded
-		 */
-	} while ((!timelimit && !sampleslimit) || count > 0);
+	}
+	free(fds);
+	channelize_finish();
+	if (proc.clipped && !quiet_mode)
+		fprintf(stderr, _("%lu samples clipped in the channel outputs\n"),
+			proc.clipped);
+	cur_file_name = NULL;
+	if (failed)
+		prg_exit(EXIT_FAILURE);
 }
 
 static void playbackv_go(int* fds, unsigned int channels, size_t loaded, off64_t count, char **names)
@@ -2379,16 +9134,21 @@ static void playbackv_go(int* fds, unsigned int channels, size_t loaded, off64_t
 	while (count > 0 && !in_aborting) {
 		size_t c = 0;
 		size_t expected = count / channels;
+		off64_t left = control_frames_left();
+		if (left == 0)
+			break;
 		if (expected > vsize)
 			expected = vsize;
+		if (left > 0 && (off64_t)expected > left * bits_per_sample / 8)
+			expected = left * bits_per_sample / 8;
 		do {
-			r = safe_read(fds[0], bufs[0], expected);
+			r = playback_read(fds[0], bufs[0] + c, expected - c);
 			if (r < 0) {
 				perror(names[0]);
 				prg_exit(EXIT_FAILURE);
 			}
 			for (channel = 1; channel < channels; ++channel) {
-				if (safe_read(fds[channel], bufs[channel], r) != r) {
+				if (playback_read(fds[channel], bufs[channel] + c, r) != r) {
 					perror(names[channel]);
 					prg_exit(EXIT_FAILURE);
 				}
@@ -2421,6 +9181,12 @@ static void capturev_go(int* fds, unsigned int channels, off64_t count, char **n
 
 	header(names[0]);
 	set_params();
+	if (iq_correct || decimate_factor > 1 || channel_delay_count) {
+		error(_("-I does not support --iq-correct, --decimate or "
+			"--channel-delay"));
+		prg_exit(EXIT_FAILURE);
+	}
+	capture_process_setup();
 
 	vsize = chunk_bytes / channels;
 
@@ -2428,23 +9194,32 @@ static void capturev_go(int* fds, unsigned int channels, off64_t count, char **n
 		bufs[channel] = audiobuf + vsize * channel;
 
 	while (count > 0 && !in_aborting) {
-		size_t rv;
+		size_t rv, saved = 0;
+		off64_t left = control_frames_left();
+		if (left == 0)
+			break;
 		c = count;
 		if (c > chunk_bytes)
 			c = chunk_bytes;
+		if (left > 0 && (off64_t)c > left * bits_per_frame / 8)
+			c = left * bits_per_frame / 8;
 		c = c * 8 / bits_per_frame;
 		if ((size_t)(r = pcm_readv(bufs, channels, c)) != c)
 			break;
-		rv = r * bits_per_sample / 8;
 		for (channel = 0; channel < channels; ++channel) {
-			if ((size_t)xwrite(fds[channel], bufs[channel], rv) != rv) {
+			u_char *out = bufs[channel];
+			rv = r * bits_per_sample / 8;
+			if (capture_processing())
+				rv = capture_convert(&out, r, channel);
+			if ((size_t)xwrite(fds[channel], out, rv) != rv) {
 				perror(names[channel]);
 				prg_exit(EXIT_FAILURE);
 			}
+			saved += rv;
 		}
 		r = r * bits_per_frame / 8;
 		count -= r;
-		fdcount += r;
+		fdcount += saved;
 	}
 }
 
@@ -2487,6 +9262,7 @@ static void playbackv(char **names, unsigned int count)
 	init_raw_data();
 	pbrec_count = calc_count();
 	playbackv_go(fds, channels, 0, pbrec_count, names);
+	playback_report();
 
       __end:
 	for (channel = 0; channel < channels; ++channel) {